@@ -2,57 +2,141 @@
 #include <gflags/gflags.h>
 
 #include "hybridfs.h"
+#include "trace.h"
 
 DEFINE_bool(debug, true, "Debug mode");
 DEFINE_string(mount_point, "", "Mount point");
-DEFINE_string(ssd_path, "", "SSD path");
-DEFINE_string(hdd_path, "", "HDD path");
-DEFINE_int64(ssd_upper_limit, 512 * 1024 * 1024, "The upper limit of file size in ssd");
-DEFINE_int64(hdd_lower_limit, 256 * 1024 * 1024, "The lower limit of file size in hdd");
+DEFINE_string(ssd_path, "", "SSD path, comma separated for several devices");
+DEFINE_string(hdd_path, "", "HDD path, comma separated for several devices");
+DEFINE_string(ssd_upper_limit, "512M", "The upper limit of file size in ssd");
+DEFINE_string(hdd_lower_limit, "256M", "The lower limit of file size in hdd");
+DEFINE_string(tier_config, "", "Tier config file, overrides ssd_path and hdd_path");
+DEFINE_string(stripe_unit, "1M", "Chunk size of files striped over hdd devices");
+DEFINE_string(stripe_threshold, "1G", "Files from this size are striped over hdd devices");
+DEFINE_int32(io_threads, 8, "Threads issuing striped backing I/O in parallel");
+DEFINE_string(readahead_min, "128K", "First readahead window of a sequential stream");
+DEFINE_string(readahead_max, "8M", "Largest readahead window of a sequential stream");
+DEFINE_string(mem_cache_size, "64M", "Memory for whole hot small files, 0 disables it");
+DEFINE_string(mem_cache_file_size, "64K", "Largest file kept in memory");
+DEFINE_uint32(mem_cache_admit, 2, "Reads of a file before it is kept in memory");
+DEFINE_string(pack_threshold, "0", "Files up to this size are packed into containers, 0 disables packing");
+DEFINE_string(pack_container_size, "64M", "Size at which a container stops taking new records");
+DEFINE_bool(compress, false, "Compress files demoted to hdd tiers");
+DEFINE_string(compress_block, "64K", "Block size of compressed files");
+DEFINE_int32(compress_level, 1, "zlib level of compressed files");
+DEFINE_string(bg_bandwidth, "64M", "Background migration bytes/s per device, 0 for no limit");
+DEFINE_int64(bg_iops, 200, "Background migration requests/s per device, 0 for no limit");
+DEFINE_double(bg_latency_factor, 2.0, "Foreground latency rise over its average that makes migration back off");
+DEFINE_string(write_buffer, "0", "Per handle buffer coalescing small writes, 0 disables it");
+DEFINE_int64(write_buffer_timeout, 200, "Milliseconds a buffered write may wait before it is written out");
+DEFINE_string(direct_io, "1M", "Hdd requests and readahead from this size, and migration copies, bypass the page cache, 0 disables it");
+DEFINE_string(migrate_chunk, "16M", "Unit background migrations copy in, chunks written during the copy are copied again");
+DEFINE_string(trace, "", "Record every operation to this file for hybridfs_replay and hybridfs_sim");
+DEFINE_int64(dentry_cache, 0, "Dentries kept in memory, least recently used directories are written out and dropped beyond it, 0 keeps all");
+DEFINE_bool(passthrough, false, "Hand backing fds of whole files to the kernel, reads and writes then bypass the daemon (Linux 6.9)");
+DEFINE_string(admit_probe, "64M", "New files written front to back this far are judged on their write rate, 0 disables");
+DEFINE_string(admit_stream_rate, "64M", "Bytes/s over the probe that send a new file below the first tier before it grows there");
+DEFINE_string(dedup_min_size, "0", "Files from this size demoted to hdd tiers share extents with files of the same content already there (needs reflink), 0 disables");
+DEFINE_bool(dedup_verify, true, "Compare the data of files with the same fingerprint before sharing it");
+
+// sizes take K/M/G/T suffixes
+DEFINE_validator(ssd_upper_limit, valid_size);
+DEFINE_validator(hdd_lower_limit, valid_size);
+DEFINE_validator(stripe_unit, valid_size);
+DEFINE_validator(stripe_threshold, valid_size);
+DEFINE_validator(readahead_min, valid_size);
+DEFINE_validator(readahead_max, valid_size);
+DEFINE_validator(mem_cache_size, valid_size);
+DEFINE_validator(mem_cache_file_size, valid_size);
+DEFINE_validator(pack_threshold, valid_size);
+DEFINE_validator(pack_container_size, valid_size);
+DEFINE_validator(compress_block, valid_size);
+DEFINE_validator(bg_bandwidth, valid_size);
+DEFINE_validator(write_buffer, valid_size);
+DEFINE_validator(direct_io, valid_size);
+DEFINE_validator(migrate_chunk, valid_size);
+DEFINE_validator(admit_probe, valid_size);
+DEFINE_validator(admit_stream_rate, valid_size);
+DEFINE_validator(dedup_min_size, valid_size);
 
 static struct fuse_operations hybridfs_operations = {
-  .getattr = HybridFS::hfs_getattr,
-  .readlink = HybridFS::hfs_readlink,
-  .mkdir = HybridFS::hfs_mkdir,
-  .unlink = HybridFS::hfs_unlink,
-  .rmdir = HybridFS::hfs_rmdir,
-  .symlink = HybridFS::hfs_symlink,
-  .rename = HybridFS::hfs_rename,
-  .link = HybridFS::hfs_link,
-  .chmod = HybridFS::hfs_chmod,
-  .chown = HybridFS::hfs_chown,
-  .truncate = HybridFS::hfs_truncate,
-  .open = HybridFS::hfs_open,
-  .read = HybridFS::hfs_read,
-  .write = HybridFS::hfs_write,
-  .flush = HybridFS::hfs_flush,
-  .release = HybridFS::hfs_release,
-  .fsync = HybridFS::hfs_fsync,
-  .setxattr = HybridFS::hfs_setxattr,
-  .getxattr = HybridFS::hfs_getxattr,
-  .listxattr = HybridFS::hfs_listxattr,
-  .removexattr = HybridFS::hfs_removexattr,
-  .readdir = HybridFS::hfs_readdir,
+  .getattr = hfs_traced<TraceOp::GETATTR, HybridFS::hfs_getattr>::call,
+  .readlink = hfs_traced<TraceOp::READLINK, HybridFS::hfs_readlink>::call,
+  .mkdir = hfs_traced<TraceOp::MKDIR, HybridFS::hfs_mkdir>::call,
+  .unlink = hfs_traced<TraceOp::UNLINK, HybridFS::hfs_unlink>::call,
+  .rmdir = hfs_traced<TraceOp::RMDIR, HybridFS::hfs_rmdir>::call,
+  .symlink = hfs_traced<TraceOp::SYMLINK, HybridFS::hfs_symlink>::call,
+  .rename = hfs_traced<TraceOp::RENAME, HybridFS::hfs_rename>::call,
+  .link = hfs_traced<TraceOp::LINK, HybridFS::hfs_link>::call,
+  .chmod = hfs_traced<TraceOp::CHMOD, HybridFS::hfs_chmod>::call,
+  .chown = hfs_traced<TraceOp::CHOWN, HybridFS::hfs_chown>::call,
+  .truncate = hfs_traced<TraceOp::TRUNCATE, HybridFS::hfs_truncate>::call,
+  .open = hfs_traced<TraceOp::OPEN, HybridFS::hfs_open>::call,
+  .read = hfs_traced<TraceOp::READ, HybridFS::hfs_read>::call,
+  .write = hfs_traced<TraceOp::WRITE, HybridFS::hfs_write>::call,
+  .flush = hfs_traced<TraceOp::FLUSH, HybridFS::hfs_flush>::call,
+  .release = hfs_traced<TraceOp::RELEASE, HybridFS::hfs_release>::call,
+  .fsync = hfs_traced<TraceOp::FSYNC, HybridFS::hfs_fsync>::call,
+  .setxattr = hfs_traced<TraceOp::SETXATTR, HybridFS::hfs_setxattr>::call,
+  .getxattr = hfs_traced<TraceOp::GETXATTR, HybridFS::hfs_getxattr>::call,
+  .listxattr = hfs_traced<TraceOp::LISTXATTR, HybridFS::hfs_listxattr>::call,
+  .removexattr = hfs_traced<TraceOp::REMOVEXATTR, HybridFS::hfs_removexattr>::call,
+  .readdir = hfs_traced<TraceOp::READDIR, HybridFS::hfs_readdir>::call,
   .init = HybridFS::hfs_init,
   .destroy = HybridFS::hfs_destroy,
-  .access = HybridFS::hfs_access,
-  .create = HybridFS::hfs_create,
-  .utimens = HybridFS::hfs_utimens,
-  .copy_file_range = HybridFS::hfs_copy_file_range,
-  .lseek = HybridFS::hfs_lseek
+  .access = hfs_traced<TraceOp::ACCESS, HybridFS::hfs_access>::call,
+  .create = hfs_traced<TraceOp::CREATE, HybridFS::hfs_create>::call,
+  .utimens = hfs_traced<TraceOp::UTIMENS, HybridFS::hfs_utimens>::call,
+  .fallocate = hfs_traced<TraceOp::FALLOCATE, HybridFS::hfs_fallocate>::call,
+  .copy_file_range = hfs_traced<TraceOp::COPY_FILE_RANGE, HybridFS::hfs_copy_file_range>::call,
+  .lseek = hfs_traced<TraceOp::LSEEK, HybridFS::hfs_lseek>::call
 };
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  struct hfs_meta* meta = new hfs_meta{
-    FLAGS_mount_point,
-    FLAGS_ssd_path,
-    FLAGS_hdd_path,
-    FLAGS_ssd_upper_limit,
-    FLAGS_hdd_lower_limit,
-    nullptr
-  };
+  struct hfs_meta* meta = new hfs_meta();
+  meta->fs_path = FLAGS_mount_point;
+  meta->root_dentry = nullptr;
+  meta->stripe_unit = size_value(FLAGS_stripe_unit);
+  meta->stripe_threshold = size_value(FLAGS_stripe_threshold);
+  meta->io_pool_threads = FLAGS_io_threads;
+  meta->readahead_min = size_value(FLAGS_readahead_min);
+  meta->readahead_max = size_value(FLAGS_readahead_max);
+  meta->mem_cache_size = size_value(FLAGS_mem_cache_size);
+  meta->mem_cache_file_size = size_value(FLAGS_mem_cache_file_size);
+  meta->mem_cache_admit = FLAGS_mem_cache_admit;
+  meta->pack_threshold = size_value(FLAGS_pack_threshold);
+  meta->pack_container_size = size_value(FLAGS_pack_container_size);
+  meta->compress = FLAGS_compress;
+  meta->compress_block = size_value(FLAGS_compress_block);
+  meta->compress_level = FLAGS_compress_level;
+  meta->bg_bandwidth = size_value(FLAGS_bg_bandwidth);
+  meta->bg_iops = FLAGS_bg_iops;
+  meta->bg_latency_factor = FLAGS_bg_latency_factor;
+  meta->write_buffer_size = size_value(FLAGS_write_buffer);
+  meta->write_buffer_timeout = FLAGS_write_buffer_timeout;
+  meta->direct_io_size = size_value(FLAGS_direct_io);
+  meta->migrate_chunk = size_value(FLAGS_migrate_chunk);
+  meta->trace_path = FLAGS_trace;
+  meta->dir_cache_size = FLAGS_dentry_cache;
+  meta->passthrough = FLAGS_passthrough;
+  meta->admit_probe = size_value(FLAGS_admit_probe);
+  meta->admit_stream_rate = size_value(FLAGS_admit_stream_rate);
+  meta->dedup_min_size = size_value(FLAGS_dedup_min_size);
+  meta->dedup_verify = FLAGS_dedup_verify;
+  if(!FLAGS_tier_config.empty()) {
+    if(!load_tier_config(FLAGS_tier_config, meta->tiers)) {
+      return 1;
+    }
+  } else {
+    // classic two tier layout
+    meta->tiers.push_back(new_tier("ssd", FLAGS_ssd_path, TierClass::SSD, 0, size_value(FLAGS_ssd_upper_limit), -1));
+    meta->tiers.push_back(new_tier("hdd", FLAGS_hdd_path, TierClass::HDD, 0, INT64_MAX, size_value(FLAGS_hdd_lower_limit)));
+    if(meta->tiers[0] == nullptr || meta->tiers[1] == nullptr) {
+      return 1;
+    }
+  }
 
   char mount_point[256];
   memset(mount_point, 0, 256);
@@ -0,0 +1,251 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "trace.h"
+
+DEFINE_string(trace, "", "Trace recorded by hybridfs --trace");
+DEFINE_string(mount_point, "", "Where to replay the trace, usually a fresh hybridfs mount");
+DEFINE_double(speed, 1.0, "Replay speed relative to the recording, 0 replays as fast as possible");
+
+// Replays a trace against a mounted file system with the recorded offsets
+// and sizes. Data written is zeros, symbolic links point nowhere, and files
+// that existed before the recording started are left out.
+struct replay_state {
+  std::unordered_map<uint64_t, std::string> paths;    // oid -> path under the mount point
+  std::unordered_map<uint64_t, std::string> named;    // oid -> path of the next operation on it
+  std::unordered_map<uint64_t, int> fds;
+  std::vector<char> buf;
+};
+
+struct replay_stat {
+  int64_t count = 0;
+  int64_t recorded_us = 0;
+  int64_t replayed_us = 0;
+};
+
+static int file_fd(struct replay_state& st, uint64_t oid) {
+  auto it = st.fds.find(oid);
+  if(it != st.fds.end()) {
+    return it->second;
+  }
+  int fd = open(st.paths[oid].c_str(), O_RDWR);
+  if(fd != -1) {
+    st.fds[oid] = fd;
+  }
+  return fd;
+}
+
+static void close_file(struct replay_state& st, uint64_t oid) {
+  auto it = st.fds.find(oid);
+  if(it != st.fds.end()) {
+    close(it->second);
+    st.fds.erase(it);
+  }
+}
+
+static char* buffer(struct replay_state& st, int64_t size) {
+  if((int64_t)st.buf.size() < size) {
+    st.buf.resize(size);
+  }
+  return st.buf.data();
+}
+
+// Runs one record, false if it could not be replayed.
+static bool replay(struct replay_state& st, const struct hfs_trace_record& r) {
+  if(r.op == TraceOp::NAME) {
+    return true;
+  }
+  std::string named;
+  auto name_it = st.named.find(r.oid);
+  if(name_it != st.named.end()) {
+    named = name_it->second;
+    st.named.erase(name_it);
+  }
+  auto path_it = st.paths.find(r.oid);
+  if(path_it == st.paths.end() && named.empty()) {
+    return false;
+  }
+  const std::string& path = path_it != st.paths.end() ? path_it->second : named;
+  switch(r.op) {
+    case TraceOp::MKDIR:
+      mkdir(named.c_str(), 0755);
+      st.paths[r.oid] = named;
+      break;
+    case TraceOp::SYMLINK:
+      symlink("hybridfs_replay", named.c_str());
+      st.paths[r.oid] = named;
+      break;
+    case TraceOp::CREATE:
+    case TraceOp::OPEN: {
+      int flags = r.op == TraceOp::CREATE ? O_CREAT | O_TRUNC : (int)r.off & (O_CREAT | O_TRUNC);
+      if(!named.empty()) {
+        st.paths[r.oid] = named;
+        flags |= O_CREAT;
+      }
+      if((flags & O_TRUNC) != 0 || st.fds.count(r.oid) == 0) {
+        close_file(st, r.oid);
+        int fd = open(path.c_str(), O_RDWR | flags, 0644);
+        if(fd == -1) {
+          return false;
+        }
+        st.fds[r.oid] = fd;
+      }
+      break;
+    }
+    case TraceOp::RENAME:
+      if(named.empty() || path_it == st.paths.end()) {
+        return false;
+      }
+      rename(path_it->second.c_str(), named.c_str());
+      st.paths[r.oid] = named;
+      break;
+    case TraceOp::LINK: {
+      auto old_it = st.paths.find(r.off);
+      if(named.empty() || old_it == st.paths.end()) {
+        return false;
+      }
+      link(old_it->second.c_str(), named.c_str());
+      st.paths[r.oid] = named;
+      break;
+    }
+    case TraceOp::UNLINK:
+      close_file(st, r.oid);
+      unlink(path.c_str());
+      st.paths.erase(r.oid);
+      break;
+    case TraceOp::RMDIR:
+      rmdir(path.c_str());
+      st.paths.erase(r.oid);
+      break;
+    case TraceOp::WRITE: {
+      int fd = file_fd(st, r.oid);
+      if(fd == -1 || pwrite(fd, buffer(st, r.result), r.result, r.off) == -1) {
+        return false;
+      }
+      break;
+    }
+    case TraceOp::READ: {
+      int fd = file_fd(st, r.oid);
+      if(fd == -1 || pread(fd, buffer(st, r.size), r.size, r.off) == -1) {
+        return false;
+      }
+      break;
+    }
+    case TraceOp::COPY_FILE_RANGE: {
+      // the source is not recorded, write what it produced
+      int fd = file_fd(st, r.oid);
+      if(fd == -1 || pwrite(fd, buffer(st, r.result), r.result, r.off) == -1) {
+        return false;
+      }
+      break;
+    }
+    case TraceOp::TRUNCATE:
+      if(truncate(path.c_str(), r.off) == -1) {
+        return false;
+      }
+      break;
+    case TraceOp::FALLOCATE: {
+      int fd = file_fd(st, r.oid);
+      if(fd == -1 || fallocate(fd, 0, r.off, r.size) == -1) {
+        return false;
+      }
+      break;
+    }
+    case TraceOp::FSYNC: {
+      int fd = file_fd(st, r.oid);
+      if(fd == -1 || fsync(fd) == -1) {
+        return false;
+      }
+      break;
+    }
+    case TraceOp::RELEASE:
+      close_file(st, r.oid);
+      break;
+    case TraceOp::GETATTR:
+    case TraceOp::ACCESS: {
+      struct stat sb;
+      if(lstat(path.c_str(), &sb) == -1) {
+        return false;
+      }
+      break;
+    }
+    case TraceOp::READDIR: {
+      DIR* dir = opendir(path.c_str());
+      if(dir == nullptr) {
+        return false;
+      }
+      while(readdir(dir) != nullptr) {
+      }
+      closedir(dir);
+      break;
+    }
+    default:
+      // attributes, xattrs and internal work
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  std::vector<struct hfs_trace_record> records;
+  std::vector<std::string> names;
+  if(!trace_load(FLAGS_trace, records, names)) {
+    return 1;
+  }
+  std::string root = FLAGS_mount_point;
+  while(!root.empty() && root.back() == '/') {
+    root.pop_back();
+  }
+  struct replay_state st;
+  struct replay_stat stats[(size_t)TraceOp::COUNT];
+  int64_t skipped = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < records.size(); i++) {
+    const struct hfs_trace_record& r = records[i];
+    if(r.op == TraceOp::NAME) {
+      st.named[r.oid] = root + names[i];
+      continue;
+    }
+    if(r.op >= TraceOp::COUNT || r.oid == 0 || r.result < 0) {
+      skipped++;
+      continue;
+    }
+    if(FLAGS_speed > 0) {
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds((int64_t)(r.time_ns / FLAGS_speed)));
+    }
+    auto op_start = std::chrono::steady_clock::now();
+    if(!replay(st, r)) {
+      skipped++;
+      continue;
+    }
+    struct replay_stat& stat = stats[(size_t)r.op];
+    stat.count++;
+    stat.recorded_us += r.latency_us;
+    stat.replayed_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - op_start).count();
+  }
+  for(auto& it : st.fds) {
+    close(it.second);
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-16s %10s %14s %14s\n", "op", "count", "recorded us", "replayed us");
+  for(size_t op = 0; op < (size_t)TraceOp::COUNT; op++) {
+    if(stats[op].count == 0) {
+      continue;
+    }
+    printf("%-16s %10ld %14.1f %14.1f\n", trace_op_name((TraceOp)op), stats[op].count,
+           (double)stats[op].recorded_us / stats[op].count, (double)stats[op].replayed_us / stats[op].count);
+  }
+  printf("skipped %ld records, replayed in %.3f s\n", skipped, elapsed);
+  return 0;
+}
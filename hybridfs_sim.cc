@@ -0,0 +1,206 @@
+#include <fcntl.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "tier.h"
+#include "trace.h"
+
+DEFINE_string(trace, "", "Trace recorded by hybridfs --trace");
+DEFINE_string(tier_config, "", "Tier config to simulate, overrides the ssd and hdd flags");
+DEFINE_string(ssd_upper_limit, "512M", "The upper limit of file size in ssd");
+DEFINE_string(hdd_lower_limit, "256M", "The lower limit of file size in hdd");
+DEFINE_string(ssd_capacity, "0", "Bytes the ssd tier holds, 0 for no limit");
+
+// sizes take K/M/G/T suffixes
+DEFINE_validator(ssd_upper_limit, valid_size);
+DEFINE_validator(hdd_lower_limit, valid_size);
+DEFINE_validator(ssd_capacity, valid_size);
+
+// Replays the size changes of a trace against a tier configuration, without
+// any I/O, to see where files would have lived. Placement mirrors
+// tier_for_new_file and tier_for_size with tier capacities standing in for
+// device free space. Pins, preferences, admission of new files, packing and
+// the memory cache are not modelled.
+struct sim_file {
+  int64_t size = 0;
+  int64_t alloc = 0;
+  int32_t tier = 0;
+};
+
+struct sim_stat {
+  int64_t ops = 0;
+  int64_t bytes = 0;
+  int64_t fast_ops = 0;     // served by the first tier
+  int64_t fast_bytes = 0;
+};
+
+// Tiers are only counted here, no device backs them.
+static struct hfs_tier* sim_tier(const std::string& name, TierClass tclass, int64_t capacity,
+                                 int64_t upper_limit, int64_t lower_limit) {
+  return new hfs_tier{name, {}, tclass, capacity, upper_limit, lower_limit, {0}};
+}
+
+static bool sim_has_space(const struct hfs_tier* tier, int64_t size) {
+  return tier->capacity <= 0 || tier->used.load() + size <= tier->capacity;
+}
+
+static int32_t sim_for_new_file(const std::vector<struct hfs_tier*>& tiers, int64_t size) {
+  for(size_t i = 0; i + 1 < tiers.size(); i++) {
+    if(size < tiers[i]->upper_limit && sim_has_space(tiers[i], size)) {
+      return i;
+    }
+  }
+  return tiers.size() - 1;
+}
+
+static int32_t sim_for_size(const std::vector<struct hfs_tier*>& tiers, int32_t cur, int64_t size) {
+  if(cur + 1 < (int32_t)tiers.size() && size >= tiers[cur]->upper_limit && sim_has_space(tiers[cur + 1], size)) {
+    return cur + 1;
+  }
+  if(cur > 0 && size <= tiers[cur]->lower_limit && sim_has_space(tiers[cur - 1], size)) {
+    return cur - 1;
+  }
+  return cur;
+}
+
+int main(int argc, char *argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  std::vector<struct hfs_trace_record> records;
+  std::vector<std::string> names;
+  if(!trace_load(FLAGS_trace, records, names)) {
+    return 1;
+  }
+  std::vector<struct hfs_tier*> tiers;
+  if(!FLAGS_tier_config.empty()) {
+    if(!load_tier_config(FLAGS_tier_config, tiers)) {
+      return 1;
+    }
+  } else {
+    tiers.push_back(sim_tier("ssd", TierClass::SSD, size_value(FLAGS_ssd_capacity), size_value(FLAGS_ssd_upper_limit), -1));
+    tiers.push_back(sim_tier("hdd", TierClass::HDD, 0, INT64_MAX, size_value(FLAGS_hdd_lower_limit)));
+  }
+  for(struct hfs_tier* tier : tiers) {
+    tier->used = 0;
+  }
+
+  std::unordered_map<uint64_t, struct sim_file> files;
+  std::unordered_map<uint64_t, uint64_t> links;   // hard link oid -> oid holding the data
+  std::unordered_set<uint64_t> created;           // named during the recording
+  struct sim_stat recorded, simulated;
+  int64_t migrations = 0, migrated_bytes = 0;
+  int64_t live_migrations = 0, live_migrated_bytes = 0;
+
+  auto resize = [&](struct sim_file& file, int64_t size, int64_t alloc) {
+    tiers[file.tier]->used += size - file.size;
+    file.size = size;
+    file.alloc = alloc;
+    int32_t target = sim_for_size(tiers, file.tier, std::max(size, alloc));
+    if(target != file.tier) {
+      migrations++;
+      migrated_bytes += size;
+      tiers[file.tier]->used -= size;
+      tiers[target]->used += size;
+      file.tier = target;
+    }
+  };
+
+  for(const struct hfs_trace_record& r : records) {
+    if(r.op == TraceOp::MIGRATE) {
+      live_migrations++;
+      live_migrated_bytes += r.size;
+      continue;
+    }
+    if(r.oid == 0 || (r.op != TraceOp::NAME && r.result < 0)) {
+      continue;
+    }
+    auto link_it = links.find(r.oid);
+    uint64_t oid = link_it != links.end() ? link_it->second : r.oid;
+    auto it = files.find(oid);
+    switch(r.op) {
+      case TraceOp::NAME:
+        created.insert(r.oid);
+        break;
+      case TraceOp::CREATE:
+      case TraceOp::OPEN:
+        if(it == files.end()) {
+          struct sim_file file;
+          // files from before the recording start where the trace saw them
+          bool known = created.count(oid) == 0 && r.tier >= 0 && r.tier < (int32_t)tiers.size();
+          file.tier = known ? r.tier : sim_for_new_file(tiers, 0);
+          it = files.emplace(oid, file).first;
+        }
+        if(r.op == TraceOp::CREATE || (r.off & O_TRUNC) != 0) {
+          resize(it->second, 0, 0);
+        }
+        break;
+      case TraceOp::LINK:
+        links[r.oid] = links.count(r.off) != 0 ? links[r.off] : r.off;
+        break;
+      case TraceOp::UNLINK:
+        if(link_it != links.end()) {
+          links.erase(link_it);
+        } else if(it != files.end()) {
+          tiers[it->second.tier]->used -= it->second.size;
+          files.erase(it);
+        }
+        break;
+      case TraceOp::TRUNCATE:
+        if(it != files.end()) {
+          resize(it->second, r.off, std::min(it->second.alloc, (int64_t)r.off));
+        }
+        break;
+      case TraceOp::FALLOCATE:
+        if(it != files.end()) {
+          resize(it->second, it->second.size, std::max(it->second.alloc, r.off + r.size));
+        }
+        break;
+      case TraceOp::READ:
+      case TraceOp::WRITE:
+      case TraceOp::COPY_FILE_RANGE: {
+        int64_t bytes = r.result;
+        recorded.ops++;
+        recorded.bytes += bytes;
+        if(r.tier == 0) {
+          recorded.fast_ops++;
+          recorded.fast_bytes += bytes;
+        }
+        if(it == files.end()) {
+          break;
+        }
+        simulated.ops++;
+        simulated.bytes += bytes;
+        if(it->second.tier == 0) {
+          simulated.fast_ops++;
+          simulated.fast_bytes += bytes;
+        }
+        if(r.op != TraceOp::READ && r.off + bytes > it->second.size) {
+          resize(it->second, r.off + bytes, it->second.alloc);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  auto ratio = [](int64_t part, int64_t whole) { return whole == 0 ? 0.0 : 100.0 * part / whole; };
+  printf("tiers:");
+  for(struct hfs_tier* tier : tiers) {
+    printf(" %s(%s)", tier->name.c_str(), tier_class_name(tier->tclass));
+  }
+  printf("\n");
+  printf("%-10s %12s %10s %16s %10s\n", "", "data ops", "fast %", "data bytes", "fast %");
+  printf("%-10s %12ld %9.2f%% %16ld %9.2f%%\n", "recorded", recorded.ops, ratio(recorded.fast_ops, recorded.ops),
+         recorded.bytes, ratio(recorded.fast_bytes, recorded.bytes));
+  printf("%-10s %12ld %9.2f%% %16ld %9.2f%%\n", "simulated", simulated.ops, ratio(simulated.fast_ops, simulated.ops),
+         simulated.bytes, ratio(simulated.fast_bytes, simulated.bytes));
+  printf("migrations: recorded %ld (%ld bytes), simulated %ld (%ld bytes)\n", live_migrations, live_migrated_bytes,
+         migrations, migrated_bytes);
+  return 0;
+}
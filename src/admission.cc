@@ -0,0 +1,119 @@
+#include <cctype>
+
+#include <spdlog/spdlog.h>
+
+#include "admission.h"
+
+// Files of a directory or extension seen before its history counts.
+static constexpr uint32_t ADMIT_MIN_FILES = 4;
+// History kept, forgotten all at once beyond it.
+static constexpr size_t ADMIT_MAX_KEYS = 65536;
+
+struct hfs_admission* admission_new(int64_t large_size, int64_t probe, int64_t stream_rate) {
+  struct hfs_admission* adm = new hfs_admission();
+  adm->large_size = large_size;
+  adm->probe = probe;
+  adm->stream_rate = stream_rate;
+  adm->expected = 0;
+  adm->redirected = 0;
+  return adm;
+}
+
+void admission_free(struct hfs_admission* adm) {
+  spdlog::info("[admission] expected large: {}, redirected streams: {}", adm->expected.load(), adm->redirected.load());
+  delete adm;
+}
+
+// Lower case extension of name, empty when it has none worth telling apart.
+static std::string extension(const std::string& name) {
+  size_t dot = name.rfind('.');
+  if(dot == std::string::npos || dot == 0 || name.size() - dot > 8) {
+    return "";
+  }
+  std::string ext = name.substr(dot + 1);
+  for(char& c : ext) {
+    c = tolower((unsigned char)c);
+  }
+  return ext;
+}
+
+static bool mostly_large(const struct hfs_admit_stat& stat) {
+  return stat.large * 4 >= stat.files * 3;
+}
+
+int64_t admission_expect(struct hfs_admission* adm, uint64_t dir_oid, const std::string& name) {
+  if(adm->large_size == 0) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(adm->lock);
+  bool large = false;
+  auto dir_it = adm->dirs.find(dir_oid);
+  if(dir_it != adm->dirs.end() && dir_it->second.files >= ADMIT_MIN_FILES) {
+    // the directory knows best, a backup target holds backups whatever their names
+    large = mostly_large(dir_it->second);
+  } else {
+    std::string ext = extension(name);
+    auto ext_it = adm->exts.find(ext);
+    large = !ext.empty() && ext_it != adm->exts.end() && ext_it->second.files >= ADMIT_MIN_FILES &&
+            mostly_large(ext_it->second);
+  }
+  if(!large) {
+    return 0;
+  }
+  adm->expected++;
+  return adm->large_size;
+}
+
+static void count(struct hfs_admit_stat& stat, bool large) {
+  if(stat.files == UINT32_MAX / 4) {
+    // keep following changes of habit
+    stat.files /= 2;
+    stat.large /= 2;
+  }
+  stat.files++;
+  stat.large += large;
+}
+
+void admission_record(struct hfs_admission* adm, uint64_t dir_oid, const std::string& name, int64_t size) {
+  if(adm->large_size == 0) {
+    return ;
+  }
+  bool large = size >= adm->large_size;
+  std::string ext = extension(name);
+  std::lock_guard<std::mutex> lock(adm->lock);
+  if(adm->dirs.size() >= ADMIT_MAX_KEYS) {
+    adm->dirs.clear();
+  }
+  count(adm->dirs[dir_oid], large);
+  if(!ext.empty()) {
+    if(adm->exts.size() >= ADMIT_MAX_KEYS) {
+      adm->exts.clear();
+    }
+    count(adm->exts[ext], large);
+  }
+}
+
+void admission_start(const struct hfs_admission* adm, struct hfs_admit_probe* probe) {
+  probe->active = adm->large_size > 0 && adm->probe > 0;
+  probe->end = 0;
+  probe->start = std::chrono::steady_clock::now();
+}
+
+bool admission_probe(struct hfs_admission* adm, struct hfs_admit_probe* probe, off_t off, size_t size) {
+  if(off != probe->end) {
+    // not written front to back
+    probe->active = false;
+    return false;
+  }
+  probe->end += size;
+  if(probe->end < adm->probe) {
+    return false;
+  }
+  probe->active = false;
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - probe->start).count();
+  if(elapsed > 0 && probe->end / elapsed < adm->stream_rate) {
+    return false;
+  }
+  adm->redirected++;
+  return true;
+}
@@ -0,0 +1,53 @@
+#ifndef _HYBRIDFS_ADMISSION_H
+#define _HYBRIDFS_ADMISSION_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Where new files start. A file is expected to grow large when most earlier
+// files of its directory, or failing that of its extension, did, or when its
+// creator streams the first bytes in fast. Expected files are placed as if
+// that large and need no second copy once they are.
+struct hfs_admit_stat {
+  uint32_t files = 0;
+  uint32_t large = 0;
+};
+
+struct hfs_admission {
+  int64_t large_size;     // size from which files belong below the first tier, 0 disables
+  int64_t probe;          // sequential bytes from the start a new file is judged on, 0 disables
+  int64_t stream_rate;    // bytes/s over the probe that make it a stream
+  std::mutex lock;
+  std::unordered_map<uint64_t, struct hfs_admit_stat> dirs;     // by directory oid
+  std::unordered_map<std::string, struct hfs_admit_stat> exts;
+  // stats
+  std::atomic<uint64_t> expected;
+  std::atomic<uint64_t> redirected;
+};
+
+// How the creator of a new file writes it, kept in the handle.
+struct hfs_admit_probe {
+  bool active = false;
+  int64_t end = 0;
+  std::chrono::steady_clock::time_point start;
+};
+
+struct hfs_admission* admission_new(int64_t large_size, int64_t probe, int64_t stream_rate);
+void admission_free(struct hfs_admission* adm);
+
+// Size a new file called name in directory dir_oid is expected to reach,
+// 0 when nothing speaks for a large file.
+int64_t admission_expect(struct hfs_admission* adm, uint64_t dir_oid, const std::string& name);
+// Learns from the size a new file had when its creator closed it.
+void admission_record(struct hfs_admission* adm, uint64_t dir_oid, const std::string& name, int64_t size);
+
+void admission_start(const struct hfs_admission* adm, struct hfs_admit_probe* probe);
+// Feeds a write of the creator, true once it shows a stream, then never again.
+bool admission_probe(struct hfs_admission* adm, struct hfs_admit_probe* probe, off_t off, size_t size);
+
+#endif
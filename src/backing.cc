@@ -0,0 +1,724 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "backing.h"
+#include "compress.h"
+#include "direct_io.h"
+#include "pack.h"
+#include "scheduler.h"
+
+struct hfs_place dentry_place(const struct hfs_dentry* dentry) {
+  if(dentry->d_type == FileType::DIRECTORY) {
+    return hfs_place{0, 0, FileLayout::WHOLE, 1};
+  }
+  if(dentry->d_layout == FileLayout::PACKED) {
+    // writes move the record with the packer locked
+    std::lock_guard<std::mutex> lock(HFS_META->packer->lock);
+    return hfs_place{dentry->d_area, dentry->d_dev, dentry->d_layout, dentry->d_width, dentry->d_pack_id, dentry->d_pack_off};
+  }
+  return hfs_place{dentry->d_area, dentry->d_dev, dentry->d_layout, dentry->d_width, dentry->d_pack_id, dentry->d_pack_off, std::atomic_load(&dentry->d_cindex)};
+}
+
+struct hfs_place choose_place(int32_t area, int64_t size) {
+  struct hfs_tier* tier = HFS_META->tiers[area];
+  struct hfs_place place{area, 0, FileLayout::WHOLE, 1};
+  int32_t ndev = tier->devices.size();
+  if(tier->tclass == TierClass::HDD && ndev > 1 && size >= HFS_META->stripe_threshold) {
+    place.layout = FileLayout::STRIPED;
+    place.width = ndev;
+    size /= ndev;
+  } else if(tier->tclass == TierClass::HDD && HFS_META->compress) {
+    place.layout = FileLayout::COMPRESSED;
+  }
+  int32_t dev = tier_pick_device(tier, size);
+  place.dev = dev == -1 ? 0 : dev;
+  return place;
+}
+
+// Fan-out directories per level.
+static constexpr uint64_t OBJECT_FANOUT = 64;
+
+static uint64_t mix_oid(uint64_t oid) {
+  // splitmix64 finalizer, spreads consecutive ids over the fan-out
+  oid = (oid ^ (oid >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  oid = (oid ^ (oid >> 27)) * 0x94d049bb133111ebULL;
+  return oid ^ (oid >> 31);
+}
+
+static std::string fanout_name(uint64_t n) {
+  char name[3];
+  snprintf(name, sizeof(name), "%02x", (unsigned)n);
+  return name;
+}
+
+std::string object_path(uint64_t oid) {
+  uint64_t h = mix_oid(oid);
+  char name[17];
+  snprintf(name, sizeof(name), "%016lx", (unsigned long)oid);
+  return "/" HFS_INTERNAL_DIR "/obj/" + fanout_name(h % OBJECT_FANOUT) + "/" + fanout_name(h / OBJECT_FANOUT % OBJECT_FANOUT) + "/" + name;
+}
+
+int backing_make_objects(const std::string& root) {
+  std::string base = root + "/" HFS_INTERNAL_DIR "/obj";
+  if(mkdir(base.c_str(), 0755) != 0 && errno != EEXIST) {
+    return -errno;
+  }
+  for(uint64_t i = 0; i < OBJECT_FANOUT; i++) {
+    std::string dir = base + "/" + fanout_name(i);
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return -errno;
+    }
+    for(uint64_t j = 0; j < OBJECT_FANOUT; j++) {
+      if(mkdir((dir + "/" + fanout_name(j)).c_str(), 0755) != 0 && errno != EEXIST) {
+        return -errno;
+      }
+    }
+  }
+  return 0;
+}
+
+int backing_open_dirs(struct hfs_device* dev) {
+  dev->root_fd = open(dev->path.c_str(), O_PATH | O_DIRECTORY);
+  if(dev->root_fd == -1) {
+    return -errno;
+  }
+  dev->tmp_fd = openat(dev->root_fd, HFS_INTERNAL_DIR "/tmp", O_PATH | O_DIRECTORY);
+  if(dev->tmp_fd == -1) {
+    int open_errno = errno;
+    backing_close_dirs(dev);
+    return -open_errno;
+  }
+  for(uint64_t i = 0; i < OBJECT_FANOUT; i++) {
+    std::string dir = HFS_INTERNAL_DIR "/obj/" + fanout_name(i);
+    int fd = openat(dev->root_fd, dir.c_str(), O_PATH | O_DIRECTORY);
+    if(fd == -1) {
+      int open_errno = errno;
+      backing_close_dirs(dev);
+      return -open_errno;
+    }
+    dev->obj_fds.push_back(fd);
+  }
+  return 0;
+}
+
+void backing_close_dirs(struct hfs_device* dev) {
+  for(int fd : dev->obj_fds) {
+    close(fd);
+  }
+  dev->obj_fds.clear();
+  if(dev->tmp_fd != -1) {
+    close(dev->tmp_fd);
+    dev->tmp_fd = -1;
+  }
+  if(dev->root_fd != -1) {
+    close(dev->root_fd);
+    dev->root_fd = -1;
+  }
+}
+
+int backing_dirfd(const struct hfs_place& place, int32_t piece, const std::string& path, const char*& name) {
+  static const std::string obj_prefix = "/" HFS_INTERNAL_DIR "/obj/";
+  static const std::string tmp_prefix = "/" HFS_INTERNAL_DIR "/tmp/";
+  struct hfs_device* dev = piece_device(place, piece);
+  if(path.compare(0, obj_prefix.size(), obj_prefix) == 0 && path.size() > obj_prefix.size() + 3 && !dev->obj_fds.empty()) {
+    // <xx>/<yy>/<oid>, from the <xx> directory
+    auto hex = [](char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+    uint64_t first = hex(path[obj_prefix.size()]) * 16 + hex(path[obj_prefix.size() + 1]);
+    name = path.c_str() + obj_prefix.size() + 3;
+    return dev->obj_fds[first % OBJECT_FANOUT];
+  }
+  if(path.compare(0, tmp_prefix.size(), tmp_prefix) == 0 && dev->tmp_fd != -1) {
+    name = path.c_str() + tmp_prefix.size();
+    return dev->tmp_fd;
+  }
+  name = path.c_str() + (path[0] == '/' ? 1 : 0);
+  return dev->root_fd;
+}
+
+int32_t piece_count(const struct hfs_place& place) {
+  return place.layout == FileLayout::STRIPED ? place.width : 1;
+}
+
+struct hfs_device* piece_device(const struct hfs_place& place, int32_t piece) {
+  std::vector<struct hfs_device*>& devices = HFS_META->tiers[place.area]->devices;
+  return devices[(place.dev + piece) % devices.size()];
+}
+
+int backing_open(const struct hfs_place& place, const std::string& path, int flags, mode_t mode, std::vector<int>& fds) {
+  fds.clear();
+  if(place.layout == FileLayout::PACKED) {
+    // records are read through the container, empty files have none
+    if(place.pack_id == 0) {
+      return 0;
+    }
+    int fd = pack_dup(HFS_META->packer, place.pack_id);
+    if(fd < 0) {
+      return fd;
+    }
+    fds.push_back(fd);
+    return 0;
+  }
+  for(int32_t i = 0; i < piece_count(place); i++) {
+    const char *name;
+    int dirfd = backing_dirfd(place, i, path, name);
+    int fd = openat(dirfd, name, flags & ~O_APPEND, mode);
+    if(fd == -1) {
+      int open_errno = errno;
+      backing_close(fds);
+      return -open_errno;
+    }
+    fds.push_back(fd);
+  }
+  return 0;
+}
+
+void backing_close(std::vector<int>& fds) {
+  for(int fd : fds) {
+    close(fd);
+  }
+  fds.clear();
+}
+
+// One contiguous range inside a backing piece.
+struct piece_io {
+  off_t piece_off;
+  size_t buf_off;
+  size_t len;
+};
+
+static void split_stripes(const struct hfs_place& place, size_t size, off_t off, std::vector<std::vector<struct piece_io>>& ios) {
+  int64_t unit = HFS_META->stripe_unit;
+  ios.assign(place.width, {});
+  size_t done = 0;
+  while(done < size) {
+    int64_t chunk = (off + done) / unit;
+    int64_t in_chunk = (off + done) % unit;
+    size_t len = std::min<size_t>(unit - in_chunk, size - done);
+    off_t piece_off = (chunk / place.width) * unit + in_chunk;
+    ios[chunk % place.width].push_back(piece_io{piece_off, done, len});
+    done += len;
+  }
+}
+
+// Runs io on every piece in parallel, the last busy piece in the caller.
+static int run_pieces(const std::vector<std::vector<struct piece_io>>& ios, const std::function<int(int32_t, const struct piece_io&)>& io) {
+  std::vector<int> results(ios.size(), 0);
+  bool background = io_background;
+  auto piece_task = [&](size_t i) {
+    // pool threads work for whoever submitted
+    io_background = background;
+    for(const struct piece_io& pio : ios[i]) {
+      results[i] = io(i, pio);
+      if(results[i] != 0) {
+        return ;
+      }
+    }
+  };
+  std::vector<std::future<void>> futures;
+  int32_t inline_piece = -1;
+  for(size_t i = 0; i < ios.size(); i++) {
+    if(ios[i].empty()) {
+      continue;
+    }
+    if(inline_piece != -1) {
+      futures.push_back(HFS_META->io_pool->submit(std::bind(piece_task, inline_piece)));
+    }
+    inline_piece = i;
+  }
+  if(inline_piece != -1) {
+    piece_task(inline_piece);
+  }
+  for(std::future<void>& f : futures) {
+    f.wait();
+  }
+  for(int result : results) {
+    if(result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+static int pread_full(int fd, char *buf, size_t size, off_t off) {
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = pread(fd, buf + done, size - done, off + done);
+    if(n == -1) {
+      return -errno;
+    }
+    if(n == 0) {
+      // hole at the end of the piece
+      memset(buf + done, 0, size - done);
+      break;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t size, off_t off) {
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = pwrite(fd, buf + done, size - done, off + done);
+    if(n == -1) {
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+ssize_t backing_pread(const struct hfs_place& place, const std::vector<int>& fds, char *buf, size_t size, off_t off, int64_t file_size) {
+  if(place.layout == FileLayout::WHOLE) {
+    hfs_io_guard guard(piece_device(place, 0));
+    ssize_t read_size = pread(fds[0], buf, size, off);
+    return read_size == -1 ? -errno : read_size;
+  }
+  if(off >= file_size) {
+    return 0;
+  }
+  size = std::min<int64_t>(size, file_size - off);
+  if(place.layout == FileLayout::PACKED) {
+    hfs_io_guard guard(piece_device(place, 0));
+    int state = pread_full(fds[0], buf, size, place.pack_off + off);
+    return state != 0 ? state : size;
+  }
+  if(place.layout == FileLayout::COMPRESSED) {
+    hfs_io_guard guard(piece_device(place, 0));
+    return compress_pread(fds[0], *place.cindex, buf, size, off);
+  }
+  std::vector<std::vector<struct piece_io>> ios;
+  split_stripes(place, size, off, ios);
+  int state = run_pieces(ios, [&](int32_t piece, const struct piece_io& pio) {
+    hfs_io_guard guard(piece_device(place, piece));
+    return pread_full(fds[piece], buf + pio.buf_off, pio.len, pio.piece_off);
+  });
+  return state != 0 ? state : size;
+}
+
+ssize_t backing_pwrite(const struct hfs_place& place, const std::vector<int>& fds, const char *buf, size_t size, off_t off) {
+  if(place.layout == FileLayout::WHOLE) {
+    hfs_io_guard guard(piece_device(place, 0));
+    ssize_t write_size = pwrite(fds[0], buf, size, off);
+    return write_size == -1 ? -errno : write_size;
+  }
+  if(place.layout == FileLayout::PACKED || place.layout == FileLayout::COMPRESSED) {
+    // packed and compressed files are rewritten whole
+    return -EINVAL;
+  }
+  std::vector<std::vector<struct piece_io>> ios;
+  split_stripes(place, size, off, ios);
+  int state = run_pieces(ios, [&](int32_t piece, const struct piece_io& pio) {
+    hfs_io_guard guard(piece_device(place, piece));
+    return pwrite_full(fds[piece], buf + pio.buf_off, pio.len, pio.piece_off);
+  });
+  return state != 0 ? state : size;
+}
+
+bool backing_direct_ok(const struct hfs_place& place) {
+  return place.layout == FileLayout::WHOLE || (place.layout == FileLayout::STRIPED && HFS_META->stripe_unit % DIO_ALIGN == 0);
+}
+
+ssize_t backing_pread_direct(const struct hfs_place& place, const std::vector<int>& fds, char *buf, size_t size, off_t off, int64_t file_size) {
+  if(!backing_direct_ok(place)) {
+    return -EINVAL;
+  }
+  if(place.layout == FileLayout::WHOLE) {
+    // up to the end of the backing file, like backing_pread
+    hfs_io_guard guard(piece_device(place, 0));
+    return dio_pread(HFS_META->dio_pool, fds[0], buf, size, off);
+  }
+  if(off >= file_size) {
+    return 0;
+  }
+  size = std::min<int64_t>(size, file_size - off);
+  std::vector<std::vector<struct piece_io>> ios;
+  split_stripes(place, size, off, ios);
+  int state = run_pieces(ios, [&](int32_t piece, const struct piece_io& pio) {
+    hfs_io_guard guard(piece_device(place, piece));
+    ssize_t n = dio_pread(HFS_META->dio_pool, fds[piece], buf + pio.buf_off, pio.len, pio.piece_off);
+    if(n < 0) {
+      return (int)n;
+    }
+    // hole at the end of the piece
+    memset(buf + pio.buf_off + n, 0, pio.len - n);
+    return 0;
+  });
+  return state != 0 ? state : size;
+}
+
+ssize_t backing_pwrite_direct(const struct hfs_place& place, const std::vector<int>& fds, const char *buf, size_t size, off_t off) {
+  if(!backing_direct_ok(place)) {
+    return -EINVAL;
+  }
+  if(place.layout == FileLayout::WHOLE) {
+    hfs_io_guard guard(piece_device(place, 0));
+    return dio_pwrite(HFS_META->dio_pool, fds[0], buf, size, off);
+  }
+  std::vector<std::vector<struct piece_io>> ios;
+  split_stripes(place, size, off, ios);
+  int state = run_pieces(ios, [&](int32_t piece, const struct piece_io& pio) {
+    hfs_io_guard guard(piece_device(place, piece));
+    ssize_t n = dio_pwrite(HFS_META->dio_pool, fds[piece], buf + pio.buf_off, pio.len, pio.piece_off);
+    return n < 0 ? (int)n : 0;
+  });
+  return state != 0 ? state : size;
+}
+
+int backing_fallocate(const struct hfs_place& place, const std::vector<int>& fds, int mode, off_t off, off_t len) {
+  if(place.layout == FileLayout::WHOLE) {
+    hfs_io_guard guard(piece_device(place, 0));
+    return fallocate(fds[0], mode, off, len) == 0 ? 0 : -errno;
+  }
+  if(place.layout != FileLayout::STRIPED) {
+    return -EOPNOTSUPP;
+  }
+  mode |= FALLOC_FL_KEEP_SIZE;
+  if((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) != 0) {
+    // exactly the pieces of the range
+    std::vector<std::vector<struct piece_io>> ios;
+    split_stripes(place, len, off, ios);
+    return run_pieces(ios, [&](int32_t piece, const struct piece_io& pio) {
+      hfs_io_guard guard(piece_device(place, piece));
+      return fallocate(fds[piece], mode, pio.piece_off, pio.len) == 0 ? 0 : -errno;
+    });
+  }
+  // whole stripes around the range, a chunk too many does no harm
+  int64_t unit = HFS_META->stripe_unit;
+  off_t piece_lo = (off / unit) / place.width * unit;
+  off_t piece_hi = ((off + len - 1) / unit / place.width + 1) * unit;
+  for(int32_t i = 0; i < place.width; i++) {
+    hfs_io_guard guard(piece_device(place, i));
+    if(fallocate(fds[i], mode, piece_lo, piece_hi - piece_lo) != 0) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+// There is no truncateat, an fd opened from the kept directories still
+// saves the walk of the device path.
+static int truncate_piece(const struct hfs_place& place, int32_t piece, const std::string& path, int64_t size) {
+  const char *name;
+  int dirfd = backing_dirfd(place, piece, path, name);
+  int fd = openat(dirfd, name, O_WRONLY);
+  if(fd == -1) {
+    return -errno;
+  }
+  int state = ftruncate(fd, size) == 0 ? 0 : -errno;
+  close(fd);
+  return state;
+}
+
+int backing_truncate(const struct hfs_place& place, const std::string& path, int64_t size) {
+  if(place.layout == FileLayout::COMPRESSED) {
+    return -EINVAL;
+  }
+  if(place.layout == FileLayout::WHOLE) {
+    return truncate_piece(place, 0, path, size);
+  }
+  int64_t unit = HFS_META->stripe_unit;
+  int64_t full_chunks = size / unit;
+  for(int32_t i = 0; i < place.width; i++) {
+    int64_t piece_size = (full_chunks / place.width + (i < full_chunks % place.width ? 1 : 0)) * unit;
+    if(i == full_chunks % place.width) {
+      piece_size += size % unit;
+    }
+    int state = truncate_piece(place, i, path, piece_size);
+    if(state != 0) {
+      return state;
+    }
+  }
+  return 0;
+}
+
+int backing_unlink(const struct hfs_place& place, const std::string& path) {
+  int state = 0;
+  for(int32_t i = 0; i < piece_count(place); i++) {
+    const char *name;
+    int dirfd = backing_dirfd(place, i, path, name);
+    if(unlinkat(dirfd, name, 0) != 0 && state == 0) {
+      state = -errno;
+    }
+  }
+  return state;
+}
+
+// rename or link of every piece of a place, undone on failure.
+static int move_pieces(const struct hfs_place& place, const std::string& from, const std::string& to, bool keep) {
+  auto step = [&](int32_t i, const std::string& a, const std::string& b) {
+    const char *a_name, *b_name;
+    int a_dirfd = backing_dirfd(place, i, a, a_name);
+    int b_dirfd = backing_dirfd(place, i, b, b_name);
+    return keep ? linkat(a_dirfd, a_name, b_dirfd, b_name, 0) : renameat(a_dirfd, a_name, b_dirfd, b_name);
+  };
+  for(int32_t i = 0; i < piece_count(place); i++) {
+    if(step(i, from, to) != 0) {
+      int move_errno = errno;
+      while(i-- > 0) {
+        if(keep) {
+          const char *name;
+          unlinkat(backing_dirfd(place, i, to, name), name, 0);
+        } else {
+          step(i, to, from);
+        }
+      }
+      return -move_errno;
+    }
+  }
+  return 0;
+}
+
+int backing_rename(const struct hfs_place& place, const std::string& from, const std::string& to) {
+  return move_pieces(place, from, to, false);
+}
+
+int backing_link(const struct hfs_place& place, const std::string& from, const std::string& to) {
+  return move_pieces(place, from, to, true);
+}
+
+static void copy_xattrs(int from_fd, int to_fd) {
+  ssize_t list_size = flistxattr(from_fd, nullptr, 0);
+  if(list_size <= 0) {
+    return ;
+  }
+  std::vector<char> list(list_size);
+  list_size = flistxattr(from_fd, list.data(), list.size());
+  for(ssize_t i = 0; i < list_size; i += strlen(&list[i]) + 1) {
+    const char* name = &list[i];
+    ssize_t value_size = fgetxattr(from_fd, name, nullptr, 0);
+    if(value_size < 0) {
+      continue;
+    }
+    std::vector<char> value(value_size);
+    value_size = fgetxattr(from_fd, name, value.data(), value.size());
+    if(value_size >= 0) {
+      fsetxattr(to_fd, name, value.data(), value_size, 0);
+    }
+  }
+}
+
+std::string backing_tmp_path() {
+  static std::atomic<uint64_t> tmp_seq{0};
+  return "/" HFS_INTERNAL_DIR "/tmp/" + std::to_string(tmp_seq++);
+}
+
+static void copy_attrs(const struct stat& st, int from_fd, const std::vector<int>& to_fds) {
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  for(int fd : to_fds) {
+    fchmod(fd, st.st_mode & 07777);
+    fchown(fd, st.st_uid, st.st_gid);
+  }
+  copy_xattrs(from_fd, to_fds[0]);
+  futimens(to_fds[0], times);
+}
+
+int backing_copy_attrs(const struct hfs_place& from, const std::string& from_path, const struct hfs_place& to, const std::string& to_path) {
+  std::vector<int> from_fds, to_fds;
+  int state = backing_open(from, from_path, O_RDONLY, 0, from_fds);
+  if(state != 0) {
+    return state;
+  }
+  state = backing_open(to, to_path, O_RDONLY, 0, to_fds);
+  if(state == 0) {
+    struct stat st;
+    fstat(from_fds[0], &st);
+    copy_attrs(st, from_fds[0], to_fds);
+    backing_close(to_fds);
+  }
+  backing_close(from_fds);
+  return state;
+}
+
+// Background copies pay for every device they touch.
+static void throttle_place(const struct hfs_place& place, int64_t bytes) {
+  int32_t pieces = piece_count(place);
+  for(int32_t i = 0; i < pieces; i++) {
+    sched_throttle(HFS_META->scheduler, piece_device(place, i), bytes / pieces);
+  }
+}
+
+// Whether a copy between the two places should bypass the page cache.
+static bool copy_direct(const struct hfs_place& from, const struct hfs_place& to) {
+  if(HFS_META->direct_io_size == 0) {
+    return false;
+  }
+  return HFS_META->tiers[from.area]->tclass == TierClass::HDD || HFS_META->tiers[to.area]->tclass == TierClass::HDD;
+}
+
+// Opens the side of a copy with O_DIRECT if direct, and without it if the
+// backing filesystem does not take O_DIRECT.
+static int open_copy_side(const struct hfs_place& place, const std::string& path, int flags, mode_t mode, bool& direct, std::vector<int>& fds) {
+  direct = direct && backing_direct_ok(place);
+  if(direct) {
+    int state = backing_open(place, path, flags | O_DIRECT, mode, fds);
+    if(state != -EINVAL) {
+      return state;
+    }
+    direct = false;
+  }
+  return backing_open(place, path, flags, mode, fds);
+}
+
+// Copies [off, off + len) through buf, a pool buffer.
+static int copy_span(const struct hfs_place& from, const std::vector<int>& from_fds, bool from_direct,
+                     const struct hfs_place& to, const std::vector<int>& to_fds, bool to_direct,
+                     char *buf, int64_t off, int64_t len, int64_t size) {
+  int64_t end = off + len;
+  while(off < end) {
+    int64_t n = std::min<int64_t>(HFS_META->dio_pool->buf_size, end - off);
+    throttle_place(from, n);
+    ssize_t read_size = from_direct ? backing_pread_direct(from, from_fds, buf, n, off, size) : backing_pread(from, from_fds, buf, n, off, size);
+    if(read_size <= 0) {
+      return read_size;
+    }
+    throttle_place(to, read_size);
+    ssize_t write_size = to_direct ? backing_pwrite_direct(to, to_fds, buf, read_size, off) : backing_pwrite(to, to_fds, buf, read_size, off);
+    if(write_size < 0) {
+      return write_size;
+    }
+    off += read_size;
+  }
+  return 0;
+}
+
+int backing_copy(const struct hfs_place& from, const std::string& from_path, struct hfs_place& to, const std::string& to_path, int64_t size) {
+  std::vector<int> from_fds, to_fds;
+  bool from_direct = copy_direct(from, to);
+  bool to_direct = from_direct;
+  int state = open_copy_side(from, from_path, O_RDONLY, 0, from_direct, from_fds);
+  if(state != 0) {
+    return state;
+  }
+  struct stat st;
+  fstat(from_fds[0], &st);
+  state = open_copy_side(to, to_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777, to_direct, to_fds);
+  if(state != 0) {
+    backing_close(from_fds);
+    return state;
+  }
+  if(size > 0 && (to.layout == FileLayout::WHOLE || to.layout == FileLayout::STRIPED)) {
+    // best effort, the copy works without
+    int alloc_state = backing_fallocate(to, to_fds, FALLOC_FL_KEEP_SIZE, 0, size);
+    if(alloc_state != 0 && alloc_state != -EOPNOTSUPP) {
+      spdlog::info("[backing] failed to preallocate {} with {}", to_path, alloc_state);
+    }
+  }
+  auto read_from = [&](char *buf, size_t len, off_t off) {
+    return from_direct ? backing_pread_direct(from, from_fds, buf, len, off, size) : backing_pread(from, from_fds, buf, len, off, size);
+  };
+  if(to.layout == FileLayout::COMPRESSED) {
+    std::shared_ptr<struct hfs_cindex> index = std::make_shared<struct hfs_cindex>();
+    state = compress_file(to_fds[0], size, HFS_META->compress_block, HFS_META->compress_level, [&](char *buf, size_t len, off_t off) {
+      // charged as if written uncompressed
+      throttle_place(from, len);
+      throttle_place(to, len);
+      return read_from(buf, len, off);
+    }, *index);
+    to.cindex = index;
+  }
+  // pool buffers hold whole stripes so every piece is busy
+  char *buf = dio_get(HFS_META->dio_pool);
+  if(buf == nullptr) {
+    state = -ENOMEM;
+  }
+  if(state == 0 && to.layout != FileLayout::COMPRESSED) {
+    state = copy_span(from, from_fds, from_direct, to, to_fds, to_direct, buf, 0, size, size);
+  }
+  dio_put(HFS_META->dio_pool, buf);
+  // also cuts the padding of the last direct write
+  if(state == 0 && to.layout != FileLayout::COMPRESSED) {
+    state = backing_truncate(to, to_path, size);
+  }
+  if(state == 0) {
+    copy_attrs(st, from_fds[0], to_fds);
+  }
+  backing_close(from_fds);
+  backing_close(to_fds);
+  if(state != 0) {
+    spdlog::info("[backing] failed to copy {} with {}", from_path, state);
+  }
+  return state;
+}
+
+int backing_copy_open(const struct hfs_place& from, const std::string& from_path, const struct hfs_place& to, const std::string& to_path,
+                      bool create, struct hfs_copy_fds& fds) {
+  fds.from_direct = copy_direct(from, to);
+  fds.to_direct = fds.from_direct;
+  int state = open_copy_side(from, from_path, O_RDONLY, 0, fds.from_direct, fds.from_fds);
+  if(state != 0) {
+    return state;
+  }
+  struct stat st;
+  fstat(fds.from_fds[0], &st);
+  state = open_copy_side(to, to_path, O_WRONLY | (create ? O_CREAT | O_TRUNC : 0), st.st_mode & 07777, fds.to_direct, fds.to_fds);
+  if(state != 0) {
+    backing_close(fds.from_fds);
+  }
+  return state;
+}
+
+void backing_copy_close(struct hfs_copy_fds& fds) {
+  backing_close(fds.from_fds);
+  backing_close(fds.to_fds);
+}
+
+// Next data of a whole file in [off, end) as [data, data_end), false if
+// the rest is a hole. Other layouts are all data.
+static bool next_data(const struct hfs_place& place, int fd, int64_t off, int64_t end, int64_t& data, int64_t& data_end) {
+  data = off;
+  data_end = end;
+  if(place.layout != FileLayout::WHOLE) {
+    return off < end;
+  }
+  off_t found = lseek(fd, off, SEEK_DATA);
+  if(found == -1) {
+    // ENXIO past the last data, anything else copies the lot
+    return errno != ENXIO && off < end;
+  }
+  if(found >= end) {
+    return false;
+  }
+  data = found;
+  off_t hole = lseek(fd, found, SEEK_HOLE);
+  if(hole != -1 && hole < end) {
+    data_end = hole;
+  }
+  return true;
+}
+
+int backing_copy_range(const struct hfs_place& from, const struct hfs_place& to, struct hfs_copy_fds& fds,
+                       int64_t off, int64_t len, int64_t size, bool refill) {
+  int64_t end = std::min(off + len, size);
+  if(off >= end) {
+    return 0;
+  }
+  if(refill) {
+    // what was copied before may be a hole now
+    int punch_state = backing_fallocate(to, fds.to_fds, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, end - off);
+    if(punch_state != 0 && punch_state != -EOPNOTSUPP) {
+      return punch_state;
+    }
+  }
+  char *buf = dio_get(HFS_META->dio_pool);
+  if(buf == nullptr) {
+    return -ENOMEM;
+  }
+  int state = 0;
+  int64_t data, data_end;
+  while(state == 0 && next_data(from, fds.from_fds[0], off, end, data, data_end)) {
+    // direct writes start aligned, holes are found in whole blocks
+    data = data / DIO_ALIGN * DIO_ALIGN;
+    // best effort, keeps the data contiguous
+    backing_fallocate(to, fds.to_fds, FALLOC_FL_KEEP_SIZE, data, data_end - data);
+    state = copy_span(from, fds.from_fds, fds.from_direct, to, fds.to_fds, fds.to_direct, buf, data, data_end - data, size);
+    off = data_end;
+  }
+  dio_put(HFS_META->dio_pool, buf);
+  return state;
+}
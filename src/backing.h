@@ -0,0 +1,93 @@
+#ifndef _HYBRIDFS_BACKING_H
+#define _HYBRIDFS_BACKING_H
+
+#include <string>
+#include <vector>
+
+#include "hybridfs.h"
+
+// Where the data of a file lives. A whole file is one backing file on dev,
+// a striped file keeps chunk i in piece i % width, at offset
+// (i / width) * stripe_unit, and piece k on device (dev + k) % devices.
+// A packed file is the record at pack_off in container pack_id on dev, a
+// compressed file one backing file on dev read through cindex.
+struct hfs_place {
+  int32_t area;
+  int32_t dev;
+  FileLayout layout;
+  int32_t width;
+  uint32_t pack_id = 0;
+  int64_t pack_off = 0;
+  std::shared_ptr<const struct hfs_cindex> cindex;
+};
+
+struct hfs_place dentry_place(const struct hfs_dentry* dentry);
+// Backing files are objects named by id, not by their path in the file
+// system: /.hybridfs/obj/<xx>/<yy>/<oid> on every device, with the two
+// fan-out levels picked by a hash of the id. Renames never touch them.
+std::string object_path(uint64_t oid);
+// Creates the fan-out directories below a device root.
+int backing_make_objects(const std::string& root);
+// Opens and closes the directories of a device backing_dirfd resolves from.
+int backing_open_dirs(struct hfs_device* dev);
+void backing_close_dirs(struct hfs_device* dev);
+// Directory fd and name below it to reach a backing path of a piece with
+// *at calls. Objects and temporary files are resolved from directories kept
+// open, so the kernel walks one or two components instead of the whole
+// device path. name points into path.
+int backing_dirfd(const struct hfs_place& place, int32_t piece, const std::string& path, const char*& name);
+// Placement for a file of size bytes moving to tier area.
+struct hfs_place choose_place(int32_t area, int64_t size);
+int32_t piece_count(const struct hfs_place& place);
+struct hfs_device* piece_device(const struct hfs_place& place, int32_t piece);
+
+// All functions return 0 (or a byte count) on success and -errno on failure.
+int backing_open(const struct hfs_place& place, const std::string& path, int flags, mode_t mode, std::vector<int>& fds);
+void backing_close(std::vector<int>& fds);
+ssize_t backing_pread(const struct hfs_place& place, const std::vector<int>& fds, char *buf, size_t size, off_t off, int64_t file_size);
+ssize_t backing_pwrite(const struct hfs_place& place, const std::vector<int>& fds, const char *buf, size_t size, off_t off);
+// Whole and striped files can be accessed through fds opened with O_DIRECT,
+// see direct_io.h. Writes must start aligned, their padding is left for a
+// later truncate.
+bool backing_direct_ok(const struct hfs_place& place);
+ssize_t backing_pread_direct(const struct hfs_place& place, const std::vector<int>& fds, char *buf, size_t size, off_t off, int64_t file_size);
+ssize_t backing_pwrite_direct(const struct hfs_place& place, const std::vector<int>& fds, const char *buf, size_t size, off_t off);
+// fallocate on whole and striped files. Pieces of striped files are only
+// allocated, never grown, the caller sets the new size with backing_truncate.
+int backing_fallocate(const struct hfs_place& place, const std::vector<int>& fds, int mode, off_t off, off_t len);
+int backing_truncate(const struct hfs_place& place, const std::string& path, int64_t size);
+int backing_unlink(const struct hfs_place& place, const std::string& path);
+int backing_rename(const struct hfs_place& place, const std::string& from, const std::string& to);
+int backing_link(const struct hfs_place& place, const std::string& from, const std::string& to);
+// Copies size bytes from one placement to another, with mode, owner, times
+// and xattrs. The source is left in place. Copies to a compressed place
+// fill in its cindex. On background threads the copy is throttled by the
+// scheduler. Copies from or to hdd tiers bypass the page cache when direct
+// I/O is on. The target is preallocated so it lands contiguously.
+int backing_copy(const struct hfs_place& from, const std::string& from_path, struct hfs_place& to, const std::string& to_path, int64_t size);
+// Both sides of a copy done range by range, for migrations that run while
+// the file is written.
+struct hfs_copy_fds {
+  std::vector<int> from_fds;
+  std::vector<int> to_fds;
+  bool from_direct;
+  bool to_direct;
+};
+// Opens whole or striped places for backing_copy_range, create starts the
+// target over.
+int backing_copy_open(const struct hfs_place& from, const std::string& from_path, const struct hfs_place& to, const std::string& to_path,
+                      bool create, struct hfs_copy_fds& fds);
+void backing_copy_close(struct hfs_copy_fds& fds);
+// Copies [off, off + len) of a file of size bytes, throttled like
+// backing_copy. Holes of a whole source are skipped and stay holes in the
+// target, refill punches the range in the target first for ranges copied
+// before. The caller sets the final size with backing_truncate.
+int backing_copy_range(const struct hfs_place& from, const struct hfs_place& to, struct hfs_copy_fds& fds,
+                       int64_t off, int64_t len, int64_t size, bool refill);
+// Copies mode, owner, times and xattrs again, for copies made while the
+// source could change.
+int backing_copy_attrs(const struct hfs_place& from, const std::string& from_path, const struct hfs_place& to, const std::string& to_path);
+// Fresh path below the internal directory, for files being rewritten.
+std::string backing_tmp_path();
+
+#endif
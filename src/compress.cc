@@ -0,0 +1,170 @@
+#include <unistd.h>
+#include <cstring>
+#include <future>
+
+#include <zlib.h>
+#include <spdlog/spdlog.h>
+
+#include "compress.h"
+#include "hybridfs.h"
+
+static int write_full(int fd, const char *buf, size_t size, off_t off) {
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = pwrite(fd, buf + done, size - done, off + done);
+    if(n == -1) {
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int read_full(int fd, char *buf, size_t size, off_t off) {
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = pread(fd, buf + done, size - done, off + done);
+    if(n <= 0) {
+      return n == 0 ? -EIO : -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Compresses one block into out, which holds compressBound(block_size)
+// bytes, and returns the stored length.
+static uint32_t compress_block(const char *raw, int64_t raw_len, std::vector<char>& out, int level) {
+  uLongf out_len = out.size();
+  if(compress2((Bytef*)out.data(), &out_len, (const Bytef*)raw, raw_len, level) != Z_OK || (int64_t)out_len >= raw_len) {
+    // not worth it, keep the block raw
+    memcpy(out.data(), raw, raw_len);
+    return raw_len;
+  }
+  return out_len;
+}
+
+int compress_file(int fd, int64_t size, int64_t block_size, int level,
+                  const std::function<ssize_t(char *, size_t, off_t)>& read, struct hfs_cindex& index) {
+  index.block_size = block_size;
+  index.size = size;
+  index.offs.clear();
+  index.lens.clear();
+  index.dead = 0;
+  // a batch keeps every io thread busy with one block
+  int64_t batch = std::max<int64_t>(HFS_META->io_pool_threads, 1);
+  std::vector<char> raw(batch * block_size);
+  std::vector<std::vector<char>> out(batch, std::vector<char>(compressBound(block_size)));
+  std::vector<uint32_t> out_lens(batch);
+  uint64_t file_off = 0;
+  for(int64_t off = 0; off < size; off += batch * block_size) {
+    int64_t len = std::min(batch * block_size, size - off);
+    ssize_t read_size = read(raw.data(), len, off);
+    if(read_size != len) {
+      return read_size < 0 ? read_size : -EIO;
+    }
+    int64_t blocks = (len + block_size - 1) / block_size;
+    std::vector<std::future<void>> futures;
+    for(int64_t b = 0; b < blocks; b++) {
+      futures.push_back(HFS_META->io_pool->submit([&, b]() {
+        out_lens[b] = compress_block(raw.data() + b * block_size, std::min(block_size, len - b * block_size), out[b], level);
+      }));
+    }
+    for(std::future<void>& f : futures) {
+      f.wait();
+    }
+    for(int64_t b = 0; b < blocks; b++) {
+      int state = write_full(fd, out[b].data(), out_lens[b], file_off);
+      if(state != 0) {
+        return state;
+      }
+      index.offs.push_back(file_off);
+      index.lens.push_back(out_lens[b]);
+      file_off += out_lens[b];
+    }
+  }
+  spdlog::info("[compress] {} bytes into {} bytes, {} blocks", size, file_off, index.offs.size());
+  return 0;
+}
+
+ssize_t compress_pread(int fd, const struct hfs_cindex& index, char *buf, size_t size, off_t off) {
+  if(off >= index.size) {
+    return 0;
+  }
+  size = std::min<int64_t>(size, index.size - off);
+  std::vector<char> packed, block(index.block_size);
+  size_t done = 0;
+  while(done < size) {
+    int64_t b = (off + done) / index.block_size;
+    int64_t in_block = (off + done) % index.block_size;
+    int64_t raw_len = std::min(index.block_size, index.size - b * index.block_size);
+    size_t len = std::min<size_t>(raw_len - in_block, size - done);
+    if(index.lens[b] == raw_len) {
+      // stored raw
+      int state = read_full(fd, buf + done, len, index.offs[b] + in_block);
+      if(state != 0) {
+        return state;
+      }
+    } else {
+      packed.resize(index.lens[b]);
+      int state = read_full(fd, packed.data(), packed.size(), index.offs[b]);
+      if(state != 0) {
+        return state;
+      }
+      uLongf block_len = block.size();
+      if(uncompress((Bytef*)block.data(), &block_len, (const Bytef*)packed.data(), packed.size()) != Z_OK
+         || (int64_t)block_len != raw_len) {
+        spdlog::info("[compress] corrupt block {} at {}", b, index.offs[b]);
+        return -EIO;
+      }
+      memcpy(buf + done, block.data() + in_block, len);
+    }
+    done += len;
+  }
+  return size;
+}
+
+int compress_append(int fd, const struct hfs_cindex& index, const char *buf, size_t size, int level,
+                    std::shared_ptr<const struct hfs_cindex>& next) {
+  std::shared_ptr<struct hfs_cindex> appended = std::make_shared<struct hfs_cindex>(index);
+  int64_t tail_len = index.size % index.block_size;
+  std::vector<char> raw(tail_len + size);
+  uint64_t file_off = compress_stored(index);
+  if(tail_len > 0) {
+    // the partial last block is compressed again with the new data, after
+    // the old one, which readers of index may still decode
+    ssize_t read_size = compress_pread(fd, index, raw.data(), tail_len, index.size - tail_len);
+    if(read_size != tail_len) {
+      return read_size < 0 ? read_size : -EIO;
+    }
+    appended->dead += appended->lens.back();
+    appended->offs.pop_back();
+    appended->lens.pop_back();
+  }
+  memcpy(raw.data() + tail_len, buf, size);
+  std::vector<char> out(compressBound(index.block_size));
+  for(int64_t off = 0; off < (int64_t)raw.size(); off += index.block_size) {
+    uint32_t out_len = compress_block(raw.data() + off, std::min<int64_t>(index.block_size, raw.size() - off), out, level);
+    int state = write_full(fd, out.data(), out_len, file_off);
+    if(state != 0) {
+      return state;
+    }
+    appended->offs.push_back(file_off);
+    appended->lens.push_back(out_len);
+    file_off += out_len;
+  }
+  if(ftruncate(fd, file_off) != 0) {
+    return -errno;
+  }
+  appended->size += size;
+  next = appended;
+  return 0;
+}
+
+int64_t compress_stored(const struct hfs_cindex& index) {
+  return index.offs.empty() ? 0 : index.offs.back() + index.lens.back();
+}
+
+bool compress_wasteful(const struct hfs_cindex& index) {
+  return index.dead > compress_stored(index) - index.dead;
+}
@@ -0,0 +1,39 @@
+#ifndef _HYBRIDFS_COMPRESS_H
+#define _HYBRIDFS_COMPRESS_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Block index of a compressed backing file, which holds the independently
+// compressed blocks back to back. A block whose stored length equals its
+// raw length is kept uncompressed. Indexes are never changed once shared,
+// appends build a new one.
+struct hfs_cindex {
+  int64_t block_size;
+  int64_t size;                   // uncompressed file size
+  std::vector<uint64_t> offs;
+  std::vector<uint32_t> lens;
+  int64_t dead = 0;               // bytes of old last blocks between the live ones
+};
+
+// Compresses size bytes taken from read into fd, blocks in parallel on the
+// io pool, and fills index. Returns 0 or -errno.
+int compress_file(int fd, int64_t size, int64_t block_size, int level,
+                  const std::function<ssize_t(char *, size_t, off_t)>& read, struct hfs_cindex& index);
+// Reads the uncompressed range [off, off + size) of a compressed file.
+ssize_t compress_pread(int fd, const struct hfs_cindex& index, char *buf, size_t size, off_t off);
+// Appends size bytes, recompressing the partial last block, and returns the
+// index covering them in next. Nothing index points to is overwritten, the
+// old last block is left behind as unused space and counted in dead.
+int compress_append(int fd, const struct hfs_cindex& index, const char *buf, size_t size, int level,
+                    std::shared_ptr<const struct hfs_cindex>& next);
+// Bytes of the backing file, live and dead.
+int64_t compress_stored(const struct hfs_cindex& index);
+// Whether more of the backing file is dead than live, for the file to be
+// compressed again.
+bool compress_wasteful(const struct hfs_cindex& index);
+
+#endif
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <cstring>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "dedup.h"
+
+static constexpr size_t DEDUP_READ = 1 << 20;
+
+// The fingerprint runs eight independent lanes of the xxhash64 round over
+// 64 byte stripes, the lanes fit vector registers and compilers keep them
+// there on targets with 64 bit vector multiplies.
+static constexpr size_t LANES = 8;
+static constexpr size_t STRIPE = LANES * sizeof(uint64_t);
+static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+
+struct hfs_hasher {
+  uint64_t lanes[LANES];
+};
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static void hash_start(struct hfs_hasher& h) {
+  for(size_t i = 0; i < LANES; i++) {
+    h.lanes[i] = P1 * (i + 1) + P2;
+  }
+}
+
+// data holds whole stripes.
+static void hash_stripes(struct hfs_hasher& h, const char *data, size_t len) {
+  uint64_t lanes[LANES];
+  memcpy(lanes, h.lanes, sizeof(lanes));
+  for(size_t off = 0; off < len; off += STRIPE) {
+    uint64_t v[LANES];
+    memcpy(v, data + off, STRIPE);
+    for(size_t i = 0; i < LANES; i++) {
+      lanes[i] = rotl(lanes[i] + v[i] * P2, 31) * P1;
+    }
+  }
+  memcpy(h.lanes, lanes, sizeof(lanes));
+}
+
+static struct hfs_fingerprint hash_finish(struct hfs_hasher& h, const char *tail, size_t tail_len, uint64_t total) {
+  char last[STRIPE] = {};
+  memcpy(last, tail, tail_len);
+  hash_stripes(h, last, STRIPE);
+  struct hfs_fingerprint fp{total * P3, total ^ P1};
+  for(size_t i = 0; i < LANES / 2; i++) {
+    fp.hi = rotl(fp.hi ^ avalanche(h.lanes[i]), 27) * P1 + P3;
+    fp.lo = rotl(fp.lo ^ avalanche(h.lanes[i + LANES / 2]), 27) * P1 + P3;
+  }
+  fp.hi = avalanche(fp.hi);
+  fp.lo = avalanche(fp.lo);
+  return fp;
+}
+
+struct hfs_dedup* dedup_new(int64_t min_size, bool verify) {
+  struct hfs_dedup* dd = new hfs_dedup();
+  dd->min_size = min_size;
+  dd->verify = verify;
+  dd->hashed = 0;
+  dd->shared = 0;
+  dd->saved_bytes = 0;
+  return dd;
+}
+
+void dedup_free(struct hfs_dedup* dd) {
+  spdlog::info("[dedup] hashed: {}, shared: {}, saved bytes: {}, indexed: {}", dd->hashed.load(), dd->shared.load(),
+               dd->saved_bytes.load(), dd->index.size());
+  delete dd;
+}
+
+// Reads exactly len bytes at off unless the file ends.
+static ssize_t read_full(int fd, char *buf, size_t len, off_t off) {
+  size_t done = 0;
+  while(done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, off + done);
+    if(n < 0) {
+      return -errno;
+    }
+    if(n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+int dedup_fingerprint(int fd, int64_t size, struct hfs_fingerprint& fp, const std::function<void(int64_t)>& charge) {
+  std::vector<char> buf(DEDUP_READ);
+  struct hfs_hasher h;
+  hash_start(h);
+  int64_t off = 0;
+  const char *tail_data = buf.data();
+  size_t tail = 0;
+  while(off < size) {
+    size_t len = std::min<int64_t>(buf.size(), size - off);
+    ssize_t n = read_full(fd, buf.data(), len, off);
+    if(n < 0) {
+      return n;
+    }
+    if((size_t)n < len) {
+      // shorter than the dentry says, changed meanwhile
+      return -ESTALE;
+    }
+    charge(n);
+    off += n;
+    size_t whole = n / STRIPE * STRIPE;
+    hash_stripes(h, buf.data(), whole);
+    // only the last read ends off a stripe
+    tail_data = buf.data() + whole;
+    tail = n - whole;
+  }
+  fp = hash_finish(h, tail_data, tail, size);
+  return 0;
+}
+
+int dedup_compare(int fd_a, int fd_b, int64_t size, const std::function<void(int64_t)>& charge) {
+  std::vector<char> buf_a(DEDUP_READ), buf_b(DEDUP_READ);
+  for(int64_t off = 0; off < size; off += buf_a.size()) {
+    size_t len = std::min<int64_t>(buf_a.size(), size - off);
+    ssize_t n_a = read_full(fd_a, buf_a.data(), len, off);
+    ssize_t n_b = read_full(fd_b, buf_b.data(), len, off);
+    if(n_a < 0 || n_b < 0) {
+      return n_a < 0 ? n_a : n_b;
+    }
+    charge(n_a + n_b);
+    if(n_a != (ssize_t)len || n_b != (ssize_t)len || memcmp(buf_a.data(), buf_b.data(), len) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int dedup_clone(int from_fd, int to_fd) {
+  if(ioctl(to_fd, FICLONE, from_fd) != 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+bool dedup_lookup(struct hfs_dedup* dd, const struct hfs_fingerprint& fp, int64_t size, int32_t area, struct hfs_dedup_entry& entry) {
+  std::lock_guard<std::mutex> lock(dd->lock);
+  auto it = dd->index.find(fp);
+  if(it == dd->index.end() || it->second.size != size || it->second.area != area) {
+    return false;
+  }
+  entry = it->second;
+  return true;
+}
+
+void dedup_insert(struct hfs_dedup* dd, const struct hfs_fingerprint& fp, const struct hfs_dedup_entry& entry) {
+  std::lock_guard<std::mutex> lock(dd->lock);
+  dd->index.emplace(fp, entry);
+}
+
+void dedup_remove(struct hfs_dedup* dd, const struct hfs_fingerprint& fp, uint64_t oid) {
+  std::lock_guard<std::mutex> lock(dd->lock);
+  auto it = dd->index.find(fp);
+  if(it != dd->index.end() && it->second.oid == oid) {
+    dd->index.erase(it);
+  }
+}
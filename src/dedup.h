@@ -0,0 +1,70 @@
+#ifndef _HYBRIDFS_DEDUP_H
+#define _HYBRIDFS_DEDUP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+// Deduplication of files demoted to hdd tiers. Files are fingerprinted on
+// the way down, and a file whose content is already on the tier gets its
+// extents shared with that file (FICLONE) instead of a copy. The backing
+// filesystem counts the references and copies shared extents on write, so
+// every file keeps its own inode and attributes.
+struct hfs_fingerprint {
+  uint64_t hi;
+  uint64_t lo;
+
+  bool operator==(const struct hfs_fingerprint& other) const {
+    return hi == other.hi && lo == other.lo;
+  }
+};
+
+struct hfs_fingerprint_hash {
+  size_t operator()(const struct hfs_fingerprint& fp) const {
+    return fp.lo;
+  }
+};
+
+// A file holding some content, by object id since dentries come and go.
+struct hfs_dedup_entry {
+  uint64_t oid;
+  int32_t area;
+  int32_t dev;
+  int64_t size;
+};
+
+struct hfs_dedup {
+  int64_t min_size;     // smaller files are copied, 0 disables deduplication
+  bool verify;          // compare the data before sharing it
+  std::mutex lock;
+  std::unordered_map<struct hfs_fingerprint, struct hfs_dedup_entry, hfs_fingerprint_hash> index;
+  std::unordered_set<int32_t> no_clone;   // tiers whose filesystems can not share extents
+  // stats
+  std::atomic<uint64_t> hashed;
+  std::atomic<uint64_t> shared;
+  std::atomic<uint64_t> saved_bytes;
+};
+
+struct hfs_dedup* dedup_new(int64_t min_size, bool verify);
+void dedup_free(struct hfs_dedup* dd);
+
+// Fingerprint of the first size bytes of fd. charge is called with the
+// bytes of every read, for throttling. Returns 0 or -errno.
+int dedup_fingerprint(int fd, int64_t size, struct hfs_fingerprint& fp, const std::function<void(int64_t)>& charge);
+// 1 when the first size bytes of both fds are the same, 0 when not, -errno.
+int dedup_compare(int fd_a, int fd_b, int64_t size, const std::function<void(int64_t)>& charge);
+// Makes to_fd share the extents of from_fd. Returns 0 or -errno.
+int dedup_clone(int from_fd, int to_fd);
+
+// A file of size bytes with content fp on tier area, false if none.
+bool dedup_lookup(struct hfs_dedup* dd, const struct hfs_fingerprint& fp, int64_t size, int32_t area, struct hfs_dedup_entry& entry);
+// Indexes a file unless its content already is.
+void dedup_insert(struct hfs_dedup* dd, const struct hfs_fingerprint& fp, const struct hfs_dedup_entry& entry);
+// Forgets the file oid once it changes, moves or goes.
+void dedup_remove(struct hfs_dedup* dd, const struct hfs_fingerprint& fp, uint64_t oid);
+
+#endif
@@ -0,0 +1,319 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "backing.h"
+#include "compress.h"
+#include "dedup.h"
+#include "dir_cache.h"
+#include "pack.h"
+
+// How often the use clock advances, and the shrink thread looks.
+static constexpr auto TICK_INTERVAL = std::chrono::milliseconds(100);
+
+static constexpr char ENTRIES_MAGIC[8] = {'H', 'F', 'S', 'D', 'I', 'R', '1', '\0'};
+static constexpr const char* ENTRIES_NAME = "entries";
+
+// One child in an entries file, its name follows, then the block index of
+// a compressed file.
+struct hfs_dir_record {
+  uint64_t oid;
+  int64_t size;
+  int64_t alloc;
+  uint64_t version;
+  uint64_t write_seq;
+  int32_t area;
+  int32_t dev;
+  int32_t width;
+  int32_t pin;
+  int32_t prefer;
+  uint32_t heat;
+  uint8_t type;
+  uint8_t layout;
+  uint16_t name_len;
+  uint8_t indexed;      // fp holds the content, see dedup.h
+  uint8_t reserved[3];
+  uint64_t fp[2];
+  // packed file: its record and attributes, see pack.h
+  uint32_t pack_id;
+  int64_t pack_off;
+  struct hfs_attr attr;
+  // compressed file: blocks offsets and lengths after the name
+  int64_t block_size;
+  uint64_t blocks;
+};
+
+static void worker(struct hfs_dir_cache* cache) {
+  std::unique_lock<std::mutex> lock(cache->lock);
+  while(!cache->stop) {
+    cache->cond.wait_for(lock, TICK_INTERVAL, [cache] { return cache->stop; });
+    cache->tick++;
+    if(cache->stop || !dir_cache_over(cache, 0)) {
+      continue;
+    }
+    lock.unlock();
+    cache->shrink();
+    lock.lock();
+  }
+}
+
+struct hfs_dir_cache* dir_cache_new(int64_t budget, const std::function<void()>& shrink) {
+  struct hfs_dir_cache* cache = new hfs_dir_cache();
+  cache->budget = budget;
+  cache->resident = 0;
+  cache->tick = 1;
+  cache->stop = false;
+  cache->shrink = shrink;
+  cache->loads = 0;
+  cache->drops = 0;
+  if(budget > 0) {
+    cache->worker = std::thread(worker, cache);
+  }
+  return cache;
+}
+
+void dir_cache_free(struct hfs_dir_cache* cache) {
+  {
+    std::lock_guard<std::mutex> lock(cache->lock);
+    cache->stop = true;
+  }
+  cache->cond.notify_all();
+  if(cache->worker.joinable()) {
+    cache->worker.join();
+  }
+  spdlog::info("[dir_cache] resident: {}, loads: {}, drops: {}", cache->resident.load(), cache->loads.load(), cache->drops.load());
+  delete cache;
+}
+
+void dir_cache_count(struct hfs_dir_cache* cache, int64_t delta) {
+  cache->resident += delta;
+  if(delta > 0 && dir_cache_over(cache, 0)) {
+    cache->cond.notify_all();
+  }
+}
+
+bool dir_cache_over(const struct hfs_dir_cache* cache, int64_t slack) {
+  return cache->budget > 0 && cache->resident.load(std::memory_order_relaxed) > cache->budget - slack;
+}
+
+void dir_cache_touch(struct hfs_dir_cache* cache, struct hfs_dentry* dir) {
+  uint64_t now = cache->tick.load(std::memory_order_relaxed);
+  // most lookups find it stamped already, no store to share the line
+  if(dir->d_used.load(std::memory_order_relaxed) == now) {
+    return ;
+  }
+  dir->d_used.store(now, std::memory_order_relaxed);
+  if(cache->budget == 0) {
+    return ;
+  }
+  std::lock_guard<std::mutex> lock(cache->lock);
+  if(dir->d_listed) {
+    cache->lru.splice(cache->lru.end(), cache->lru, dir->d_lru);
+  } else {
+    dir->d_lru = cache->lru.insert(cache->lru.end(), dir);
+    dir->d_listed = true;
+  }
+}
+
+void dir_cache_unlist(struct hfs_dir_cache* cache, struct hfs_dentry* dir) {
+  std::lock_guard<std::mutex> lock(cache->lock);
+  if(dir->d_listed) {
+    cache->lru.erase(dir->d_lru);
+    dir->d_listed = false;
+  }
+  // listed again on the next lookup
+  dir->d_used.store(0, std::memory_order_relaxed);
+}
+
+void dir_cache_lru(struct hfs_dir_cache* cache, std::vector<struct hfs_dentry*>& dirs) {
+  std::lock_guard<std::mutex> lock(cache->lock);
+  dirs.assign(cache->lru.begin(), cache->lru.end());
+}
+
+// Directory fd and name of the entries file of dir.
+static int entries_at(const struct hfs_dentry* dir, std::string& obj, std::string& name) {
+  obj = object_path(dir->d_oid);
+  const char *obj_name;
+  int dirfd = backing_dirfd(dentry_place(dir), 0, obj, obj_name);
+  name = std::string(obj_name) + "/" + ENTRIES_NAME;
+  return dirfd;
+}
+
+int dir_store(const struct hfs_dentry* dir) {
+  std::vector<char> data(ENTRIES_MAGIC, ENTRIES_MAGIC + sizeof(ENTRIES_MAGIC));
+  for(auto it = dir->d_childs->begin(); it != dir->d_childs->end(); it++) {
+    const struct hfs_dentry* child = it->second;
+    struct hfs_dir_record record{};
+    record.oid = child->d_oid;
+    record.size = child->d_size;
+    record.alloc = child->d_alloc.load();
+    record.version = child->d_version;
+    record.write_seq = child->d_write_seq;
+    record.area = child->d_area;
+    record.dev = child->d_dev;
+    record.width = child->d_width;
+    record.pin = child->d_pin;
+    record.prefer = child->d_prefer;
+    record.heat = child->d_heat.load(std::memory_order_relaxed);
+    record.type = (uint8_t)child->d_type;
+    record.layout = (uint8_t)child->d_layout;
+    record.name_len = it->first.size();
+    const struct hfs_fingerprint* fp = child->d_fp.load();
+    if(fp != nullptr) {
+      record.indexed = 1;
+      record.fp[0] = fp->hi;
+      record.fp[1] = fp->lo;
+    }
+    if(child->d_layout == FileLayout::PACKED) {
+      record.pack_id = child->d_pack_id;
+      record.pack_off = child->d_pack_off;
+      record.attr = *child->d_attr;
+    }
+    std::shared_ptr<const struct hfs_cindex> cindex = std::atomic_load(&child->d_cindex);
+    if(child->d_layout == FileLayout::COMPRESSED) {
+      record.block_size = cindex->block_size;
+      record.blocks = cindex->offs.size();
+    }
+    const char *bytes = (const char*)&record;
+    data.insert(data.end(), bytes, bytes + sizeof(record));
+    data.insert(data.end(), it->first.begin(), it->first.end());
+    if(record.blocks > 0) {
+      const char *offs = (const char*)cindex->offs.data();
+      const char *lens = (const char*)cindex->lens.data();
+      data.insert(data.end(), offs, offs + record.blocks * sizeof(uint64_t));
+      data.insert(data.end(), lens, lens + record.blocks * sizeof(uint32_t));
+    }
+  }
+  std::string obj, name;
+  int dirfd = entries_at(dir, obj, name);
+  // written aside and renamed over, a crash leaves the old list
+  std::string tmp_name = name + ".tmp";
+  int fd = openat(dirfd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(fd == -1) {
+    return -errno;
+  }
+  size_t done = 0;
+  while(done < data.size()) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if(n <= 0) {
+      int write_errno = n == 0 ? EIO : errno;
+      close(fd);
+      unlinkat(dirfd, tmp_name.c_str(), 0);
+      return -write_errno;
+    }
+    done += n;
+  }
+  close(fd);
+  if(renameat(dirfd, tmp_name.c_str(), dirfd, name.c_str()) != 0) {
+    int rename_errno = errno;
+    unlinkat(dirfd, tmp_name.c_str(), 0);
+    return -rename_errno;
+  }
+  return 0;
+}
+
+// A truncated or overlong entries file, the children read so far go.
+static int bad_entries(const std::string& obj, std::unordered_map<std::string, struct hfs_dentry*>& childs) {
+  spdlog::error("[dir_cache] bad entries file {}", obj);
+  for(auto it = childs.begin(); it != childs.end(); it++) {
+    delete it->second->d_attr;
+    delete it->second->d_fp.load();
+    delete it->second;
+  }
+  childs.clear();
+  return -EIO;
+}
+
+int dir_load(struct hfs_dentry* dir, std::unordered_map<std::string, struct hfs_dentry*>& childs) {
+  std::string obj, name;
+  int dirfd = entries_at(dir, obj, name);
+  int fd = openat(dirfd, name.c_str(), O_RDONLY);
+  if(fd == -1) {
+    return -errno;
+  }
+  std::vector<char> data;
+  char buf[64 * 1024];
+  ssize_t n;
+  while((n = read(fd, buf, sizeof(buf))) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  close(fd);
+  if(n < 0) {
+    return -EIO;
+  }
+  if(data.size() < sizeof(ENTRIES_MAGIC) || memcmp(data.data(), ENTRIES_MAGIC, sizeof(ENTRIES_MAGIC)) != 0) {
+    spdlog::error("[dir_cache] bad entries file {}", obj);
+    return -EIO;
+  }
+  size_t pos = sizeof(ENTRIES_MAGIC);
+  while(pos + sizeof(struct hfs_dir_record) <= data.size()) {
+    struct hfs_dir_record record;
+    memcpy(&record, data.data() + pos, sizeof(record));
+    pos += sizeof(record);
+    if(pos + record.name_len > data.size()) {
+      return bad_entries(obj, childs);
+    }
+    std::string child_name(data.data() + pos, record.name_len);
+    pos += record.name_len;
+    size_t index_len = record.blocks * (sizeof(uint64_t) + sizeof(uint32_t));
+    if(pos + index_len > data.size()) {
+      return bad_entries(obj, childs);
+    }
+    FileType type = (FileType)record.type;
+    struct hfs_dentry* child = new hfs_dentry{child_name, type, record.area, dir, nullptr, record.size, record.dev};
+    child->d_layout = (FileLayout)record.layout;
+    child->d_width = record.width;
+    child->d_version = record.version;
+    child->d_write_seq = record.write_seq;
+    child->d_heat.store(record.heat, std::memory_order_relaxed);
+    child->d_pin = record.pin;
+    child->d_prefer = record.prefer;
+    child->d_alloc.store(record.alloc);
+    child->d_oid = record.oid;
+    if(record.indexed) {
+      child->d_fp = new hfs_fingerprint{record.fp[0], record.fp[1]};
+    }
+    if(child->d_layout == FileLayout::PACKED) {
+      child->d_pack_id = record.pack_id;
+      child->d_pack_off = record.pack_off;
+      child->d_attr = new hfs_attr(record.attr);
+    }
+    if(child->d_layout == FileLayout::COMPRESSED) {
+      std::shared_ptr<struct hfs_cindex> cindex = std::make_shared<struct hfs_cindex>();
+      cindex->block_size = record.block_size;
+      cindex->size = record.size;
+      cindex->offs.resize(record.blocks);
+      cindex->lens.resize(record.blocks);
+      memcpy(cindex->offs.data(), data.data() + pos, record.blocks * sizeof(uint64_t));
+      memcpy(cindex->lens.data(), data.data() + pos + record.blocks * sizeof(uint64_t), record.blocks * sizeof(uint32_t));
+      // what lies between the live blocks is dead
+      cindex->dead = compress_stored(*cindex);
+      for(uint32_t len : cindex->lens) {
+        cindex->dead -= len;
+      }
+      child->d_cindex = cindex;
+    }
+    pos += index_len;
+    if(type == FileType::DIRECTORY) {
+      // its own entries file holds its children
+      child->d_loaded = false;
+    }
+    childs.insert(std::make_pair(child_name, child));
+  }
+  if(pos != data.size()) {
+    return bad_entries(obj, childs);
+  }
+  return 0;
+}
+
+int dir_forget(const struct hfs_dentry* dir) {
+  std::string obj, name;
+  int dirfd = entries_at(dir, obj, name);
+  if(unlinkat(dirfd, name.c_str(), 0) != 0 && errno != ENOENT) {
+    return -errno;
+  }
+  return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef _HYBRIDFS_DIR_CACHE_H
+#define _HYBRIDFS_DIR_CACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct hfs_dentry;
+
+// Bounds the dentries kept in memory. While more than budget are resident,
+// shrink writes directories to an entries file in their backing object and
+// drops their children, least recently used first, and a lookup loads them
+// back. Loaded directories are kept in an LRU list as they are looked into,
+// the tree decides which of them may go, shrink runs on a thread of the
+// cache.
+struct hfs_dir_cache {
+  int64_t budget;                   // resident dentries, 0 keeps all
+  std::atomic<int64_t> resident;
+  std::atomic<uint64_t> tick;       // coarse clock directory use is stamped with
+  std::mutex load_lock;             // loads of dropped directories
+  std::mutex lock;                  // lru and the worker
+  std::list<struct hfs_dentry*> lru;  // least recently used first
+  std::condition_variable cond;
+  bool stop;
+  std::function<void()> shrink;
+  std::thread worker;
+  // stats
+  std::atomic<uint64_t> loads;
+  std::atomic<uint64_t> drops;
+};
+
+struct hfs_dir_cache* dir_cache_new(int64_t budget, const std::function<void()>& shrink);
+void dir_cache_free(struct hfs_dir_cache* cache);
+// Counts dentries added to (or, negative, removed from) the tree, waking
+// shrink once there are more than the budget.
+void dir_cache_count(struct hfs_dir_cache* cache, int64_t delta);
+bool dir_cache_over(const struct hfs_dir_cache* cache, int64_t slack);
+// Records a lookup in dir for the LRU order, listing it if needed. The list
+// moves at most once per tick for a directory.
+void dir_cache_touch(struct hfs_dir_cache* cache, struct hfs_dentry* dir);
+// Takes dir off the LRU list, before it is dropped or deleted.
+void dir_cache_unlist(struct hfs_dir_cache* cache, struct hfs_dentry* dir);
+// Listed directories, least recently used first.
+void dir_cache_lru(struct hfs_dir_cache* cache, std::vector<struct hfs_dentry*>& dirs);
+
+// The entries file keeps every field the tree needs to rebuild the children
+// of dir, with the record and attributes of packed files and the block
+// index of compressed ones. All return 0 or -errno; dir_load fails with
+// -EIO and loads nothing unless the file reads to its last byte.
+int dir_store(const struct hfs_dentry* dir);
+int dir_load(struct hfs_dentry* dir, std::unordered_map<std::string, struct hfs_dentry*>& childs);
+// Removes the entries file before the directory object goes.
+int dir_forget(const struct hfs_dentry* dir);
+
+#endif
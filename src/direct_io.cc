@@ -0,0 +1,146 @@
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "direct_io.h"
+
+static size_t align_up(size_t n) {
+  return (n + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+}
+
+struct hfs_dio_pool* dio_pool_new(size_t buf_size, size_t max_free) {
+  struct hfs_dio_pool* pool = new hfs_dio_pool();
+  pool->buf_size = align_up(buf_size);
+  pool->max_free = max_free;
+  return pool;
+}
+
+void dio_pool_free(struct hfs_dio_pool* pool) {
+  for(char *buf : pool->free) {
+    free(buf);
+  }
+  delete pool;
+}
+
+char* dio_get(struct hfs_dio_pool* pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if(!pool->free.empty()) {
+      char *buf = pool->free.back();
+      pool->free.pop_back();
+      return buf;
+    }
+  }
+  return (char*) aligned_alloc(DIO_ALIGN, pool->buf_size);
+}
+
+void dio_put(struct hfs_dio_pool* pool, char *buf) {
+  if(buf == nullptr) {
+    return ;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if(pool->free.size() < pool->max_free) {
+      pool->free.push_back(buf);
+      return ;
+    }
+  }
+  free(buf);
+}
+
+bool dio_aligned(const void *buf, size_t size, off_t off) {
+  return (uintptr_t)buf % DIO_ALIGN == 0 && size % DIO_ALIGN == 0 && off % DIO_ALIGN == 0;
+}
+
+// Aligned reads straight into buf, stops at the end of the file.
+static ssize_t pread_aligned(int fd, char *buf, size_t size, off_t off) {
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = pread(fd, buf + done, size - done, off + done);
+    if(n == -1) {
+      return -errno;
+    }
+    done += n;
+    if(n == 0 || done % DIO_ALIGN != 0) {
+      break;
+    }
+  }
+  return done;
+}
+
+static ssize_t pwrite_aligned(int fd, const char *buf, size_t size, off_t off) {
+  size_t done = 0;
+  while(done < size) {
+    ssize_t n = pwrite(fd, buf + done, size - done, off + done);
+    if(n == -1) {
+      return -errno;
+    }
+    done += n;
+  }
+  return done;
+}
+
+ssize_t dio_pread(struct hfs_dio_pool* pool, int fd, char *buf, size_t size, off_t off) {
+  if(dio_aligned(buf, size, off)) {
+    return pread_aligned(fd, buf, size, off);
+  }
+  char *bounce = dio_get(pool);
+  if(bounce == nullptr) {
+    return -ENOMEM;
+  }
+  size_t done = 0;
+  ssize_t state = 0;
+  while(done < size) {
+    off_t pos = (off + done) / DIO_ALIGN * DIO_ALIGN;
+    size_t skip = off + done - pos;
+    size_t len = std::min(pool->buf_size, align_up(skip + size - done));
+    ssize_t n = pread_aligned(fd, bounce, len, pos);
+    if(n < 0) {
+      state = n;
+      break;
+    }
+    if((size_t)n <= skip) {
+      break;
+    }
+    size_t got = std::min<size_t>(n - skip, size - done);
+    memcpy(buf + done, bounce + skip, got);
+    done += got;
+    if((size_t)n < len) {
+      break;
+    }
+  }
+  dio_put(pool, bounce);
+  return state != 0 ? state : done;
+}
+
+ssize_t dio_pwrite(struct hfs_dio_pool* pool, int fd, const char *buf, size_t size, off_t off) {
+  if(dio_aligned(buf, size, off)) {
+    return pwrite_aligned(fd, buf, size, off);
+  }
+  if(off % DIO_ALIGN != 0) {
+    return -EINVAL;
+  }
+  char *bounce = dio_get(pool);
+  if(bounce == nullptr) {
+    return -ENOMEM;
+  }
+  size_t done = 0;
+  ssize_t state = 0;
+  while(done < size) {
+    size_t len = std::min(pool->buf_size, size - done);
+    memcpy(bounce, buf + done, len);
+    size_t padded = align_up(len);
+    memset(bounce + len, 0, padded - len);
+    ssize_t n = pwrite_aligned(fd, bounce, padded, off + done);
+    if(n < 0) {
+      state = n;
+      break;
+    }
+    done += len;
+  }
+  dio_put(pool, bounce);
+  return state != 0 ? state : size;
+}
@@ -0,0 +1,35 @@
+#ifndef _HYBRIDFS_DIRECT_IO_H
+#define _HYBRIDFS_DIRECT_IO_H
+
+#include <sys/types.h>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Offsets, lengths and memory of O_DIRECT requests are multiples of this.
+static constexpr size_t DIO_ALIGN = 4096;
+
+// Aligned buffers for O_DIRECT requests that cannot use the memory of the
+// caller, and for migration copies. Buffers are kept for reuse instead of
+// being freed.
+struct hfs_dio_pool {
+  std::mutex lock;
+  size_t buf_size;          // multiple of DIO_ALIGN
+  size_t max_free;          // buffers kept for reuse
+  std::vector<char*> free;
+};
+
+struct hfs_dio_pool* dio_pool_new(size_t buf_size, size_t max_free);
+void dio_pool_free(struct hfs_dio_pool* pool);
+char* dio_get(struct hfs_dio_pool* pool);
+void dio_put(struct hfs_dio_pool* pool, char *buf);
+
+bool dio_aligned(const void *buf, size_t size, off_t off);
+// pread/pwrite on an fd opened with O_DIRECT, going through pool buffers
+// when buf, size or off are not aligned. Reads stop short at the end of the
+// file. off of a write must be aligned, a write of a size that is not is
+// padded with zeros to the next multiple, for the caller to truncate.
+ssize_t dio_pread(struct hfs_dio_pool* pool, int fd, char *buf, size_t size, off_t off);
+ssize_t dio_pwrite(struct hfs_dio_pool* pool, int fd, const char *buf, size_t size, off_t off);
+
+#endif
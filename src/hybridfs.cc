@@ -1,12 +1,32 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <thread>
 #include <vector>
 #include <filesystem>
 
+#include <fuse3/fuse_lowlevel.h>
 #include <spdlog/spdlog.h>
 
+#include "backing.h"
+#include "compress.h"
+#include "dedup.h"
+#include "dir_cache.h"
+#include "direct_io.h"
 #include "hybridfs.h"
+#include "mem_cache.h"
+#include "pack.h"
+#include "passthrough.h"
+#include "readahead.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "write_buffer.h"
+
+struct hfs_meta* hfs_global_meta = nullptr;
 
 void split_path(const char *path, std::vector<std::string>& d_names) {
   d_names.clear();
@@ -15,8 +35,8 @@ void split_path(const char *path, std::vector<std::string>& d_names) {
     head++;
   }
 
-  uint32_t len = 1;
   while(path[head] != 0) {
+    uint32_t len = 1;
     while(path[head + len] != '/' && path[head + len] != 0) {
       len++;
     }
@@ -32,12 +52,50 @@ void split_path(const char *path, std::vector<std::string>& d_names) {
   }
 }
 
+// Brings back the children of a directory the dentry cache dropped.
+int load_dir(struct hfs_dentry* dir) {
+  if(dir->d_loaded.load(std::memory_order_acquire)) {
+    return 0;
+  }
+  struct hfs_dir_cache* cache = HFS_META->dir_cache;
+  std::lock_guard<std::mutex> lock(cache->load_lock);
+  if(dir->d_loaded.load(std::memory_order_relaxed)) {
+    return 0;
+  }
+  auto childs = new std::unordered_map<std::string, struct hfs_dentry*>();
+  int load_state = dir_load(dir, *childs);
+  if(load_state != 0) {
+    spdlog::error("[dir_cache] failed to load object {}: {}", object_path(dir->d_oid), load_state);
+    delete childs;
+    return load_state;
+  }
+  for(auto it = childs->begin(); it != childs->end(); it++) {
+    if(it->second->d_layout == FileLayout::PACKED) {
+      pack_attach(HFS_META->packer, it->second);
+    }
+  }
+  dir->d_childs = childs;
+  dir->d_loaded.store(true, std::memory_order_release);
+  cache->loads++;
+  dir_cache_count(cache, childs->size());
+  return 0;
+}
+
+// Loads dir if needed and stamps the lookup, false if it can not be read.
+bool enter_dir(struct hfs_dentry* dir) {
+  if(load_dir(dir) != 0) {
+    return false;
+  }
+  dir_cache_touch(HFS_META->dir_cache, dir);
+  return true;
+}
+
 struct hfs_dentry* find_dentry(const char *path) {
   std::vector<std::string> dnames;
   split_path(path, dnames);
   struct hfs_dentry* target_dentry = HFS_META->root_dentry;
   for(size_t i = 0; i < dnames.size(); i++) {
-    if(target_dentry->d_type != FileType::DIRECTORY) {
+    if(target_dentry->d_type != FileType::DIRECTORY || !enter_dir(target_dentry)) {
       return nullptr;
     }
     auto it = target_dentry->d_childs->find(dnames[i]);
@@ -54,7 +112,7 @@ struct hfs_dentry* find_parent_dentry(const char *path) {
   split_path(path, dnames);
   struct hfs_dentry* target_dentry = HFS_META->root_dentry;
   for(size_t i = 0; i < dnames.size() - 1; i++) {
-    if(target_dentry->d_type != FileType::DIRECTORY) {
+    if(target_dentry->d_type != FileType::DIRECTORY || !enter_dir(target_dentry)) {
       return nullptr;
     }
     auto it = target_dentry->d_childs->find(dnames[i]);
@@ -63,53 +121,1514 @@ struct hfs_dentry* find_parent_dentry(const char *path) {
     }
     target_dentry = it->second;
   }
+  // callers look up or add the last name
+  if(target_dentry->d_type == FileType::DIRECTORY && !enter_dir(target_dentry)) {
+    return nullptr;
+  }
   return target_dentry;
 }
 
+// Adds a new dentry to a loaded directory, with the tree lock held
+// exclusively like every change of a d_childs.
+void add_child(struct hfs_dentry* parent, const std::string& name, struct hfs_dentry* child) {
+  parent->d_childs->insert(std::make_pair(name, child));
+  dir_cache_count(HFS_META->dir_cache, 1);
+}
+
+std::string backing_root(struct hfs_dentry* dentry) {
+  // directory objects live on the first device, striped files keep the
+  // attributes on their first piece
+  return piece_device(dentry_place(dentry), 0)->path;
+}
+
+// Name of the object of dentry below a device root.
+std::string backing_name(const struct hfs_dentry* dentry) {
+  return object_path(dentry->d_oid);
+}
+
+// Full path of the object, for the xattr calls that have no *at form.
+std::string backing_real_path(struct hfs_dentry* dentry) {
+  return backing_root(dentry) + backing_name(dentry);
+}
+
+// Directory fd and name of the first piece of dentry for *at calls, name
+// points into obj.
+int dentry_at(const struct hfs_dentry* dentry, std::string& obj, const char*& name) {
+  obj = backing_name(dentry);
+  return backing_dirfd(dentry_place(dentry), 0, obj, name);
+}
+
+uint64_t new_object() {
+  return HFS_META->next_oid++;
+}
+
+// Tells the trace which file the running operation works on.
+void trace_dentry(const struct hfs_dentry* dentry, int64_t off = 0, int64_t size = 0) {
+  trace_target(dentry->d_oid, dentry->d_area, off, size);
+}
+
+int32_t pick_device(int32_t area, int64_t size) {
+  int32_t dev = tier_pick_device(HFS_META->tiers[area], size);
+  return dev == -1 ? 0 : dev;
+}
+
+void update_size(struct hfs_dentry* dentry, int64_t size) {
+  int64_t old_size = dentry->d_size.exchange(size);
+  HFS_META->tiers[dentry->d_area]->used += size - old_size;
+}
+
+void grow_size(struct hfs_dentry* dentry, int64_t end) {
+  int64_t old_size = dentry->d_size.load();
+  while(end > old_size) {
+    if(dentry->d_size.compare_exchange_weak(old_size, end)) {
+      HFS_META->tiers[dentry->d_area]->used += end - old_size;
+      return ;
+    }
+  }
+}
+
+void move_mark(struct hfs_move* mv, int64_t off, int64_t len);
+
+// Takes dentry out of the deduplication index, before its content or place
+// changes.
+void forget_content(struct hfs_dentry* dentry) {
+  if(dentry->d_fp.load(std::memory_order_relaxed) == nullptr) {
+    return ;
+  }
+  struct hfs_fingerprint* fp = dentry->d_fp.exchange(nullptr);
+  if(fp != nullptr) {
+    dedup_remove(HFS_META->dedup, *fp, dentry->d_oid);
+    delete fp;
+  }
+}
+
+// Whether the backing file has more names than dentry. Each name has a
+// dentry of its own, a write through another one does not show in this
+// dentry's size or write sequence. Packed files are unpacked to be linked.
+bool hard_linked(const struct hfs_dentry* dentry) {
+  std::string obj;
+  const char *name;
+  struct stat st;
+  if(dentry->d_layout == FileLayout::PACKED) {
+    return false;
+  }
+  int dirfd = dentry_at(dentry, obj, name);
+  return fstatat(dirfd, name, &st, 0) != 0 || st.st_nlink != 1;
+}
+
+// Offers a whole file on a deduplicated tier to later files with the same
+// content. Files with hard links change behind the dentry and are left out.
+void index_content(struct hfs_dentry* dentry, const struct hfs_fingerprint& fp) {
+  if(dentry->d_layout != FileLayout::WHOLE || hard_linked(dentry)) {
+    return ;
+  }
+  dedup_insert(HFS_META->dedup, fp, {dentry->d_oid, dentry->d_area, dentry->d_dev, dentry->d_size});
+  delete dentry->d_fp.exchange(new hfs_fingerprint(fp));
+}
+
+// [off, off + len) of the backing data changed.
+void data_changed(struct hfs_dentry* dentry, int64_t off, int64_t len) {
+  forget_content(dentry);
+  dentry->d_write_seq.fetch_add(1);
+  if(dentry->d_move != nullptr) {
+    move_mark(dentry->d_move, off, len);
+  }
+}
+
+// Moves a packed file into a whole backing file, for files outgrowing the
+// pack threshold and operations that need a backing file. With the tree
+// lock held exclusively, see require_unpacked.
+int unpack_file(struct hfs_dentry* dentry) {
+  if(dentry->d_layout != FileLayout::PACKED) {
+    return 0;
+  }
+  return pack_unpack(HFS_META->packer, dentry, backing_name(dentry));
+}
+
+std::string dentry_path(const struct hfs_dentry* dentry) {
+  std::string path;
+  for(; dentry->d_parent != nullptr; dentry = dentry->d_parent) {
+    path = "/" + dentry->d_name + path;
+  }
+  return path;
+}
+
+void flush_dirty(struct hfs_dentry* dentry, const char *path, bool discard = false, struct hfs_handle* keep = nullptr);
+
+// A file on its way to another tier. The data goes to a temporary name on
+// the target devices first, the commit moves it into place.
+struct hfs_migration {
+  struct hfs_dentry* dentry;
+  std::string path;
+  std::string obj;          // backing name, the same on both sides
+  int64_t size;
+  uint64_t version;         // d_version and d_write_seq the copy was taken at
+  uint64_t write_seq;
+  struct hfs_place from;
+  struct hfs_place to;
+  std::string tmp_path;
+  std::chrono::steady_clock::time_point start;
+  struct hfs_fingerprint fp{};  // content at write_seq, when fp_valid
+  bool fp_valid = false;
+};
+
+// Size placement decisions go by, what the file holds, was allocated for or
+// is expected to reach.
+int64_t placement_size(const struct hfs_dentry* dentry) {
+  return std::max({dentry->d_size.load(), dentry->d_alloc.load(), dentry->d_expect.load()});
+}
+
+void migration_start(struct hfs_migration& m, struct hfs_dentry* dentry, const std::string& path, int32_t target_area) {
+  m = {dentry, path, backing_name(dentry), dentry->d_size, dentry->d_version, dentry->d_write_seq, dentry_place(dentry),
+       choose_place(target_area, placement_size(dentry)), backing_tmp_path(), std::chrono::steady_clock::now()};
+}
+
+int migration_copy(struct hfs_migration& m) {
+  spdlog::info("[migrate] migrate {} from tier {} device {} to tier {} device {} width {}", m.path, m.from.area, m.from.dev, m.to.area, m.to.dev, piece_count(m.to));
+  int state = backing_copy(m.from, m.obj, m.to, m.tmp_path, m.size);
+  if(state != 0) {
+    backing_unlink(m.to, m.tmp_path);
+  }
+  return state;
+}
+
+// Puts the copy of m in place of the file. With the tree lock held
+// exclusively.
+int migration_commit(struct hfs_migration& m) {
+  if(m.dentry->d_passthrough > 0 || m.dentry->d_passthrough_rw > 0) {
+    // the kernel keeps using the old file, the last release queues it again
+    spdlog::info("[migrate] {} was opened for passthrough during the copy", m.path);
+    backing_unlink(m.to, m.tmp_path);
+    return -EBUSY;
+  }
+  int state = backing_copy_attrs(m.from, m.obj, m.to, m.tmp_path);
+  if(state == 0) {
+    state = backing_rename(m.to, m.tmp_path, m.obj);
+  }
+  if(state != 0) {
+    backing_unlink(m.to, m.tmp_path);
+    return state;
+  }
+  backing_unlink(m.from, m.obj);
+  struct hfs_dentry* dentry = m.dentry;
+  forget_content(dentry);
+  trace_event(TraceOp::MIGRATE, dentry->d_oid, m.to.area, m.from.area, m.size, m.start);
+  HFS_META->tiers[dentry->d_area]->used -= dentry->d_size;
+  HFS_META->tiers[m.to.area]->used += dentry->d_size;
+  dentry->d_area = m.to.area;
+  dentry->d_dev = m.to.dev;
+  dentry->d_layout = m.to.layout;
+  dentry->d_width = m.to.width;
+  dentry->d_cindex = m.to.cindex;
+  dentry->d_version++;
+  if(m.fp_valid && dentry->d_write_seq == m.write_seq) {
+    index_content(dentry, m.fp);
+  }
+  return 0;
+}
+
+// Migrates dentry right away. With the tree lock held exclusively, no write
+// lands between the copy and the switch. Files passed through or owned by a
+// background migration are left to it.
+void migrate_file(struct hfs_dentry* dentry, const char* path, int32_t target_area) {
+  if(dentry->d_passthrough > 0 || dentry->d_move != nullptr || sched_queued(HFS_META->scheduler, dentry)) {
+    spdlog::info("[migrate] {} is busy, left in place", path);
+    return ;
+  }
+  flush_dirty(dentry, path);
+  struct hfs_migration m;
+  migration_start(m, dentry, path, target_area);
+  if(migration_copy(m) != 0 || migration_commit(m) != 0) {
+    spdlog::info("[migrate] failed to migrate {}", path);
+  }
+}
+
+// Copies [from, to) of a compressed file, appended since the copy of m was
+// taken, from now, where the file is, to the copy.
+int rewrite_tail(struct hfs_migration& m, const struct hfs_place& now, int64_t from, int64_t to) {
+  if(from >= to) {
+    return 0;
+  }
+  std::vector<int> from_fds, to_fds;
+  int state = backing_open(now, m.obj, O_RDONLY, 0, from_fds);
+  if(state != 0) {
+    return state;
+  }
+  state = backing_open(m.to, m.tmp_path, O_RDWR, 0, to_fds);
+  if(state != 0) {
+    backing_close(from_fds);
+    return state;
+  }
+  std::vector<char> buf(std::min(to - from, HFS_META->migrate_chunk));
+  for(int64_t off = from; state == 0 && off < to; off += buf.size()) {
+    int64_t len = std::min<int64_t>(buf.size(), to - off);
+    ssize_t read_size = backing_pread(now, from_fds, buf.data(), len, off, to);
+    if(read_size != len) {
+      state = read_size < 0 ? read_size : -EIO;
+    } else if(m.to.layout == FileLayout::COMPRESSED) {
+      std::shared_ptr<const struct hfs_cindex> next;
+      state = compress_append(to_fds[0], *m.to.cindex, buf.data(), len, HFS_META->compress_level, next);
+      if(state == 0) {
+        m.to.cindex = next;
+      }
+    } else {
+      ssize_t write_size = backing_pwrite(m.to, to_fds, buf.data(), len, off);
+      state = write_size < 0 ? write_size : write_size != len ? -EIO : 0;
+    }
+  }
+  backing_close(from_fds);
+  backing_close(to_fds);
+  return state;
+}
+
+// Whether dentry is still the compressed file m copied. While it is, the
+// only writes it took are appends. With the tree lock held.
+bool rewrite_unchanged(const struct hfs_migration& m, const struct hfs_dentry* dentry) {
+  return dentry == m.dentry && backing_name(dentry) == m.obj && dentry->d_version == m.version &&
+         dentry->d_layout == FileLayout::COMPRESSED;
+}
+
+// Rewrites a compressed file on the same device as layout: WHOLE before it
+// is modified, unless the write is an append at append, which keeps it
+// compressed, or COMPRESSED again to drop the old last blocks appends left
+// behind once they outweigh the live ones. Like a migration, the copy goes
+// to a temporary name without the tree lock, appends made meanwhile are
+// copied after it, the last migrate_chunk bytes of them with the tree lock
+// held exclusively for the switch. Called without the tree lock.
+int rewrite_compressed(const char* path, FileLayout layout, off_t append) {
+  while(true) {
+    struct hfs_migration m;
+    {
+      hfs_shared_guard guard;
+      struct hfs_dentry* dentry = find_dentry(path);
+      if(dentry == nullptr || dentry->d_layout != FileLayout::COMPRESSED) {
+        return 0;
+      }
+      if(layout == FileLayout::WHOLE ? append == dentry->d_size : !compress_wasteful(*std::atomic_load(&dentry->d_cindex))) {
+        return 0;
+      }
+      spdlog::info("[compress] rewrite {} as {}", path, layout == FileLayout::WHOLE ? "plain" : "compressed");
+      m = {dentry, path, backing_name(dentry), dentry->d_size, dentry->d_version, dentry->d_write_seq, dentry_place(dentry),
+           {dentry->d_area, dentry->d_dev, layout, 1}, backing_tmp_path(), std::chrono::steady_clock::now()};
+    }
+    int state = backing_copy(m.from, m.obj, m.to, m.tmp_path, m.size);
+    int64_t copied = m.size;
+    while(true) {
+      struct hfs_place now;
+      int64_t size;
+      {
+        hfs_exclusive_guard guard;
+        struct hfs_dentry* dentry = find_dentry(path);
+        if(!rewrite_unchanged(m, dentry)) {
+          // replaced meanwhile, also what a failed copy may have read
+          spdlog::info("[compress] {} changed during the rewrite", path);
+          state = -ESTALE;
+          break;
+        }
+        if(state != 0) {
+          break;
+        }
+        now = dentry_place(dentry);
+        size = dentry->d_size;
+        if(size - copied <= HFS_META->migrate_chunk) {
+          state = rewrite_tail(m, now, copied, size);
+          if(state == 0) {
+            state = backing_copy_attrs(m.from, m.obj, m.to, m.tmp_path);
+          }
+          if(state == 0) {
+            state = backing_rename(m.to, m.tmp_path, m.obj);
+          }
+          if(state != 0) {
+            break;
+          }
+          dentry->d_layout = layout;
+          dentry->d_width = 1;
+          std::atomic_store(&dentry->d_cindex, m.to.cindex);
+          dentry->d_version++;
+          return 0;
+        }
+      }
+      state = rewrite_tail(m, now, copied, size);
+      copied = size;
+    }
+    backing_unlink(m.to, m.tmp_path);
+    if(state != -ESTALE) {
+      return state;
+    }
+  }
+}
+
+int uncompress_file(const char* path, off_t append = -1) {
+  return rewrite_compressed(path, FileLayout::WHOLE, append);
+}
+
+int recompress_file(const char* path) {
+  return rewrite_compressed(path, FileLayout::COMPRESSED, -1);
+}
+
+// Operations that would rewrite a compressed file return -ESTALE, for the
+// caller to have it made plain by make_plain and go again.
+int require_plain(const struct hfs_dentry* dentry) {
+  return dentry->d_layout == FileLayout::COMPRESSED ? -ESTALE : 0;
+}
+
+// Same for operations that need a packed file in a backing file of its own.
+// Unpacking frees d_attr and switches d_layout, which operations holding
+// the tree lock shared look at without the packer lock.
+int require_unpacked(const struct hfs_dentry* dentry) {
+  return dentry->d_layout == FileLayout::PACKED ? -ESTALE : 0;
+}
+
+int unpack_path(const char* path) {
+  hfs_exclusive_guard guard;
+  struct hfs_dentry* dentry = find_dentry(path);
+  if(dentry == nullptr || dentry->d_type != FileType::REGULAR) {
+    // gone meanwhile, the operation finds out when it goes again
+    return 0;
+  }
+  return unpack_file(dentry);
+}
+
+// Makes the file at path plain for an operation that returned -ESTALE, see
+// uncompress_file for append. Called without the tree lock.
+int make_plain(const char* path, off_t append = -1) {
+  int state = unpack_path(path);
+  return state != 0 ? state : uncompress_file(path, append);
+}
+
+// Reads a file through fds opened for place. The record of a packed file
+// moves with every write, it is read through the packer instead.
+ssize_t read_at(const struct hfs_dentry* dentry, const struct hfs_place& place, const std::vector<int>& fds, char *buf, size_t size, off_t off) {
+  if(place.layout == FileLayout::PACKED) {
+    return pack_read(HFS_META->packer, dentry, buf, size, off);
+  }
+  return backing_pread(place, fds, buf, size, off, dentry->d_size);
+}
+
+// Catches up with an open that truncated the file. With the tree lock held
+// exclusively, readers of a compressed file do not go on with its old index.
+void open_truncated(struct hfs_dentry* dentry) {
+  flush_dirty(dentry, nullptr, true);
+  int64_t old_size = dentry->d_size;
+  if(dentry->d_layout == FileLayout::PACKED) {
+    pack_truncate(HFS_META->packer, dentry, 0);
+  } else if(dentry->d_layout == FileLayout::COMPRESSED) {
+    // blocks and index went alike
+    dentry->d_layout = FileLayout::WHOLE;
+    std::atomic_store(&dentry->d_cindex, std::shared_ptr<const struct hfs_cindex>());
+    dentry->d_version++;
+  }
+  data_changed(dentry, 0, old_size);
+  update_size(dentry, 0);
+  dentry->d_alloc = 0;
+}
+
+// Tier the file belongs on now.
+int32_t migrate_target(struct hfs_dentry* dentry) {
+  if(dentry->d_layout == FileLayout::PACKED) {
+    // packed files stay on the first tier until unpacked
+    return dentry->d_area;
+  }
+  int32_t pin = dentry->d_pin;
+  if(pin != -1) {
+    return pin;
+  }
+  int32_t prefer = dentry->d_prefer;
+  int32_t target_area = tier_for_size(HFS_META->tiers, dentry->d_area, placement_size(dentry));
+  if(target_area < prefer) {
+    // not promoted past the preferred tier, moved down to it if it has room
+    bool down = dentry->d_area < prefer && tier_has_space(HFS_META->tiers[prefer], placement_size(dentry));
+    return down ? prefer : dentry->d_area;
+  }
+  return target_area;
+}
+
+void maybe_migrate(struct hfs_dentry* dentry, const char* path) {
+  if(migrate_target(dentry) != dentry->d_area) {
+    spdlog::info("[migrate] queue {}", path);
+    sched_enqueue(HFS_META->scheduler, dentry);
+  }
+}
+
+// A background migration of a whole or striped file, copied chunk by chunk
+// while the file stays writable. Writes to chunks the copy has passed mark
+// them dirty, they are copied again, and only the last few are copied with
+// the tree lock held before the switch. The progress is kept with the
+// dentry, a migration that makes way for other files picks up where it
+// stopped.
+struct hfs_move {
+  struct hfs_migration m;
+  int64_t chunk;
+  bool created = false;       // the target exists
+  bool running = false;       // owned by the scheduler thread
+  std::mutex lock;            // cursor and dirty, taken by writers
+  int64_t cursor = 0;         // chunks below it were copied once
+  std::set<int64_t> dirty;    // of those, chunks written since
+  int32_t passes = 0;         // rounds over dirty chunks
+  int64_t round_pos = 0;      // where the current round is
+  int32_t backoffs = 0;       // switches put off, owned by the scheduler thread
+};
+
+// Dirty chunks the switch copies with writers held off, and the rounds
+// over dirty chunks before it does so with up to MOVE_SWITCH_MAX left.
+// With more, writers outrun the copy: the move waits MOVE_BACKOFF, twice
+// as long every time up to 64 times, and starts its rounds over.
+static constexpr size_t MOVE_SWITCH_CHUNKS = 4;
+static constexpr int32_t MOVE_MAX_PASSES = 8;
+static constexpr size_t MOVE_SWITCH_MAX = 16;
+static constexpr std::chrono::milliseconds MOVE_BACKOFF{10};
+
+void move_mark(struct hfs_move* mv, int64_t off, int64_t len) {
+  if(len <= 0) {
+    return ;
+  }
+  std::lock_guard<std::mutex> lock(mv->lock);
+  for(int64_t i = off / mv->chunk; i <= (off + len - 1) / mv->chunk && i < mv->cursor; i++) {
+    mv->dirty.insert(i);
+  }
+}
+
+bool move_ok(const struct hfs_migration& m) {
+  auto plain = [](FileLayout layout) { return layout == FileLayout::WHOLE || layout == FileLayout::STRIPED; };
+  return plain(m.from.layout) && plain(m.to.layout);
+}
+
+// Gives up a move, the caller unhooks it from a living dentry.
+void move_drop(struct hfs_move* mv) {
+  if(mv->created) {
+    backing_unlink(mv->m.to, mv->m.tmp_path);
+  }
+  delete mv;
+}
+
+// Next chunk to copy and whether it was copied before, false when only the
+// switch is left. With the tree lock held.
+bool move_next(struct hfs_move* mv, int64_t size, int64_t& chunk, bool& refill) {
+  std::lock_guard<std::mutex> lock(mv->lock);
+  if(mv->cursor * mv->chunk < size) {
+    // past the cursor before it is copied, writes meanwhile mark it
+    chunk = mv->cursor++;
+    refill = false;
+    return true;
+  }
+  if(mv->dirty.size() <= MOVE_SWITCH_CHUNKS || mv->passes >= MOVE_MAX_PASSES) {
+    return false;
+  }
+  // rounds go up the file, a chunk written all the time waits for the next
+  auto it = mv->dirty.lower_bound(mv->round_pos);
+  if(it == mv->dirty.end()) {
+    it = mv->dirty.begin();
+    mv->passes++;
+  }
+  // taken off before it is copied, same reason
+  chunk = *it;
+  mv->dirty.erase(it);
+  mv->round_pos = chunk + 1;
+  refill = true;
+  return true;
+}
+
+// Copies what is left with writers held off and moves the file over, or
+// -EAGAIN when too much is left. With the tree lock held exclusively.
+int move_switch(struct hfs_dentry* dentry, struct hfs_move* mv, struct hfs_copy_fds& fds) {
+  flush_dirty(dentry, mv->m.path.c_str());
+  int64_t size = dentry->d_size;
+  std::set<int64_t> chunks = mv->dirty;
+  for(int64_t i = mv->cursor; i * mv->chunk < size; i++) {
+    chunks.insert(i);
+  }
+  if(chunks.size() > MOVE_SWITCH_MAX) {
+    spdlog::info("[migrate] {} backs off with {} chunks left", mv->m.path, chunks.size());
+    mv->passes = 0;
+    mv->backoffs++;
+    backing_copy_close(fds);
+    return -EAGAIN;
+  }
+  spdlog::info("[migrate] switch {} with {} chunks left", mv->m.path, chunks.size());
+  // operations wait, no throttling
+  io_background = false;
+  int state = 0;
+  for(int64_t i : chunks) {
+    state = backing_copy_range(mv->m.from, mv->m.to, fds, i * mv->chunk, mv->chunk, size, i < mv->cursor);
+    if(state != 0) {
+      break;
+    }
+  }
+  io_background = true;
+  backing_copy_close(fds);
+  if(state == 0) {
+    state = backing_truncate(mv->m.to, mv->m.tmp_path, size);
+  }
+  if(state != 0) {
+    return state;
+  }
+  mv->m.size = size;
+  state = migration_commit(mv->m);
+  if(state == 0) {
+    // the target is the file now
+    mv->created = false;
+  }
+  return state;
+}
+
+// Runs a move until it is done or other work is waiting.
+void move_run(struct hfs_dentry* dentry, struct hfs_move* mv) {
+  struct hfs_copy_fds fds;
+  int state = backing_copy_open(mv->m.from, mv->m.obj, mv->m.to, mv->m.tmp_path, !mv->created, fds);
+  bool open = state == 0;
+  mv->created = mv->created || open;
+  bool yield = false;
+  while(state == 0 && !yield) {
+    int64_t chunk, size;
+    bool refill;
+    {
+      hfs_exclusive_guard guard;
+      if(sched_cancelled(HFS_META->scheduler, dentry)) {
+        break;
+      }
+      if(dentry->d_version != mv->m.version) {
+        state = -ESTALE;
+        break;
+      }
+      if(!move_next(mv, dentry->d_size, chunk, refill)) {
+        open = false;
+        state = move_switch(dentry, mv, fds);
+        if(state == 0) {
+          dentry->d_move = nullptr;
+          move_drop(mv);
+          return ;
+        }
+        break;
+      }
+      size = dentry->d_size;
+    }
+    state = backing_copy_range(mv->m.from, mv->m.to, fds, chunk * mv->chunk, mv->chunk, size, refill);
+    yield = sched_should_yield(HFS_META->scheduler);
+  }
+  if(open) {
+    backing_copy_close(fds);
+  }
+  if(state == -EAGAIN) {
+    // the copy resumes once the writes calm down
+    std::this_thread::sleep_for(MOVE_BACKOFF * (1 << std::min(mv->backoffs - 1, 6)));
+    state = 0;
+  }
+  hfs_exclusive_guard guard;
+  if(sched_cancelled(HFS_META->scheduler, dentry)) {
+    spdlog::info("[migrate] {} deleted during the copy", mv->m.path);
+    move_drop(mv);
+    return ;
+  }
+  if(state != 0) {
+    spdlog::info("[migrate] failed to migrate {} with {}", mv->m.path, state);
+    dentry->d_move = nullptr;
+    move_drop(mv);
+    if(state == -ESTALE) {
+      // replaced meanwhile, maybe somewhere else
+      maybe_migrate(dentry, dentry_path(dentry).c_str());
+    }
+    return ;
+  }
+  spdlog::info("[migrate] {} paused at chunk {}", mv->m.path, mv->cursor);
+  mv->running = false;
+  sched_enqueue(HFS_META->scheduler, dentry);
+}
+
+// Starts a chunked migration of dentry if m can be one.
+struct hfs_move* move_start(struct hfs_dentry* dentry, const struct hfs_migration& m) {
+  if(!move_ok(m)) {
+    return nullptr;
+  }
+  struct hfs_move* mv = new hfs_move();
+  mv->m = m;
+  mv->chunk = HFS_META->migrate_chunk;
+  dentry->d_move = mv;
+  return mv;
+}
+
+// Whether m demotes a whole file to a deduplicated tier.
+bool dedup_want(const struct hfs_migration& m) {
+  struct hfs_dedup* dd = HFS_META->dedup;
+  if(dd->min_size == 0 || m.size < dd->min_size || m.to.area <= m.from.area ||
+     m.from.layout != FileLayout::WHOLE || m.to.layout != FileLayout::WHOLE ||
+     HFS_META->tiers[m.to.area]->tclass != TierClass::HDD) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(dd->lock);
+  return dd->no_clone.count(m.to.area) == 0;
+}
+
+// Fingerprints the file of m and, when the target tier holds the same
+// content, moves it there by sharing the extents of that file. True when
+// the migration is over, otherwise m carries the fingerprint. Called
+// without the tree lock.
+bool migration_dedup(struct hfs_migration& m) {
+  struct hfs_dedup* dd = HFS_META->dedup;
+  auto charge = [](const struct hfs_place& place) {
+    return [place](int64_t bytes) { sched_throttle(HFS_META->scheduler, piece_device(place, 0), bytes); };
+  };
+  std::vector<int> from_fds;
+  if(backing_open(m.from, m.obj, O_RDONLY, 0, from_fds) != 0) {
+    return false;
+  }
+  struct stat st;
+  // hard links change behind the dentry
+  int state = fstat(from_fds[0], &st) != 0 ? -errno : st.st_nlink != 1 ? -EMLINK : 0;
+  if(state == 0) {
+    state = dedup_fingerprint(from_fds[0], m.size, m.fp, charge(m.from));
+  }
+  if(state != 0) {
+    backing_close(from_fds);
+    return false;
+  }
+  dd->hashed++;
+  m.fp_valid = true;
+  struct hfs_dedup_entry entry;
+  if(!dedup_lookup(dd, m.fp, m.size, m.to.area, entry)) {
+    backing_close(from_fds);
+    return false;
+  }
+  struct hfs_place same{entry.area, entry.dev, FileLayout::WHOLE, 1};
+  std::vector<int> same_fds;
+  state = backing_open(same, object_path(entry.oid), O_RDONLY, 0, same_fds);
+  if(state == 0 && dd->verify) {
+    state = dedup_compare(from_fds[0], same_fds[0], m.size, charge(same)) == 1 ? 0 : -EILSEQ;
+  }
+  backing_close(from_fds);
+  if(state != 0) {
+    spdlog::info("[dedup] {} not shared with object {}: {}", m.path, object_path(entry.oid), state);
+    backing_close(same_fds);
+    return false;
+  }
+  hfs_exclusive_guard guard;
+  struct hfs_dentry* dentry = m.dentry;
+  if(sched_cancelled(HFS_META->scheduler, dentry)) {
+    backing_close(same_fds);
+    return true;
+  }
+  std::string path = dentry_path(dentry);
+  if(dentry->d_version != m.version || dentry->d_write_seq != m.write_seq || path != m.path) {
+    spdlog::info("[dedup] {} changed during the fingerprint", m.path);
+    backing_close(same_fds);
+    maybe_migrate(dentry, path.c_str());
+    return true;
+  }
+  struct hfs_dedup_entry now;
+  if(!dedup_lookup(dd, m.fp, m.size, m.to.area, now) || now.oid != entry.oid) {
+    // changed since the comparison
+    backing_close(same_fds);
+    return false;
+  }
+  // the extents are on the device of the other file
+  m.to.dev = entry.dev;
+  std::vector<int> to_fds;
+  state = backing_open(m.to, m.tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600, to_fds);
+  if(state == 0) {
+    state = dedup_clone(same_fds[0], to_fds[0]);
+    backing_close(to_fds);
+  }
+  backing_close(same_fds);
+  if(state != 0) {
+    backing_unlink(m.to, m.tmp_path);
+    if(state == -EOPNOTSUPP || state == -EXDEV || state == -EINVAL || state == -ENOTTY) {
+      spdlog::info("[dedup] tier {} can not share extents, deduplication off there", HFS_META->tiers[m.to.area]->name);
+      std::lock_guard<std::mutex> lock(dd->lock);
+      dd->no_clone.insert(m.to.area);
+    }
+    return false;
+  }
+  spdlog::info("[dedup] {} shares object {}", m.path, object_path(entry.oid));
+  if(migration_commit(m) != 0) {
+    spdlog::info("[migrate] failed to migrate {}", m.path);
+    return true;
+  }
+  dd->shared++;
+  dd->saved_bytes += m.size;
+  return true;
+}
+
+// Scheduler side of maybe_migrate. The copy runs without the tree lock and
+// is thrown away if the file changed meanwhile, moves of whole and striped
+// files keep going instead, see hfs_move.
+void background_migrate(struct hfs_dentry* dentry) {
+  struct hfs_migration m;
+  struct hfs_move* mv;
+  bool dedup = false;
+  {
+    hfs_exclusive_guard guard;
+    if(sched_cancelled(HFS_META->scheduler, dentry)) {
+      return ;
+    }
+    if(dentry->d_passthrough > 0) {
+      // queued again at the last release
+      spdlog::info("[migrate] {} is passed through, deferred", dentry_path(dentry));
+      return ;
+    }
+    int32_t target_area = migrate_target(dentry);
+    mv = dentry->d_move;
+    if(mv != nullptr && (dentry->d_version != mv->m.version || target_area != mv->m.to.area)) {
+      spdlog::info("[migrate] {} changed, started over", mv->m.path);
+      dentry->d_move = nullptr;
+      move_drop(mv);
+      mv = nullptr;
+    }
+    if(mv == nullptr) {
+      if(target_area == dentry->d_area) {
+        return ;
+      }
+      std::string path = dentry_path(dentry);
+      flush_dirty(dentry, path.c_str());
+      migration_start(m, dentry, path, target_area);
+      dedup = dedup_want(m);
+      if(!dedup) {
+        mv = move_start(dentry, m);
+      }
+    }
+    if(mv != nullptr) {
+      mv->running = true;
+    }
+  }
+  if(dedup) {
+    if(migration_dedup(m)) {
+      return ;
+    }
+    // nothing to share, copied with the fingerprint for later files
+    hfs_exclusive_guard guard;
+    if(sched_cancelled(HFS_META->scheduler, dentry)) {
+      return ;
+    }
+    if(dentry->d_version != m.version || dentry->d_move != nullptr) {
+      maybe_migrate(dentry, dentry_path(dentry).c_str());
+      return ;
+    }
+    mv = move_start(dentry, m);
+    if(mv != nullptr) {
+      mv->running = true;
+    }
+  }
+  if(mv != nullptr) {
+    move_run(dentry, mv);
+    return ;
+  }
+  int copy_state = migration_copy(m);
+  hfs_exclusive_guard guard;
+  if(sched_cancelled(HFS_META->scheduler, dentry)) {
+    spdlog::info("[migrate] {} deleted during the copy", m.path);
+    backing_unlink(m.to, m.tmp_path);
+    return ;
+  }
+  std::string path = dentry_path(dentry);
+  if(dentry->d_version != m.version || dentry->d_write_seq != m.write_seq || path != m.path) {
+    spdlog::info("[migrate] {} changed during the copy", m.path);
+    backing_unlink(m.to, m.tmp_path);
+    maybe_migrate(dentry, path.c_str());
+    return ;
+  }
+  if(copy_state != 0 || migration_commit(m) != 0) {
+    spdlog::info("[migrate] failed to migrate {}", m.path);
+  }
+}
+
+// Tier a new file called name starts on, expect is set to the size it is
+// placed for.
+int32_t new_file_area(struct hfs_dentry* parent, const std::string& name, int64_t& expect) {
+  expect = 0;
+  int32_t pin = parent->d_pin;
+  if(pin != -1) {
+    return pin;
+  }
+  int32_t prefer = parent->d_prefer;
+  if(prefer != -1 && tier_has_space(HFS_META->tiers[prefer], 0)) {
+    return prefer;
+  }
+  expect = admission_expect(HFS_META->admission, parent->d_oid, name);
+  return tier_for_new_file(HFS_META->tiers, expect);
+}
+
+void creator_opened(struct hfs_handle* handle) {
+  handle->created = true;
+  admission_start(HFS_META->admission, &handle->probe);
+}
+
+// A new file streamed in fast goes below the first tier now, while little
+// of it has to be copied.
+void redirect_stream(struct hfs_dentry* dentry, const char *path) {
+  int64_t large_size = HFS_META->admission->large_size;
+  int64_t expect = dentry->d_expect.load();
+  do {
+    if(expect >= large_size) {
+      return ;
+    }
+  } while(!dentry->d_expect.compare_exchange_weak(expect, large_size));
+  spdlog::info("[admission] {} is a stream", path);
+  maybe_migrate(dentry, path);
+}
+
+// The creator is done with a new file: its size goes into the history and
+// places it from now on.
+void creator_closed(struct hfs_handle* handle, const char *path) {
+  struct hfs_dentry* dentry = find_dentry(path);
+  if(dentry == nullptr || dentry->d_oid != handle->oid) {
+    return ;
+  }
+  admission_record(HFS_META->admission, dentry->d_parent->d_oid, dentry->d_name, dentry->d_size);
+  if(dentry->d_expect.exchange(0) != 0) {
+    maybe_migrate(dentry, path);
+  }
+}
+
+void inherit_hints(struct hfs_dentry* dentry, struct hfs_dentry* parent) {
+  dentry->d_pin = parent->d_pin.load();
+  dentry->d_prefer = parent->d_prefer.load();
+}
+
+// Placement hints handled by the file system instead of the backing files:
+//   user.hybridfs.pin       tier name or index, keeps files there
+//   user.hybridfs.prefer    tier name or index, where new files start
+//   user.hybridfs.prefetch  write only, pulls a file or a whole tree in
+//   user.hybridfs.tier      read only, current tier of a file
+//   user.hybridfs.heat      read only, reads served for a file
+// pin and prefer on a directory apply to files created below it later.
+#define HFS_XATTR_PREFIX "user.hybridfs."
+
+bool hint_xattr(const char *name) {
+  return strncmp(name, HFS_XATTR_PREFIX, strlen(HFS_XATTR_PREFIX)) == 0;
+}
+
+void prefetch_file(struct hfs_dentry* dentry, const std::string& path) {
+  flush_dirty(dentry, path.c_str());
+  if(dentry->d_size == 0) {
+    return ;
+  }
+  uint64_t write_seq = dentry->d_write_seq;
+  struct hfs_place place = dentry_place(dentry);
+  std::vector<int> fds;
+  if(backing_open(place, backing_name(dentry), O_RDONLY, 0, fds) != 0) {
+    return ;
+  }
+  spdlog::info("[hint] prefetch {}", path);
+  if(HFS_META->mem_cache->capacity > 0 && dentry->d_size <= HFS_META->mem_cache->max_file_size && !hard_linked(dentry)) {
+    std::vector<char> data(dentry->d_size);
+    if(read_at(dentry, place, fds, data.data(), data.size(), 0) == (ssize_t)data.size()) {
+      mem_cache_admit(HFS_META->mem_cache, dentry, write_seq, data.data(), data.size());
+    }
+  } else {
+    for(int fd : fds) {
+      posix_fadvise(fd, place.pack_off, place.layout == FileLayout::PACKED ? dentry->d_size.load() : 0, POSIX_FADV_WILLNEED);
+    }
+  }
+  backing_close(fds);
+}
+
+// Prefetches the file at path, or adds the entries of the directory at
+// path to children. The tree lock is held shared for it alone.
+void prefetch_node(const std::string& path, std::deque<std::string>& children) {
+  hfs_shared_guard guard;
+  struct hfs_dentry* dentry = find_dentry(path.c_str());
+  if(dentry == nullptr) {
+    return ;
+  }
+  if(dentry->d_type == FileType::REGULAR) {
+    prefetch_file(dentry, path);
+    return ;
+  }
+  if(dentry->d_type != FileType::DIRECTORY || !enter_dir(dentry)) {
+    return ;
+  }
+  for(auto it = dentry->d_childs->begin(); it != dentry->d_childs->end(); it++) {
+    children.push_back(path + "/" + it->first);
+  }
+}
+
+// A tree being prefetched. Each task on the readahead pool takes one file
+// or directory, so the readahead of open files gets in between, and no more
+// than PREFETCH_TASKS are queued at a time, the rest of the tree waits in
+// paths.
+struct hfs_prefetch {
+  std::mutex lock;
+  std::deque<std::string> paths;
+  int32_t tasks = 0;
+};
+
+static constexpr int32_t PREFETCH_TASKS = 2;
+
+void prefetch_step(std::shared_ptr<struct hfs_prefetch> pf, const std::string& path);
+
+void prefetch_more_locked(const std::shared_ptr<struct hfs_prefetch>& pf) {
+  while(pf->tasks < PREFETCH_TASKS && !pf->paths.empty()) {
+    std::string path = std::move(pf->paths.front());
+    pf->paths.pop_front();
+    pf->tasks++;
+    HFS_META->ra_pool->submit([pf, path]() { prefetch_step(pf, path); });
+  }
+}
+
+void prefetch_step(std::shared_ptr<struct hfs_prefetch> pf, const std::string& path) {
+  std::deque<std::string> children;
+  prefetch_node(path, children);
+  std::lock_guard<std::mutex> lock(pf->lock);
+  pf->tasks--;
+  pf->paths.insert(pf->paths.end(), children.begin(), children.end());
+  prefetch_more_locked(pf);
+}
+
+// The walk runs on the readahead pool, the hint returns right away.
+void prefetch_tree(const std::string& path) {
+  std::shared_ptr<struct hfs_prefetch> pf = std::make_shared<struct hfs_prefetch>();
+  std::lock_guard<std::mutex> lock(pf->lock);
+  pf->paths.push_back(path);
+  prefetch_more_locked(pf);
+}
+
+int hint_setxattr(struct hfs_dentry* dentry, const char *path, const char *name, const char *value, size_t size) {
+  std::string key = name + strlen(HFS_XATTR_PREFIX);
+  std::string val(value, size);
+  while(!val.empty() && (val.back() == '\0' || val.back() == '\n')) {
+    val.pop_back();
+  }
+  if(key == "prefetch") {
+    prefetch_tree(strcmp(path, "/") == 0 ? "" : path);
+    return 0;
+  }
+  if(key == "tier" || key == "heat") {
+    return -EPERM;
+  }
+  if(key != "pin" && key != "prefer") {
+    return -ENOTSUP;
+  }
+  int32_t area = tier_by_name(HFS_META->tiers, val);
+  if(area == -1) {
+    spdlog::info("[hint] no tier {}", val);
+    return -EINVAL;
+  }
+  spdlog::info("[hint] {} {} to tier {}", key, path, area);
+  (key == "pin" ? dentry->d_pin : dentry->d_prefer) = area;
+  if(dentry->d_type != FileType::REGULAR || dentry->d_area == area) {
+    return 0;
+  }
+  // files are queued to move, directories only pass the hint on
+  int unpack_state = require_unpacked(dentry);
+  if(unpack_state != 0) {
+    return unpack_state;
+  }
+  maybe_migrate(dentry, path);
+  return 0;
+}
+
+int hint_getxattr(struct hfs_dentry* dentry, const char *name, std::string& val) {
+  std::string key = name + strlen(HFS_XATTR_PREFIX);
+  if(key == "pin" || key == "prefer") {
+    int32_t area = key == "pin" ? dentry->d_pin : dentry->d_prefer;
+    if(area == -1) {
+      return -ENODATA;
+    }
+    val = HFS_META->tiers[area]->name;
+  } else if(key == "tier" && dentry->d_type != FileType::DIRECTORY) {
+    val = HFS_META->tiers[dentry->d_area]->name;
+  } else if(key == "heat" && dentry->d_type != FileType::DIRECTORY) {
+    val = std::to_string(dentry->d_heat.load(std::memory_order_relaxed));
+  } else {
+    return -ENODATA;
+  }
+  return 0;
+}
+
+void hint_listxattr(struct hfs_dentry* dentry, std::string& list) {
+  list.clear();
+  if(dentry->d_pin != -1) {
+    list.append(HFS_XATTR_PREFIX "pin", sizeof(HFS_XATTR_PREFIX "pin"));
+  }
+  if(dentry->d_prefer != -1) {
+    list.append(HFS_XATTR_PREFIX "prefer", sizeof(HFS_XATTR_PREFIX "prefer"));
+  }
+  if(dentry->d_type != FileType::DIRECTORY) {
+    list.append(HFS_XATTR_PREFIX "tier", sizeof(HFS_XATTR_PREFIX "tier"));
+    list.append(HFS_XATTR_PREFIX "heat", sizeof(HFS_XATTR_PREFIX "heat"));
+  }
+}
+
+// Reopens the backing files of a handle whose file has been migrated. With
+// the handle locked.
+int refresh_handle(struct hfs_handle* handle, struct hfs_dentry* dentry, const char* path) {
+  if(handle->version == dentry->d_version) {
+    return 0;
+  }
+  spdlog::info("[handle] reopen migrated file {}", path);
+  readahead_drain(handle->ra);
+  backing_close(handle->fds);
+  backing_close(handle->dio_fds);
+  // the new tier may take O_DIRECT
+  handle->dio_off = false;
+  handle->version = dentry->d_version;
+  return backing_open(dentry_place(dentry), backing_name(dentry), handle->flags & ~(O_CREAT | O_EXCL | O_TRUNC), 0, handle->fds);
+}
+
+// O_DIRECT fds of handle for bulk traffic, nullptr for files not on an hdd
+// tier or laid out so they cannot be read directly. Opened on first use,
+// with the handle locked.
+const std::vector<int>* direct_fds(struct hfs_handle* handle, struct hfs_dentry* dentry, const char* path) {
+  struct hfs_place place = dentry_place(dentry);
+  if(HFS_META->direct_io_size == 0 || handle->dio_off || HFS_META->tiers[place.area]->tclass != TierClass::HDD || !backing_direct_ok(place)) {
+    return nullptr;
+  }
+  if(handle->dio_fds.empty()) {
+    int flags = (handle->flags & O_ACCMODE) | O_DIRECT;
+    int open_state = backing_open(place, backing_name(dentry), flags, 0, handle->dio_fds);
+    if(open_state != 0) {
+      spdlog::info("[handle] no direct I/O for {}: {}", path, open_state);
+      handle->dio_off = open_state == -EINVAL;
+      return nullptr;
+    }
+  }
+  return &handle->dio_fds;
+}
+
+// Registers the backing file of a whole file for kernel passthrough. Files
+// queued for or in a migration, or with writes held back, stay on the
+// daemon path. No migration starts while the handle is open, and one that
+// was copying does not commit.
+bool open_passthrough(struct hfs_dentry* dentry, struct hfs_handle* handle, struct fuse_file_info *fi) {
+#ifdef FUSE_CAP_PASSTHROUGH
+  if(HFS_META->passthrough_fd == -1 || dentry->d_type != FileType::REGULAR || dentry->d_layout != FileLayout::WHOLE ||
+     dentry->d_move != nullptr || dentry->d_dirty > 0 || sched_queued(HFS_META->scheduler, dentry)) {
+    return false;
+  }
+  int backing_id = passthrough_open(HFS_META->passthrough_fd, handle->fds[0]);
+  if(backing_id < 0) {
+    spdlog::info("[open] passthrough of {} failed: {}", backing_name(dentry), backing_id);
+    return false;
+  }
+  fi->backing_id = backing_id;
+  handle->backing_id = backing_id;
+  dentry->d_passthrough++;
+  if((handle->flags & O_ACCMODE) != O_RDONLY) {
+    // what the daemon has cached goes stale
+    handle->passthrough_rw = true;
+    dentry->d_passthrough_rw++;
+    mem_cache_evict(HFS_META->mem_cache, dentry);
+    forget_content(dentry);
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Takes in the size and data passthrough writers changed behind the daemon.
+void sync_passthrough(struct hfs_dentry* dentry) {
+  if(dentry->d_passthrough_rw.load() == 0) {
+    return ;
+  }
+  std::string obj;
+  const char *name;
+  struct stat st;
+  int dirfd = dentry_at(dentry, obj, name);
+  if(fstatat(dirfd, name, &st, 0) != 0) {
+    return ;
+  }
+  if(st.st_size != dentry->d_size) {
+    update_size(dentry, st.st_size);
+  }
+  data_changed(dentry, 0, dentry->d_size);
+}
+
+void close_passthrough(struct hfs_handle* handle, const char *path) {
+  passthrough_close(HFS_META->passthrough_fd, handle->backing_id);
+  struct hfs_dentry* dentry = find_dentry(path);
+  if(dentry == nullptr || dentry->d_oid != handle->oid) {
+    // removed or replaced while open
+    return ;
+  }
+  if(handle->passthrough_rw) {
+    sync_passthrough(dentry);
+    dentry->d_passthrough_rw--;
+  }
+  dentry->d_passthrough--;
+  // migrations wait for the last passthrough handle
+  maybe_migrate(dentry, path);
+}
+
+int open_handle(struct hfs_dentry* dentry, const char* path, int flags, mode_t mode, struct fuse_file_info *fi) {
+  struct hfs_handle* handle = new hfs_handle{flags, dentry->d_version, {}, nullptr};
+  int open_state = backing_open(dentry_place(dentry), backing_name(dentry), flags, mode, handle->fds);
+  if(open_state != 0) {
+    delete handle;
+    return open_state;
+  }
+  handle->ra = readahead_new();
+  handle->oid = dentry->d_oid;
+  bool passthrough = open_passthrough(dentry, handle, fi);
+  if(!passthrough && (flags & O_ACCMODE) != O_RDONLY && (flags & (O_DIRECT | O_SYNC | O_DSYNC)) == 0) {
+    handle->wbuf = wbuf_new(HFS_META->write_back);
+  }
+  fi->fh = (uint64_t)handle;
+  dentry->d_open++;
+  return 0;
+}
+
+// Writes to the backing files, through handle when there is one.
+ssize_t write_through(struct hfs_dentry* target_dentry, const char *path, struct hfs_handle* handle, const char *buf, size_t size, off_t off) {
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    if(off + (off_t)size <= HFS_META->pack_threshold) {
+      spdlog::info("[write] packed write");
+      int pack_state = pack_write(HFS_META->packer, target_dentry, buf, size, off);
+      if(pack_state != 0) {
+        return pack_state;
+      }
+      data_changed(target_dentry, off, size);
+      mem_cache_write(HFS_META->mem_cache, target_dentry, buf, size, off);
+      return size;
+    }
+    // grown out of the container, write_file keeps runs held back within it
+    return require_unpacked(target_dentry);
+  }
+  std::unique_lock<std::mutex> compress_guard(target_dentry->d_compress_lock, std::defer_lock);
+  if(target_dentry->d_layout == FileLayout::COMPRESSED) {
+    // each append builds on the index the last one left
+    compress_guard.lock();
+  }
+  if(target_dentry->d_layout == FileLayout::COMPRESSED && off == target_dentry->d_size) {
+    // appends keep the file compressed
+    spdlog::info("[write] compressed append");
+    struct hfs_place place = dentry_place(target_dentry);
+    std::vector<int> append_fds;
+    int open_state = backing_open(place, backing_name(target_dentry), O_RDWR, 0, append_fds);
+    if(open_state != 0) {
+      return open_state;
+    }
+    std::shared_ptr<const struct hfs_cindex> cindex;
+    int append_state = compress_append(append_fds[0], *place.cindex, buf, size, HFS_META->compress_level, cindex);
+    backing_close(append_fds);
+    if(append_state != 0) {
+      return append_state;
+    }
+    std::atomic_store(&target_dentry->d_cindex, cindex);
+    data_changed(target_dentry, off, size);
+    mem_cache_write(HFS_META->mem_cache, target_dentry, buf, size, off);
+    grow_size(target_dentry, off + size);
+    maybe_migrate(target_dentry, path);
+    return size;
+  }
+  int plain_state = require_plain(target_dentry);
+  if(plain_state != 0) {
+    return plain_state;
+  }
+  // get file fds
+  std::vector<int> local_fds;
+  std::unique_lock<std::mutex> handle_guard;
+  int open_state;
+  if(handle != nullptr) {
+    handle_guard = std::unique_lock<std::mutex>(handle->lock);
+    open_state = refresh_handle(handle, target_dentry, path);
+  } else {
+    spdlog::info("[write] open object: {}", backing_name(target_dentry));
+    open_state = backing_open(dentry_place(target_dentry), backing_name(target_dentry), O_WRONLY, 0, local_fds);
+  }
+  if(open_state != 0) {
+    spdlog::info("[write] failed to open");
+    return open_state;
+  }
+  // the place the fds were opened for
+  struct hfs_place place = dentry_place(target_dentry);
+  // write, large aligned writes on hdd tiers bypass the page cache
+  const std::vector<int>* dio_fds = nullptr;
+  if(handle != nullptr && (int64_t)size >= HFS_META->direct_io_size && size % DIO_ALIGN == 0 && off % DIO_ALIGN == 0) {
+    dio_fds = direct_fds(handle, target_dentry, path);
+  }
+  int write_size;
+  if(dio_fds != nullptr) {
+    spdlog::info("[write] direct write");
+    write_size = backing_pwrite_direct(place, *dio_fds, buf, size, off);
+  } else {
+    spdlog::info("[write] real write");
+    write_size = backing_pwrite(place, handle != nullptr ? handle->fds : local_fds, buf, size, off);
+  }
+  if(handle == nullptr) {
+    spdlog::info("[write] close file");
+    backing_close(local_fds);
+  } else {
+    handle_guard.unlock();
+  }
+  if(write_size < 0) {
+    return write_size;
+  }
+  data_changed(target_dentry, off, write_size);
+  mem_cache_write(HFS_META->mem_cache, target_dentry, buf, write_size, off);
+  grow_size(target_dentry, off + write_size);
+  // maybe migrate
+  maybe_migrate(target_dentry, path);
+  return write_size;
+}
+
+// Writes out the run a handle holds back, with its buffer locked. A failed
+// run is dropped and its error kept for the next flush of the handle.
+int flush_locked(struct hfs_handle* handle, const char *path) {
+  struct hfs_write_buffer* buf = handle->wbuf;
+  if(buf->len == 0) {
+    return 0;
+  }
+  struct hfs_dentry* dentry = buf->dentry;
+  spdlog::info("[write_back] flush {} bytes at {} of {}", buf->len, buf->off, path);
+  ssize_t write_size = write_through(dentry, path, handle, buf->data.data(), buf->len, buf->off);
+  int state = write_size < 0 ? write_size : write_size != (ssize_t)buf->len ? -EIO : 0;
+  if(state != 0) {
+    spdlog::info("[write_back] failed to flush {} with {}", path, state);
+    buf->error = state;
+  }
+  buf->len = 0;
+  HFS_META->write_back->flushes++;
+  return state;
+}
+
+// Writes out the run of a handle and reports what went wrong since the
+// last time, for flush, fsync and release.
+int flush_handle(struct hfs_handle* handle, const char *path) {
+  if(handle->wbuf == nullptr) {
+    return 0;
+  }
+  int state;
+  {
+    std::lock_guard<std::mutex> lock(handle->wbuf->lock);
+    state = flush_locked(handle, path);
+    if(state == 0) {
+      state = handle->wbuf->error;
+    }
+    handle->wbuf->error = 0;
+  }
+  write_back_clean(HFS_META->write_back, handle);
+  return state;
+}
+
+// Writes out (or drops, for files going away) what handles other than keep
+// hold back on dentry, before an operation that looks at the backing files.
+void flush_dirty(struct hfs_dentry* dentry, const char *path, bool discard, struct hfs_handle* keep) {
+  sync_passthrough(dentry);
+  if(dentry->d_dirty.load() == 0) {
+    return ;
+  }
+  struct hfs_write_back* wb = HFS_META->write_back;
+  std::unordered_set<struct hfs_handle*> seen{keep};
+  while(true) {
+    std::unique_lock<std::mutex> wb_lock(wb->lock);
+    struct hfs_handle* handle = write_back_holder_locked(wb, dentry, seen);
+    if(handle == nullptr) {
+      return ;
+    }
+    seen.insert(handle);
+    // registered handles are not freed before their buffer lock is free
+    struct hfs_write_buffer* buf = handle->wbuf;
+    {
+      std::lock_guard<std::mutex> lock(buf->lock);
+      bool held = buf->len > 0 && buf->dentry == dentry;
+      if(!held || discard) {
+        // a dropped run leaves no pointer to the file behind
+        if(held) {
+          buf->len = 0;
+        }
+        write_back_forget_locked(wb, handle, dentry);
+        continue;
+      }
+      wb_lock.unlock();
+      flush_locked(handle, path);
+    }
+    // a release may have freed handle once its buffer was let go, it is
+    // only looked at again while still registered
+    wb_lock.lock();
+    write_back_clean_locked(wb, handle);
+  }
+}
+
+// Takes a small write into the buffer of handle. The run goes out when the
+// write does not continue it, fills it or finds it expired.
+int buffer_write(struct hfs_handle* handle, struct hfs_dentry* dentry, const char *path, const char *data, size_t size, off_t off) {
+  struct hfs_write_buffer* buf = handle->wbuf;
+  {
+    // registered first, and no one sees the buffer before the write is in
+    std::unique_lock<std::mutex> wb_lock(HFS_META->write_back->lock);
+    write_back_mark_locked(HFS_META->write_back, handle, dentry);
+    std::lock_guard<std::mutex> lock(buf->lock);
+    wb_lock.unlock();
+    if(wbuf_expired(HFS_META->write_back, buf)) {
+      flush_locked(handle, path);
+    }
+    size_t done = 0;
+    while(done < size) {
+      size_t n = wbuf_add(buf, dentry, data + done, size - done, off + done);
+      if(n == 0 || wbuf_room(buf) == 0) {
+        int state = flush_locked(handle, path);
+        if(state != 0) {
+          buf->error = 0;
+          return state;
+        }
+      }
+      done += n;
+    }
+  }
+  HFS_META->write_back->writes++;
+  // the backing file changes when the buffer is written out
+  data_changed(dentry, off, 0);
+  mem_cache_write(HFS_META->mem_cache, dentry, data, size, off);
+  return size;
+}
+
+// Whether the children of dir may be dropped, nothing about them lives
+// outside the dentries but what the entries file keeps.
+bool dir_evictable(const struct hfs_dentry* dir) {
+  for(auto it = dir->d_childs->begin(); it != dir->d_childs->end(); it++) {
+    const struct hfs_dentry* child = it->second;
+    if(child->d_type == FileType::DIRECTORY) {
+      if(child->d_loaded.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      continue;
+    }
+    if(child->d_open > 0 || child->d_dirty > 0 || child->d_move != nullptr || child->d_passthrough > 0 || child->d_expect != 0 ||
+       sched_queued(HFS_META->scheduler, child)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the children of dir out and deletes them, returns how many went.
+int64_t drop_dir(struct hfs_dentry* dir) {
+  int store_state = dir_store(dir);
+  if(store_state != 0) {
+    spdlog::error("[dir_cache] failed to store object {}: {}", object_path(dir->d_oid), store_state);
+    return -1;
+  }
+  int64_t dropped = dir->d_childs->size();
+  for(auto it = dir->d_childs->begin(); it != dir->d_childs->end(); it++) {
+    struct hfs_dentry* child = it->second;
+    mem_cache_evict(HFS_META->mem_cache, child);
+    if(child->d_layout == FileLayout::PACKED) {
+      pack_detach(HFS_META->packer, child);
+      delete child->d_attr;
+    }
+    // stays indexed by object id, the fingerprint is in the entries file
+    delete child->d_fp.load();
+    delete child;
+  }
+  dir_cache_unlist(HFS_META->dir_cache, dir);
+  delete dir->d_childs;
+  dir->d_childs = nullptr;
+  dir->d_loaded.store(false, std::memory_order_release);
+  return dropped;
+}
+
+// Dentry cache thread: drops the least recently used directories whose
+// subdirectories are dropped, while no operation runs until the tree is back
+// under the budget.
+void shrink_dentries() {
+  hfs_exclusive_guard guard;
+  struct hfs_dir_cache* cache = HFS_META->dir_cache;
+  // an eighth below the budget, not to run again on the next create
+  int64_t slack = cache->budget / 8;
+  bool progress = true;
+  while(progress && dir_cache_over(cache, slack)) {
+    progress = false;
+    std::vector<struct hfs_dentry*> dirs;
+    dir_cache_lru(cache, dirs);
+    for(struct hfs_dentry* dir : dirs) {
+      if(!dir_cache_over(cache, slack)) {
+        break;
+      }
+      if(dir == HFS_META->root_dentry || !dir_evictable(dir)) {
+        continue;
+      }
+      int64_t dropped = drop_dir(dir);
+      if(dropped < 0) {
+        continue;
+      }
+      // emptied parents become leaves on the next pass
+      dir_cache_count(cache, -dropped);
+      cache->drops++;
+      progress = true;
+    }
+  }
+}
+
+// Packer thread: compacts and drops containers while no operation runs.
+void compact_containers() {
+  hfs_exclusive_guard guard;
+  pack_compact(HFS_META->packer);
+}
+
+// Write back thread: flushes the runs older than the timeout while no
+// operation runs.
+void expire_buffers() {
+  hfs_exclusive_guard guard;
+  std::vector<struct hfs_handle*> handles;
+  write_back_dirty(HFS_META->write_back, handles);
+  for(struct hfs_handle* handle : handles) {
+    {
+      std::lock_guard<std::mutex> lock(handle->wbuf->lock);
+      if(wbuf_expired(HFS_META->write_back, handle->wbuf)) {
+        flush_locked(handle, dentry_path(handle->wbuf->dentry).c_str());
+      }
+    }
+    write_back_clean(HFS_META->write_back, handle);
+  }
+}
+
 int HybridFS::hfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
   spdlog::info("[getattr] path: {}", path);
+  hfs_shared_guard guard;
   // stat
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     spdlog::info("[getattr] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  flush_dirty(target_dentry, path);
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    pack_stat(HFS_META->packer, target_dentry, st);
+    return 0;
   }
-  spdlog::info("[getattr] stat from real path {}", real_path.c_str());
-  if(stat(real_path.c_str(), st) != 0) {
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(target_dentry, obj, name);
+  spdlog::info("[getattr] stat object {}", obj);
+  if(fstatat(dirfd, name, st, 0) != 0) {
     return -errno;
   }
+  if(target_dentry->d_layout != FileLayout::WHOLE) {
+    st->st_size = target_dentry->d_size;
+  }
   return 0;
 }
 
 int HybridFS::hfs_readlink(const char *path, char *buf, size_t len) {
   spdlog::info("[readlink] path: {}", path);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // target dentry does not exist
     spdlog::info("[readlink] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry);
   if(target_dentry->d_type != FileType::SYMBOLLINK) {
     // target dentry is not a symbol link
     spdlog::info("[getattr] not a symbollink");
     return -1;
   }
-  std::string real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-  spdlog::info("[readlink] readlink from real path {}", real_path.c_str());
-  if(readlink(real_path.c_str(), buf, len) != 0) {
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(target_dentry, obj, name);
+  spdlog::info("[readlink] readlink object {}", obj);
+  ssize_t link_size = readlinkat(dirfd, name, buf, len - 1);
+  if(link_size == -1) {
     return -errno;
   }
+  buf[link_size] = '\0';
   return 0;
 }
 
 int HybridFS::hfs_mkdir(const char *path, mode_t mode) {
   spdlog::info("[mkdir] path: {}, mode {}", path, mode);
+  hfs_exclusive_guard guard;
   std::vector<std::string> dnames;
   split_path(path, dnames);
   struct hfs_dentry* parent_dentry = find_parent_dentry(path);
@@ -128,102 +1647,135 @@ int HybridFS::hfs_mkdir(const char *path, mode_t mode) {
     spdlog::info("[mkdir] file exists");
     return -EEXIST;
   }
-  // real mkdir 
-  int mkdir_state;
-  mkdir_state = mkdir((HFS_META->ssd_path + path).c_str(), mode);
-  if(mkdir_state == 0) {
-    mkdir_state = mkdir((HFS_META->hdd_path + path).c_str(), mode);
-  } else {
-    spdlog::info("[mkdir] real mkdir {} failed with return value {}", (HFS_META->ssd_path + path).c_str(), errno);
-    return -errno;
-  }
-  if(mkdir_state == 0) {
-    // create dentry
-    parent_dentry->d_childs->insert(std::make_pair(dnames[dnames.size() - 1], new hfs_dentry{
-      dnames[dnames.size() - 1], 
-      FileType::DIRECTORY, 
-      FileArea::NOTFILE, 
-      parent_dentry,
-      new std::unordered_map<std::string, struct hfs_dentry*>()
-    }));
+  // create dentry
+  struct hfs_dentry* new_dentry = new hfs_dentry{
+    dnames[dnames.size() - 1], 
+    FileType::DIRECTORY, 
+    AREA_NOTFILE, 
+    parent_dentry,
+    new std::unordered_map<std::string, struct hfs_dentry*>()
+  };
+  new_dentry->d_oid = new_object();
+  // the directory object only keeps mode, owner, times and xattrs
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(new_dentry, obj, name);
+  spdlog::info("[mkdir] real mkdir {}", obj);
+  if(mkdirat(dirfd, name, mode) != 0) {
+    int mkdir_errno = errno;
+    spdlog::info("[mkdir] real mkdir {} failed with return value {}", obj, mkdir_errno);
+    delete new_dentry->d_childs;
+    delete new_dentry;
+    return -mkdir_errno;
+  }
+  inherit_hints(new_dentry, parent_dentry);
+  add_child(parent_dentry, dnames[dnames.size() - 1], new_dentry);
+  trace_name(new_dentry->d_oid, path);
+  trace_dentry(new_dentry);
+  return 0;
+}
+
+// Removes a file or symbol link with its backing object.
+int remove_file(struct hfs_dentry* target_dentry, const char *path) {
+  flush_dirty(target_dentry, path, true);
+  spdlog::info("[unlink] unlink object: {}", backing_name(target_dentry));
+  int unlink_state = 0;
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    pack_remove(HFS_META->packer, target_dentry);
   } else {
-    rmdir((HFS_META->ssd_path + path).c_str());
+    unlink_state = backing_unlink(dentry_place(target_dentry), backing_name(target_dentry));
+  }
+  if(unlink_state != 0) {
+    return unlink_state;
+  }
+  // delete target dentry
+  sched_cancel(HFS_META->scheduler, target_dentry);
+  if(target_dentry->d_move != nullptr && !target_dentry->d_move->running) {
+    move_drop(target_dentry->d_move);
+  }
+  mem_cache_evict(HFS_META->mem_cache, target_dentry);
+  forget_content(target_dentry);
+  update_size(target_dentry, 0);
+  target_dentry->d_parent->d_childs->erase(target_dentry->d_name);
+  dir_cache_count(HFS_META->dir_cache, -1);
+  delete target_dentry;
+  return 0;
+}
+
+// Removes an empty directory with its backing object.
+int remove_dir(struct hfs_dentry* target_dentry) {
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(target_dentry, obj, name);
+  spdlog::info("[rmdir] remove object: {}", obj);
+  // a directory dropped once keeps its entries file
+  int forget_state = dir_forget(target_dentry);
+  if(forget_state != 0) {
+    return forget_state;
+  }
+  if(unlinkat(dirfd, name, AT_REMOVEDIR) != 0) {
     return -errno;
   }
+  // delete target dentry
+  spdlog::info("[rmdir] delete dentry");
+  dir_cache_unlist(HFS_META->dir_cache, target_dentry);
+  target_dentry->d_parent->d_childs->erase(target_dentry->d_name);
+  dir_cache_count(HFS_META->dir_cache, -1);
+  delete target_dentry->d_childs;
+  delete target_dentry;
   return 0;
 }
 
 int HybridFS::hfs_unlink(const char *path) {
   spdlog::info("[unlink] path: {}", path);
+  hfs_exclusive_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // can not find target dentry
     spdlog::info("[unlink] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry);
   if(target_dentry->d_type != FileType::REGULAR && target_dentry->d_type != FileType::SYMBOLLINK) {
     // target dentry is not a regular file
     spdlog::info("[unlink] not a regular file");
     return -EISDIR;
   }
-  std::string real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-  spdlog::info("[unlink] unlink real path: {}", real_path.c_str());
-  if(unlink(real_path.c_str()) == 0) {
-    // delete target dentry
-    target_dentry->d_parent->d_childs->erase(target_dentry->d_name);
-    delete target_dentry;
-    return 0;
-  }
-  return -errno;
+  return remove_file(target_dentry, path);
 }
 
 int HybridFS::hfs_rmdir(const char *path) {
   spdlog::info("[rmdir] path: {}", path);
+  hfs_exclusive_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // can not find target dentry
     spdlog::info("[rmdir] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry);
   if(target_dentry->d_type != FileType::DIRECTORY) {
     // target dentry is not a directory
     spdlog::info("[rmdir] not a directory");
     return -ENOTDIR;
   }
-  if(!target_dentry->d_childs->empty()) {
-    // target directory is not empty
-    spdlog::info("[rmdir] not a directory");
-    return -ENOTEMPTY;
+  if(target_dentry == HFS_META->root_dentry) {
+    return -EBUSY;
   }
-  // stat for recovery
-  struct stat st;
-  stat((HFS_META->ssd_path + path).c_str(), &st);
-  // real remove
-  int rmdir_state;
-  spdlog::info("[rmdir] remove real path: {}", (HFS_META->ssd_path + path).c_str());
-  rmdir_state = rmdir((HFS_META->ssd_path + path).c_str());
-  if(rmdir_state == 0) {
-    spdlog::info("[rmdir] remove real path: {}", (HFS_META->hdd_path + path).c_str());
-    rmdir_state = rmdir((HFS_META->hdd_path + path).c_str());
-  } else {
-    return -errno;
+  if(!enter_dir(target_dentry)) {
+    return -EIO;
   }
-  if(rmdir_state == 0) {
-    // delete target dentry
-    spdlog::info("[rmdir] delete dentry");
-    target_dentry->d_parent->d_childs->erase(target_dentry->d_name);
-    delete target_dentry->d_childs;
-    delete target_dentry;
-  } else {
-    spdlog::info("[rmdir] failed to remove real path, start recovery");
-    mkdir((HFS_META->ssd_path + path).c_str(), st.st_mode);
-    return -errno;
+  if(!target_dentry->d_childs->empty()) {
+    // target directory is not empty
+    spdlog::info("[rmdir] not a directory");
+    return -ENOTEMPTY;
   }
-  return 0;
+  return remove_dir(target_dentry);
 }
 
 int HybridFS::hfs_symlink(const char *oldpath, const char *newpath) {
   spdlog::info("[symlink] oldpath: {}, newpath: {}", oldpath, newpath);
+  hfs_exclusive_guard guard;
   std::vector<std::string> dnames;
   split_path(newpath, dnames);
   struct hfs_dentry* parent_dentry = find_parent_dentry(newpath);
@@ -242,25 +1794,34 @@ int HybridFS::hfs_symlink(const char *oldpath, const char *newpath) {
     spdlog::info("[symlink] target dentry exists");
     return -EEXIST;
   }
-  std::string real_old_path = oldpath;
-  std::string real_new_path = HFS_META->ssd_path + newpath;
-  spdlog::info("[symlink] real symlink from path {} to path {}", real_new_path.c_str(), real_old_path.c_str());
-  if(symlink(real_old_path.c_str(), real_new_path.c_str()) == 0) {
-    parent_dentry->d_childs->insert(std::make_pair(dnames[dnames.size() - 1], new hfs_dentry {
-      dnames[dnames.size() - 1], 
-      FileType::SYMBOLLINK, 
-      FileArea::SSD, 
-      parent_dentry,
-      nullptr
-    }));
-  } else {
-    return -errno;
-  }
+  struct hfs_dentry* new_dentry = new hfs_dentry {
+    dnames[dnames.size() - 1], 
+    FileType::SYMBOLLINK, 
+    0, 
+    parent_dentry,
+    nullptr,
+    0,
+    pick_device(0, 0)
+  };
+  new_dentry->d_oid = new_object();
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(new_dentry, obj, name);
+  spdlog::info("[symlink] real symlink from object {} to path {}", obj, oldpath);
+  if(symlinkat(oldpath, dirfd, name) != 0) {
+    int symlink_errno = errno;
+    delete new_dentry;
+    return -symlink_errno;
+  }
+  add_child(parent_dentry, dnames[dnames.size() - 1], new_dentry);
+  trace_name(new_dentry->d_oid, newpath);
+  trace_dentry(new_dentry);
   return 0;
 }
 
 int HybridFS::hfs_rename(const char *oldpath, const char *newpath, unsigned int flags) {
   spdlog::info("[rename] oldpath: {}, newpath: {}", oldpath, newpath);
+  hfs_exclusive_guard guard;
 
   if(flags == RENAME_EXCHANGE || flags == RENAME_WHITEOUT) {
     // do not support
@@ -275,13 +1836,10 @@ int HybridFS::hfs_rename(const char *oldpath, const char *newpath, unsigned int
     spdlog::info("[rename] failed to find old target dentry");
     return -ENOENT;
   }
-  if(old_dentry->d_type != FileType::REGULAR && old_dentry->d_type != FileType::SYMBOLLINK) {
-    // target old dentry is not file
-    spdlog::info("[rename] old target dentry is not a file");
-    return -1;
+  trace_dentry(old_dentry);
+  if(old_dentry == HFS_META->root_dentry) {
+    return -EBUSY;
   }
-  std::string real_old_path = (old_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + oldpath;
-  std::string real_new_path = (old_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + newpath;
 
   // find new dentry parent
   std::vector<std::string> dnames;
@@ -298,38 +1856,65 @@ int HybridFS::hfs_rename(const char *oldpath, const char *newpath, unsigned int
     spdlog::info("[rename] new parent dentry is not a directory");
     return -ENOENT;
   }
+  for(struct hfs_dentry* dentry = new_dentry_parent; dentry != nullptr; dentry = dentry->d_parent) {
+    if(dentry == old_dentry) {
+      // a directory can not move below itself
+      spdlog::info("[rename] new path is below old path");
+      return -EINVAL;
+    }
+  }
 
   // for different flags
-  if(flags == RENAME_NOREPLACE) {
-    // check new path does not exist
-    auto it = new_dentry_parent->d_childs->find(new_dentry_name);
-    if(it != new_dentry_parent->d_childs->end()) {
+  auto it = new_dentry_parent->d_childs->find(new_dentry_name);
+  if(it != new_dentry_parent->d_childs->end()) {
+    struct hfs_dentry* replaced = it->second;
+    if(replaced == old_dentry) {
+      return 0;
+    }
+    if(flags == RENAME_NOREPLACE) {
       // same path exist
       spdlog::info("[rename] new dentry exists");
       return -EEXIST;
     }
-    spdlog::info("[rename] real rename from {} to {}", real_old_path.c_str(), real_new_path.c_str());
-    if(rename(real_old_path.c_str(), real_new_path.c_str()) == 0) {
-      // rename successful
-      old_dentry->d_parent->d_childs->erase(old_dentry->d_name);
-      old_dentry->d_name = new_dentry_name;
-      old_dentry->d_parent = new_dentry_parent;
-      new_dentry_parent->d_childs->insert(std::make_pair(old_dentry->d_name, old_dentry));
-    } else {
-      return -errno;
+    if(replaced->d_type == FileType::DIRECTORY) {
+      if(old_dentry->d_type != FileType::DIRECTORY) {
+        return -EISDIR;
+      }
+      if(!enter_dir(replaced)) {
+        return -EIO;
+      }
+      if(!replaced->d_childs->empty()) {
+        return -ENOTEMPTY;
+      }
+    } else if(old_dentry->d_type == FileType::DIRECTORY) {
+      return -ENOTDIR;
+    }
+    spdlog::info("[rename] replace {}", newpath);
+    int remove_state = replaced->d_type == FileType::DIRECTORY ? remove_dir(replaced) : remove_file(replaced, newpath);
+    if(remove_state != 0) {
+      return remove_state;
     }
   }
+  // backing objects are named by id, nothing moves on the devices
+  trace_name(old_dentry->d_oid, newpath);
+  old_dentry->d_parent->d_childs->erase(old_dentry->d_name);
+  old_dentry->d_name = new_dentry_name;
+  old_dentry->d_parent = new_dentry_parent;
+  new_dentry_parent->d_childs->insert(std::make_pair(old_dentry->d_name, old_dentry));
   return 0;
 }
 
 int HybridFS::hfs_link(const char *oldpath, const char *newpath) {
   spdlog::info("[link] oldpath: {}, newpath: {}", oldpath, newpath);
+  hfs_exclusive_guard guard;
   struct hfs_dentry* old_dentry = find_dentry(oldpath);
   if(old_dentry == nullptr) {
     // old dentry does not exist
     spdlog::info("[link] failed to find old target dentry");
     return -ENOENT;
   }
+  trace_dentry(old_dentry);
+  flush_dirty(old_dentry, oldpath);
   if(old_dentry->d_type == FileType::DIRECTORY) {
     // old dentry is a directory
     spdlog::info("[link] old target dentry is a directory");
@@ -354,85 +1939,169 @@ int HybridFS::hfs_link(const char *oldpath, const char *newpath) {
     spdlog::info("[link] new parent dentry exists");
     return -EEXIST;
   }
-  // real link
-  std::string real_old_path = (old_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + oldpath;
-  std::string real_new_path = (old_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + newpath;
-  spdlog::info("[link] real link from {} to {}", real_old_path.c_str(), real_new_path.c_str());
-  if(link(real_old_path.c_str(), real_new_path.c_str()) == 0) {
-    new_dentry_parent->d_childs->insert(std::make_pair(new_dentry_name, new hfs_dentry{
-      new_dentry_name,
-      old_dentry->d_type,
-      old_dentry->d_area,
-      new_dentry_parent,
-      nullptr
-    }));
-  } else {
-    return -errno;
-  }
+  // links share a backing file
+  int unpack_state = unpack_file(old_dentry);
+  if(unpack_state != 0) {
+    return unpack_state;
+  }
+  forget_content(old_dentry);
+  // hard linked files are not kept in memory, under either name
+  mem_cache_evict(HFS_META->mem_cache, old_dentry);
+  struct hfs_dentry* new_dentry = new hfs_dentry{
+    new_dentry_name,
+    old_dentry->d_type,
+    old_dentry->d_area,
+    new_dentry_parent,
+    nullptr,
+    old_dentry->d_size.load(),
+    old_dentry->d_dev,
+    old_dentry->d_layout,
+    old_dentry->d_width
+  };
+  new_dentry->d_cindex = std::atomic_load(&old_dentry->d_cindex);
+  new_dentry->d_oid = new_object();
+  // real link, a second object name for the same backing files
+  spdlog::info("[link] real link from {} to {}", backing_name(old_dentry), backing_name(new_dentry));
+  int link_state = backing_link(dentry_place(old_dentry), backing_name(old_dentry), backing_name(new_dentry));
+  if(link_state != 0) {
+    delete new_dentry;
+    return link_state;
+  }
+  add_child(new_dentry_parent, new_dentry_name, new_dentry);
+  mem_cache_evict(HFS_META->mem_cache, new_dentry);
+  trace_name(new_dentry->d_oid, newpath);
+  trace_dentry(new_dentry, old_dentry->d_oid);
   return 0;
 }
 
 int HybridFS::hfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi){
   spdlog::info("[chmod] path: {}, mode: {:#o}", path, mode);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // can not find such file
     spdlog::info("[chmod] failed to find target dentry");
     return -ENOENT;
   }
-  // real chmod
-  std::string real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-  spdlog::info("[chmod] chmod real path: {}", real_path.c_str());
-  if(chmod(real_path.c_str(), mode) != 0) {
-    return -errno;
+  trace_dentry(target_dentry);
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    pack_set_attr(HFS_META->packer, target_dentry, [mode](struct hfs_attr& attr, const struct timespec& now) {
+      attr.mode = mode & 07777;
+    });
+    return 0;
+  }
+  // real chmod, on every piece so they open alike
+  struct hfs_place place = dentry_place(target_dentry);
+  std::string obj = backing_name(target_dentry);
+  spdlog::info("[chmod] chmod object: {}", obj);
+  for(int32_t i = 0; i < piece_count(place); i++) {
+    const char *name;
+    int dirfd = backing_dirfd(place, i, obj, name);
+    if(fchmodat(dirfd, name, mode, 0) != 0) {
+      return -errno;
+    }
   }
   return 0;
 }
 
 int HybridFS::hfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
   spdlog::info("[chown] path: {}, uid: {}, gid: {}", path, uid, gid);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // can not find such dentry
     spdlog::info("[chown] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY || target_dentry->d_type == FileType::SYMBOLLINK) {
-    real_path = HFS_META->ssd_path + path;
-  } else if(target_dentry->d_type == FileType::REGULAR) {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    pack_set_attr(HFS_META->packer, target_dentry, [uid, gid](struct hfs_attr& attr, const struct timespec& now) {
+      if(uid != (uid_t)-1) {
+        attr.uid = uid;
+      }
+      if(gid != (gid_t)-1) {
+        attr.gid = gid;
+      }
+    });
+    return 0;
   }
-  spdlog::info("[chown] chown real path: {}", real_path.c_str());
-  if(chown(real_path.c_str(), uid, gid) != 0) {
-    return -errno;
+  struct hfs_place place = dentry_place(target_dentry);
+  std::string obj = backing_name(target_dentry);
+  spdlog::info("[chown] chown object: {}", obj);
+  for(int32_t i = 0; i < piece_count(place); i++) {
+    const char *name;
+    int dirfd = backing_dirfd(place, i, obj, name);
+    if(fchownat(dirfd, name, uid, gid, 0) != 0) {
+      return -errno;
+    }
   }
   return 0;
 }
 
-int HybridFS::hfs_truncate(const char *path, off_t off, struct fuse_file_info *fi) {
-  spdlog::info("[truncate] path: {}, offset: {}", path, off);
+int truncate_file(const char *path, off_t off) {
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // can not find such file
     spdlog::info("[truncate] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry, off);
   if(target_dentry->d_type == FileType::DIRECTORY) {
     // dentry is not file
     spdlog::info("[truncate] target dentry is a directory");
     return -EISDIR;
   }
-  std::string real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-  spdlog::info("[truncate] truncate real path: {}", real_path.c_str());
-  if(truncate(real_path.c_str(), off) != 0) {
-    return -errno;
+  flush_dirty(target_dentry, path);
+  int truncate_state = off > HFS_META->pack_threshold ? require_unpacked(target_dentry) : 0;
+  if(truncate_state == 0) {
+    truncate_state = require_plain(target_dentry);
+  }
+  if(truncate_state != 0) {
+    return truncate_state;
+  }
+  int64_t old_size = target_dentry->d_size;
+  bool packed = target_dentry->d_layout == FileLayout::PACKED;
+  if(packed) {
+    spdlog::info("[truncate] packed truncate");
+    truncate_state = pack_truncate(HFS_META->packer, target_dentry, off);
+  } else {
+    spdlog::info("[truncate] truncate object: {}", backing_name(target_dentry));
+    truncate_state = backing_truncate(dentry_place(target_dentry), backing_name(target_dentry), off);
   }
+  if(truncate_state != 0) {
+    return truncate_state;
+  }
+  data_changed(target_dentry, std::min<int64_t>(off, old_size), std::abs(old_size - off));
+  mem_cache_truncate(HFS_META->mem_cache, target_dentry, off);
+  if(!packed) {
+    // a packed file got its size with the record
+    update_size(target_dentry, off);
+  }
+  // blocks allocated past the new end are gone
+  int64_t alloc = target_dentry->d_alloc.load();
+  while(alloc > off && !target_dentry->d_alloc.compare_exchange_weak(alloc, off)) {
+  }
+  maybe_migrate(target_dentry, path);
   return 0;
 }
 
+int HybridFS::hfs_truncate(const char *path, off_t off, struct fuse_file_info *fi) {
+  spdlog::info("[truncate] path: {}, offset: {}", path, off);
+  int truncate_state = truncate_file(path, off);
+  while(truncate_state == -ESTALE) {
+    truncate_state = make_plain(path);
+    if(truncate_state == 0) {
+      truncate_state = truncate_file(path, off);
+    }
+  }
+  return truncate_state;
+}
+
 int HybridFS::hfs_open(const char *path, struct fuse_file_info *fi) {
   spdlog::info("[open] path: {}, flags: {:#o}", path, fi->flags);
+  // only creating the file changes the namespace, and truncating it the layout
+  hfs_tree_guard guard((fi->flags & (O_CREAT | O_TRUNC)) != 0);
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     if((fi->flags & O_CREAT) == 0) {
@@ -447,24 +2116,39 @@ int HybridFS::hfs_open(const char *path, struct fuse_file_info *fi) {
       spdlog::info("parent dentry doesn't exist");
       return -ENOENT;
     }
+    std::vector<std::string> dnames;
+    split_path(path, dnames);
     // create
-    std::string real_path = HFS_META->ssd_path + path;
-    spdlog::info("[open] open file from real path {}", real_path.c_str());
-    int open_state = open(real_path.c_str(), fi->flags);
-    if(open_state != -1){
-      fi->fh = open_state;
-      std::vector<std::string> dnames;
-      split_path(path, dnames);
-      std::string new_dentry_name = dnames[dnames.size() - 1];
-      parent_dentry->d_childs->insert(std::make_pair(new_dentry_name, new hfs_dentry{
-        new_dentry_name,
-        FileType::REGULAR,
-        FileArea::SSD,
-        parent_dentry,
-        nullptr
-      }));
+    std::string new_dentry_name = dnames[dnames.size() - 1];
+    int64_t expect;
+    int32_t area = new_file_area(parent_dentry, new_dentry_name, expect);
+    int32_t dev = pick_device(area, expect);
+    struct hfs_dentry* new_dentry = new hfs_dentry{
+      new_dentry_name,
+      FileType::REGULAR,
+      area,
+      parent_dentry,
+      nullptr,
+      0,
+      dev
+    };
+    new_dentry->d_oid = new_object();
+    new_dentry->d_expect = expect;
+    spdlog::info("[open] open file from object {}", backing_name(new_dentry));
+    inherit_hints(new_dentry, parent_dentry);
+    if(expect == 0 && pack_want(HFS_META->packer, area)) {
+      pack_new_file(HFS_META->packer, new_dentry, 0644);
+    }
+    int open_state = open_handle(new_dentry, path, fi->flags, 0644, fi);
+    if(open_state == 0){
+      add_child(parent_dentry, new_dentry_name, new_dentry);
+      creator_opened(HFS_HANDLE(fi));
+      trace_name(new_dentry->d_oid, path);
+      trace_dentry(new_dentry, fi->flags);
     } else {
-      return -errno;
+      delete new_dentry->d_attr;
+      delete new_dentry;
+      return open_state;
     }
   } else {
     // file exists
@@ -473,18 +2157,15 @@ int HybridFS::hfs_open(const char *path, struct fuse_file_info *fi) {
       spdlog::info("file exist");
       return -EEXIST ;
     }
-    std::string real_path;
-    if(target_dentry->d_type == FileType::DIRECTORY) {
-      real_path = HFS_META->ssd_path + path;
-    } else {
-      real_path = ((target_dentry->d_area == FileArea::SSD) ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-    }
-    spdlog::info("[open] open real path {}", real_path.c_str());
-    int open_state = open(real_path.c_str(), fi->flags);
-    if(open_state != -1){
-      fi->fh = open_state;
+    spdlog::info("[open] open object {}", backing_name(target_dentry));
+    trace_dentry(target_dentry, fi->flags);
+    int open_state = open_handle(target_dentry, path, fi->flags, 0, fi);
+    if(open_state == 0){
+      if((fi->flags & O_TRUNC) != 0 && target_dentry->d_type == FileType::REGULAR) {
+        open_truncated(target_dentry);
+      }
     } else {
-      return -errno;
+      return open_state;
     }
   }
   return 0;
@@ -492,6 +2173,7 @@ int HybridFS::hfs_open(const char *path, struct fuse_file_info *fi) {
 
 int HybridFS::hfs_read(const char *path, char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
   spdlog::info("[read] path: {}, offset: {}, size: {}", path, off, size);
+  hfs_shared_guard guard;
   // check file
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
@@ -499,44 +2181,92 @@ int HybridFS::hfs_read(const char *path, char *buf, size_t size, off_t off, stru
     spdlog::info("[read] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry, off, size);
   if(target_dentry->d_type == FileType::DIRECTORY){
     // path is a directory
     spdlog::info("[read] target dentry is a directory");
     return -EISDIR;
   }
-  // get file fd
-  int fd = -1;
+  target_dentry->d_heat.fetch_add(1, std::memory_order_relaxed);
+  // hot small files are served from memory, unless the kernel writes them
+  // behind the daemon
+  bool cacheable = target_dentry->d_passthrough_rw == 0;
+  ssize_t cached_size = cacheable ? mem_cache_read(HFS_META->mem_cache, target_dentry, buf, size, off) : -1;
+  if(cached_size >= 0) {
+    spdlog::info("[read] memory hit");
+    return cached_size;
+  }
+  flush_dirty(target_dentry, path);
+  // what is read is cached only if no write comes in meanwhile
+  uint64_t write_seq = target_dentry->d_write_seq;
+  // get file fds
+  std::vector<int> local_fds;
+  std::unique_lock<std::mutex> handle_guard;
+  int open_state;
   if(fi != nullptr) {
-    fd = fi->fh;
+    handle_guard = std::unique_lock<std::mutex>(HFS_HANDLE(fi)->lock);
+    open_state = refresh_handle(HFS_HANDLE(fi), target_dentry, path);
   } else {
-    std::string real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-    spdlog::info("[read] open real path: {}", real_path.c_str());
-    fd = open(real_path.c_str(), O_RDONLY);
+    spdlog::info("[read] open object: {}", backing_name(target_dentry));
+    open_state = backing_open(dentry_place(target_dentry), backing_name(target_dentry), O_RDONLY, 0, local_fds);
   }
-  if(fd == -1) {
+  if(open_state != 0) {
     spdlog::info("[read] failed to open");
-    return -errno;
+    return open_state;
   }
+  // the place the fds were opened for
+  struct hfs_place place = dentry_place(target_dentry);
   // read
-  spdlog::info("[read] lseek file");
-  if(lseek(fd, off, SEEK_SET) == -1) {
-    spdlog::info("[read] failed to seek");
-    return -errno;
-  }
   spdlog::info("[read] real read");
-  int read_size = read(fd, buf, size);
-  if(read_size == -1) {
-    return -errno;
+  int read_size;
+  if(fi != nullptr && place.layout != FileLayout::PACKED) {
+    struct hfs_handle* handle = HFS_HANDLE(fi);
+    const std::vector<int>* dio_fds = nullptr;
+    if((int64_t)size >= HFS_META->direct_io_size || readahead_streaming(handle->ra)) {
+      dio_fds = direct_fds(handle, target_dentry, path);
+    }
+    read_size = readahead_read(handle->ra, place, handle->fds, dio_fds, buf, size, off,
+                               target_dentry->d_size, target_dentry->d_write_seq);
+  } else {
+    read_size = read_at(target_dentry, place, fi != nullptr ? HFS_HANDLE(fi)->fds : local_fds, buf, size, off);
+  }
+  // the cached copy goes stale on writes through another link
+  if(read_size >= 0 && cacheable && mem_cache_want(HFS_META->mem_cache, target_dentry) && !hard_linked(target_dentry)) {
+    if(off == 0 && read_size == target_dentry->d_size) {
+      mem_cache_admit(HFS_META->mem_cache, target_dentry, write_seq, buf, read_size);
+    } else {
+      std::vector<char> data(target_dentry->d_size);
+      ssize_t data_size = read_at(target_dentry, place, fi != nullptr ? HFS_HANDLE(fi)->fds : local_fds, data.data(), data.size(), 0);
+      if(data_size == (ssize_t)data.size()) {
+        mem_cache_admit(HFS_META->mem_cache, target_dentry, write_seq, data.data(), data_size);
+      }
+    }
   }
   if(fi == nullptr) {
     spdlog::info("[read] close file");
-    close(fd);
+    backing_close(local_fds);
   }
   return read_size;
 }
 
-int HybridFS::hfs_write(const char *path, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
-  spdlog::info("[write] path: {}, offset: {}, size: {}", path, off, size);
+// Where an append to dentry through handle goes, past the run the handle
+// holds back on it.
+off_t append_offset(struct hfs_handle* handle, const struct hfs_dentry* dentry) {
+  if(handle == nullptr || handle->wbuf == nullptr) {
+    return dentry->d_size;
+  }
+  std::lock_guard<std::mutex> lock(handle->wbuf->lock);
+  if(handle->wbuf->len == 0 || handle->wbuf->dentry != dentry) {
+    return dentry->d_size;
+  }
+  return handle->wbuf->off + handle->wbuf->len;
+}
+
+// Sets recompress when the write left a compressed file with more dead
+// than live bytes, which only appends do.
+int write_file(const char *path, const char *buf, size_t size, off_t off, struct fuse_file_info *fi, bool& recompress) {
+  hfs_shared_guard guard;
+  recompress = false;
   // check file
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
@@ -544,108 +2274,196 @@ int HybridFS::hfs_write(const char *path, const char *buf, size_t size, off_t of
     spdlog::info("[write] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry, off, size);
   if(target_dentry->d_type == FileType::DIRECTORY){
     // path is a directory
     spdlog::info("[write] target dentry is a directory");
     return -EISDIR;
   }
-  // get file fd
-  int fd = -1;
-  std::string real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-  if(fi != nullptr) {
-    fd = fi->fh;
-  } else {
-    spdlog::info("[write] open real path: {}", real_path.c_str());
-    fd = open(real_path.c_str(), O_WRONLY);
-  }
-  if(fd == -1) {
-    spdlog::info("[write] failed to open");
-    return -errno;
+  struct hfs_handle* handle = fi != nullptr ? HFS_HANDLE(fi) : nullptr;
+  // a run of handle itself is continued or written out below
+  flush_dirty(target_dentry, path, false, handle);
+  off_t append_off = append_offset(handle, target_dentry);
+  if(off != append_off) {
+    if(append_off != target_dentry->d_size) {
+      // the run of handle goes out before a write that does not continue it
+      int flush_state = flush_handle(handle, path);
+      if(flush_state != 0) {
+        return flush_state;
+      }
+    }
+    if(off != target_dentry->d_size) {
+      // also before it is held back, appends keep compressed files as they are
+      int plain_state = require_plain(target_dentry);
+      if(plain_state != 0) {
+        return plain_state;
+      }
+    }
   }
-  // write
-  spdlog::info("[write] lseek file");
-  if(lseek(fd, off, SEEK_SET) == -1) {
-    spdlog::info("[write] failed to seek");
-    return -errno;
+  if(target_dentry->d_layout == FileLayout::PACKED && off + (off_t)size > HFS_META->pack_threshold) {
+    // grown out of the container, before a run that would not fit is held back
+    return require_unpacked(target_dentry);
   }
-  spdlog::info("[read] real write");
-  int write_size = write(fd, buf, size);
-  if(write_size == -1) {
-    return -errno;
+  bool stream = false;
+  if(handle != nullptr) {
+    // writes through one handle may come in on several threads
+    std::lock_guard<std::mutex> handle_guard(handle->lock);
+    stream = handle->probe.active && admission_probe(HFS_META->admission, &handle->probe, off, size);
   }
-  if(fi == nullptr) {
-    spdlog::info("[write] close file");
-    close(fd);
+  if(stream) {
+    redirect_stream(target_dentry, path);
   }
-  // maybe migrate
-  struct stat st;
-  stat(real_path.c_str(), &st);
-  if(target_dentry->d_area == FileArea::SSD && st.st_size >= HFS_META->ssd_upper_limit) {
-    // move file to hdd
-    char cmd[1024];
-    sprintf(cmd, "mv %s %s", (HFS_META->ssd_path + path).c_str(), (HFS_META->hdd_path + path).c_str());
-    spdlog::info("[write] migrate {} to {}", (HFS_META->ssd_path + path).c_str(), (HFS_META->hdd_path + path).c_str());
-    system(cmd);
-    target_dentry->d_area = FileArea::HDD;
-  } else if(target_dentry->d_area == FileArea::HDD && st.st_size <= HFS_META->hdd_lower_limit){
-    // move file to ssd
-    char cmd[1024];
-    sprintf(cmd, "mv %s %s", (HFS_META->hdd_path + path).c_str(), (HFS_META->ssd_path + path).c_str());
-    spdlog::info("[write] migrate {} to {}", (HFS_META->hdd_path + path).c_str(), (HFS_META->ssd_path + path).c_str());
-    system(cmd);
-    target_dentry->d_area = FileArea::SSD;
+  int write_size;
+  if(handle != nullptr && handle->wbuf != nullptr && size < handle->wbuf->data.size()) {
+    spdlog::info("[write] buffered write");
+    write_size = buffer_write(handle, target_dentry, path, buf, size, off);
+  } else {
+    int flush_state = handle != nullptr ? flush_handle(handle, path) : 0;
+    if(flush_state != 0) {
+      return flush_state;
+    }
+    write_size = write_through(target_dentry, path, handle, buf, size, off);
   }
+  recompress = write_size >= 0 && target_dentry->d_layout == FileLayout::COMPRESSED &&
+               compress_wasteful(*std::atomic_load(&target_dentry->d_cindex));
   return write_size;
 }
 
+int HybridFS::hfs_write(const char *path, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+  spdlog::info("[write] path: {}, offset: {}, size: {}", path, off, size);
+  bool recompress;
+  int write_state = write_file(path, buf, size, off, fi, recompress);
+  while(write_state == -ESTALE) {
+    write_state = make_plain(path, off);
+    if(write_state == 0) {
+      write_state = write_file(path, buf, size, off, fi, recompress);
+    }
+  }
+  if(recompress) {
+    // best effort, the appended file stays readable as it is
+    int recompress_state = recompress_file(path);
+    if(recompress_state != 0) {
+      spdlog::info("[compress] failed to recompress {}: {}", path, recompress_state);
+    }
+  }
+  return write_state;
+}
+
+// trace_dentry for operations that work on handles.
+void trace_lookup(const char *path) {
+  if(hfs_trace == nullptr || path == nullptr) {
+    return ;
+  }
+  struct hfs_dentry* dentry = find_dentry(path);
+  if(dentry != nullptr) {
+    trace_dentry(dentry);
+  }
+}
+
 int HybridFS::hfs_flush(const char *path, struct fuse_file_info *fi) {
   spdlog::info("[flush] path: {}", path);
+  hfs_shared_guard guard;
+  trace_lookup(path);
+  if(fi != nullptr) {
+    return flush_handle(HFS_HANDLE(fi), path);
+  }
   return 0;
 }
 
+// Lets the directory of the file handle was open on be dropped again.
+void close_handle(struct hfs_handle* handle, const char *path) {
+  struct hfs_dentry* dentry = path != nullptr ? find_dentry(path) : nullptr;
+  if(dentry == nullptr || dentry->d_oid != handle->oid) {
+    // removed or replaced while open
+    return ;
+  }
+  dentry->d_open--;
+}
+
 int HybridFS::hfs_release(const char *path, struct fuse_file_info *fi) {
   spdlog::info("[release] path: {}", path);
+  hfs_shared_guard guard;
+  trace_lookup(path);
   if(fi != nullptr) {
     spdlog::info("[release] close file handle {}", fi->fh);
-    if(close(fi->fh) == -1) {
-      return -errno;
+    struct hfs_handle* handle = HFS_HANDLE(fi);
+    flush_handle(handle, path);
+    if(handle->backing_id > 0) {
+      close_passthrough(handle, path);
+    }
+    if(handle->created) {
+      creator_closed(handle, path);
+    }
+    close_handle(handle, path);
+    if(handle->wbuf != nullptr) {
+      // wait out a flush of the run by another operation
+      std::lock_guard<std::mutex> lock(handle->wbuf->lock);
     }
+    wbuf_free(handle->wbuf);
+    readahead_free(handle->ra);
+    backing_close(handle->fds);
+    backing_close(handle->dio_fds);
+    delete handle;
   }
   return 0;
 }
 
 int HybridFS::hfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
   spdlog::info("[fsync] path: {}, datasync: {}", path, datasync);
+  hfs_shared_guard guard;
+  struct hfs_dentry* target_dentry = find_dentry(path);
+  if(target_dentry != nullptr) {
+    trace_dentry(target_dentry);
+    flush_dirty(target_dentry, path);
+  }
   if(fi != nullptr) {
-    if(datasync) {
-      spdlog::info("[fsync] datasync file handle {}", fi->fh);
-      if(fdatasync(fi->fh) == -1) {
-        return -errno;
+    int flush_state = flush_handle(HFS_HANDLE(fi), path);
+    if(flush_state != 0) {
+      return flush_state;
+    }
+    std::lock_guard<std::mutex> handle_guard(HFS_HANDLE(fi)->lock);
+    if(target_dentry != nullptr) {
+      // sync the file where it lives now
+      int open_state = refresh_handle(HFS_HANDLE(fi), target_dentry, path);
+      if(open_state != 0) {
+        return open_state;
       }
-    } else {
-      spdlog::info("[fsync] fsync file handle {}", fi->fh);
-      if(fsync(fi->fh) == -1) {
-        return -errno;
+    }
+    for(int fd : HFS_HANDLE(fi)->fds) {
+      if(datasync) {
+        spdlog::info("[fsync] datasync file handle {}", fd);
+        if(fdatasync(fd) == -1) {
+          return -errno;
+        }
+      } else {
+        spdlog::info("[fsync] fsync file handle {}", fd);
+        if(fsync(fd) == -1) {
+          return -errno;
+        }
       }
     }
   }
   return 0;
 }
 
-int HybridFS::hfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
-  spdlog::info("[setxattr] path: {}, name: {}, value: {}", path, name, value);
+int setxattr_file(const char *path, const char *name, const char *value, size_t size, int flags) {
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // no such file
     spdlog::info("[setxattr] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  if(hint_xattr(name)) {
+    return hint_setxattr(target_dentry, path, name, value, size);
+  }
+  // xattrs are kept on backing files only
+  int unpack_state = require_unpacked(target_dentry);
+  if(unpack_state != 0) {
+    return unpack_state;
   }
+  std::string real_path = backing_real_path(target_dentry);
   spdlog::info("[setxattr] setxattr real path: {}", real_path.c_str());
   if(setxattr(real_path.c_str(), name, value, size, flags) == -1) {
     return -errno;
@@ -653,62 +2471,112 @@ int HybridFS::hfs_setxattr(const char *path, const char *name, const char *value
   return 0;
 }
 
+int HybridFS::hfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+  spdlog::info("[setxattr] path: {}, name: {}, value: {}", path, name, value);
+  int setxattr_state = setxattr_file(path, name, value, size, flags);
+  while(setxattr_state == -ESTALE) {
+    setxattr_state = unpack_path(path);
+    if(setxattr_state == 0) {
+      setxattr_state = setxattr_file(path, name, value, size, flags);
+    }
+  }
+  return setxattr_state;
+}
+
 int HybridFS::hfs_getxattr(const char *path, const char *name, char *value, size_t size) {
   spdlog::info("[getxattr] path: {}, name: {} ", path, name);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // no such file
     spdlog::info("[getattr] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  if(hint_xattr(name)) {
+    std::string val;
+    int hint_state = hint_getxattr(target_dentry, name, val);
+    if(hint_state != 0) {
+      return hint_state;
+    }
+    if(size == 0) {
+      return val.size();
+    }
+    if(size < val.size()) {
+      return -ERANGE;
+    }
+    memcpy(value, val.data(), val.size());
+    return val.size();
+  }
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    return -ENODATA;
   }
+  std::string real_path = backing_real_path(target_dentry);
   spdlog::info("[getxattr] getxattr real path: {}", real_path.c_str());
-  if(getxattr(real_path.c_str(), name, value, size) != 0) {
+  ssize_t value_size = getxattr(real_path.c_str(), name, value, size);
+  if(value_size == -1) {
     return -errno;
   }
-  return 0;
+  return value_size;
 }
 
 int HybridFS::hfs_listxattr(const char *path, char *list, size_t size) {
   spdlog::info("[listxattr] path: {}", path);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // no such file
     spdlog::info("[listxattr] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  std::string hints;
+  hint_listxattr(target_dentry, hints);
+  ssize_t list_size = 0;
+  if(target_dentry->d_layout != FileLayout::PACKED) {
+    std::string real_path = backing_real_path(target_dentry);
+    spdlog::info("[listxattr] listxattr real path: {}", real_path.c_str());
+    list_size = listxattr(real_path.c_str(), list, size);
+    if(list_size == -1) {
+      return -errno;
+    }
   }
-  spdlog::info("[listxattr] listxattr real path: {}", real_path.c_str());
-  if(listxattr(real_path.c_str(), list, size) == -1) {
-    return -errno;
+  if(size == 0) {
+    return list_size + hints.size();
   }
-  return 0;
+  if(list_size + hints.size() > size) {
+    return -ERANGE;
+  }
+  memcpy(list + list_size, hints.data(), hints.size());
+  return list_size + hints.size();
 }
 
 int HybridFS::hfs_removexattr(const char *path, const char *name) {
   spdlog::info("[removexattr] path: {}, name: {}", path, name);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // no such file
     spdlog::info("[removexattr] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  if(hint_xattr(name)) {
+    std::string key = name + strlen(HFS_XATTR_PREFIX);
+    std::atomic<int32_t>* hint = key == "pin" ? &target_dentry->d_pin : key == "prefer" ? &target_dentry->d_prefer : nullptr;
+    if(hint == nullptr || hint->exchange(-1) == -1) {
+      return -ENODATA;
+    }
+    if(target_dentry->d_type == FileType::REGULAR) {
+      // back where its size and heat put it
+      maybe_migrate(target_dentry, path);
+    }
+    return 0;
+  }
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    return -ENODATA;
   }
+  std::string real_path = backing_real_path(target_dentry);
   spdlog::info("[removexattr] removexattr real path: {}", real_path.c_str());
   if(removexattr(real_path.c_str(), name) == -1) {
     return -errno;
@@ -718,56 +2586,125 @@ int HybridFS::hfs_removexattr(const char *path, const char *name) {
 
 int HybridFS::hfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
   spdlog::info("[readdir] path: {}", path);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // no such dentry
     spdlog::info("[readdir] failed to find target dentry");
     return -ENOENT;
   }
+  trace_dentry(target_dentry);
   if(target_dentry->d_type != FileType::DIRECTORY) {
     // not a directory
     spdlog::info("[readdir] target dentry is not a directory");
     return -ENOTDIR;
   }
+  if(!enter_dir(target_dentry)) {
+    return -EIO;
+  }
   filler(buf, ".", NULL, 0, FUSE_FILL_DIR_PLUS);
 	filler(buf, "..", NULL, 0, FUSE_FILL_DIR_PLUS);
   for(auto it = target_dentry->d_childs->begin(); it != target_dentry->d_childs->end(); it++) {
     struct hfs_dentry* child = it->second;
     struct stat st;
-    std::string real_path;
-    if(child->d_type == FileType::DIRECTORY) {
-      real_path = HFS_META->ssd_path + path + "/" + child->d_name;
-    } else {
-      real_path = (child->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path + "/" + child->d_name;
+    if(child->d_layout == FileLayout::PACKED) {
+      pack_stat(HFS_META->packer, child, &st);
+      filler(buf, child->d_name.c_str(), &st, 0, FUSE_FILL_DIR_PLUS);
+      continue;
     }
-    spdlog::info("[readdir] stat real path {}", real_path.c_str());
-    if(stat(real_path.c_str(), &st) == 0) {
+    std::string obj;
+    const char *name;
+    int dirfd = dentry_at(child, obj, name);
+    spdlog::info("[readdir] stat object {}", obj);
+    if(fstatat(dirfd, name, &st, 0) == 0) {
+      if(child->d_layout != FileLayout::WHOLE) {
+        st.st_size = child->d_size;
+      }
       filler(buf, child->d_name.c_str(), &st, 0, FUSE_FILL_DIR_PLUS);
     }
   }
   return 0;
 }
 
-void *HybridFS::hfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+void hfs_start(struct hfs_meta* meta, struct fuse_conn_info *conn) {
+  hfs_global_meta = meta;
   spdlog::info("[init] initial data path");
-  if(HFS_META->ssd_path.back() == '/') {
-    HFS_META->ssd_path.pop_back();
-  }
-  if(HFS_META->hdd_path.back() == '/') {
-    HFS_META->hdd_path.pop_back();
-  }
-  std::filesystem::remove_all(HFS_META->ssd_path);
-  std::filesystem::remove_all(HFS_META->hdd_path);
-  std::filesystem::create_directories(HFS_META->ssd_path);
-  std::filesystem::create_directories(HFS_META->hdd_path);
+  for(struct hfs_tier* tier : HFS_META->tiers) {
+    for(struct hfs_device* dev : tier->devices) {
+      if(dev->path.back() == '/') {
+        dev->path.pop_back();
+      }
+      std::filesystem::remove_all(dev->path);
+      std::filesystem::create_directories(dev->path + "/" HFS_INTERNAL_DIR "/tmp");
+      if(backing_make_objects(dev->path) != 0 || backing_open_dirs(dev) != 0) {
+        spdlog::info("[init] failed to set up object directories on {}", dev->path);
+      }
+    }
+    tier->used = 0;
+  }
+  HFS_META->io_pool = new ThreadPool(HFS_META->io_pool_threads);
+  HFS_META->ra_pool = new ThreadPool(2);
+  // copy buffers cover whole stripes of the widest tier
+  int64_t copy_size = 4 << 20;
+  for(struct hfs_tier* tier : HFS_META->tiers) {
+    copy_size = std::max<int64_t>(copy_size, HFS_META->stripe_unit * tier->devices.size());
+  }
+  copy_size = (copy_size + HFS_META->stripe_unit - 1) / HFS_META->stripe_unit * HFS_META->stripe_unit;
+  HFS_META->dio_pool = dio_pool_new(copy_size, HFS_META->io_pool_threads);
+  HFS_META->migrate_chunk = std::max<int64_t>(HFS_META->migrate_chunk / DIO_ALIGN * DIO_ALIGN, DIO_ALIGN);
+  HFS_META->mem_cache = mem_cache_new(HFS_META->mem_cache_size, HFS_META->mem_cache_file_size, HFS_META->mem_cache_admit);
+  HFS_META->packer = packer_new(HFS_META->pack_threshold, HFS_META->pack_container_size, compact_containers);
+  if(packer_init(HFS_META->packer) != 0) {
+    spdlog::info("[init] packing disabled");
+    HFS_META->packer->threshold = 0;
+  }
+  pthread_rwlockattr_t lock_attr;
+  pthread_rwlockattr_init(&lock_attr);
+  // the short exclusive steps of background work must not starve
+  pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&HFS_META->tree_lock, &lock_attr);
+  pthread_rwlockattr_destroy(&lock_attr);
+  HFS_META->write_back = write_back_new(HFS_META->write_buffer_size, HFS_META->write_buffer_timeout, expire_buffers);
+  HFS_META->scheduler = sched_new(HFS_META->bg_bandwidth, HFS_META->bg_iops, HFS_META->bg_latency_factor, background_migrate);
   spdlog::info("[init] initial dentry");
   HFS_META->root_dentry = new hfs_dentry {
     "",
     FileType::DIRECTORY,
-    FileArea::NOTFILE,
+    AREA_NOTFILE,
     nullptr,
     new std::unordered_map<std::string, struct hfs_dentry*>()
   };
+  // 0 stands for no file in traces
+  HFS_META->next_oid = 1;
+  HFS_META->root_dentry->d_oid = new_object();
+  std::string root_obj;
+  const char *root_name;
+  int root_dirfd = dentry_at(HFS_META->root_dentry, root_obj, root_name);
+  mkdirat(root_dirfd, root_name, 0755);
+  HFS_META->dir_cache = dir_cache_new(HFS_META->dir_cache_size, shrink_dentries);
+  // one tier leaves nothing to choose
+  int64_t large_size = HFS_META->tiers.size() > 1 ? HFS_META->tiers[0]->upper_limit : 0;
+  HFS_META->admission = admission_new(large_size, HFS_META->admit_probe, HFS_META->admit_stream_rate);
+  HFS_META->dedup = dedup_new(HFS_META->dedup_min_size, HFS_META->dedup_verify);
+  HFS_META->passthrough_fd = -1;
+  if(HFS_META->passthrough) {
+#ifdef FUSE_CAP_PASSTHROUGH
+    if(conn != nullptr && (conn->capable & FUSE_CAP_PASSTHROUGH) != 0) {
+      conn->want |= FUSE_CAP_PASSTHROUGH;
+      HFS_META->passthrough_fd = fuse_session_fd(fuse_get_session(fuse_get_context()->fuse));
+    }
+#endif
+    if(HFS_META->passthrough_fd == -1) {
+      spdlog::info("[init] passthrough is not supported, disabled");
+    }
+  }
+  if(!HFS_META->trace_path.empty() && trace_open(HFS_META->trace_path) != 0) {
+    spdlog::info("[init] failed to open trace {}", HFS_META->trace_path);
+  }
+}
+
+void *HybridFS::hfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  hfs_start((struct hfs_meta*) fuse_get_context()->private_data, conn);
   return HFS_META;
 }
 
@@ -775,36 +2712,65 @@ void destroy_dfs(struct hfs_dentry* root) {
   if(root == nullptr) {
     return ;
   }
-  for(auto it = root->d_childs->begin(); it != root->d_childs->end(); it++) {
-    destroy_dfs(it->second);
-    it->second = nullptr;
+  if(root->d_childs != nullptr) {
+    for(auto it = root->d_childs->begin(); it != root->d_childs->end(); it++) {
+      destroy_dfs(it->second);
+      it->second = nullptr;
+    }
+    delete root->d_childs;
+  }
+  if(root->d_move != nullptr) {
+    move_drop(root->d_move);
   }
-  delete root->d_childs;
+  delete root->d_attr;
+  delete root->d_fp.load();
   delete root;
   return ;
 }
 
 void HybridFS::hfs_destroy(void *private_data) {
   spdlog::info("[destory]");
+  // prefetches still queued look at the tree
+  delete HFS_META->ra_pool;
+  dir_cache_free(HFS_META->dir_cache);
+  write_back_free(HFS_META->write_back);
+  sched_free(HFS_META->scheduler);
+  // its thread moves records of dentries
+  packer_free(HFS_META->packer);
+  trace_close();
   destroy_dfs(HFS_META->root_dentry);
+  mem_cache_free(HFS_META->mem_cache);
+  admission_free(HFS_META->admission);
+  dedup_free(HFS_META->dedup);
+  delete HFS_META->io_pool;
+  dio_pool_free(HFS_META->dio_pool);
+  for(struct hfs_tier* tier : HFS_META->tiers) {
+    for(struct hfs_device* dev : tier->devices) {
+      backing_close_dirs(dev);
+    }
+  }
+  pthread_rwlock_destroy(&HFS_META->tree_lock);
 }
 
 int HybridFS::hfs_access(const char *path, int mode) {
   spdlog::info("[access] path: {}, mode: {:#o}", path, mode);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // no such dentry
     spdlog::info("[access] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = (target_dentry->d_area == FileArea::SSD ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    // what access(2) tells the daemon about its own files
+    return (mode & X_OK) != 0 && (pack_attr(HFS_META->packer, target_dentry).mode & 0111) == 0 ? -EACCES : 0;
   }
-  spdlog::info("[access] access real path {}", real_path.c_str());
-  if(access(real_path.c_str(), mode) != 0) {
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(target_dentry, obj, name);
+  spdlog::info("[access] access object {}", obj);
+  if(faccessat(dirfd, name, mode, 0) != 0) {
     return -errno;
   }
   return 0;
@@ -812,6 +2778,7 @@ int HybridFS::hfs_access(const char *path, int mode) {
 
 int HybridFS::hfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
   spdlog::info("[create] path: {}, mode: {:#o}", path, mode);
+  hfs_exclusive_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // create first
@@ -822,39 +2789,51 @@ int HybridFS::hfs_create(const char *path, mode_t mode, struct fuse_file_info *f
       spdlog::info("[create] failed to find parent dentry");
       return -ENOENT;
     }
+    std::vector<std::string> dnames;
+    split_path(path, dnames);
     // open file
-    std::string real_path = HFS_META->ssd_path + path;
-    spdlog::info("[create] creat real path {}", real_path.c_str());
-    int open_state = creat(real_path.c_str(), mode);
-    if(open_state != -1){
-      fi->fh = open_state;
-      std::vector<std::string> dnames;
-      split_path(path, dnames);
-      std::string new_dentry_name = dnames[dnames.size() - 1];
-      parent_dentry->d_childs->insert(std::make_pair(new_dentry_name, new hfs_dentry{
-        new_dentry_name,
-        FileType::REGULAR,
-        FileArea::SSD,
-        parent_dentry,
-        nullptr
-      }));
+    std::string new_dentry_name = dnames[dnames.size() - 1];
+    int64_t expect;
+    int32_t area = new_file_area(parent_dentry, new_dentry_name, expect);
+    int32_t dev = pick_device(area, expect);
+    struct hfs_dentry* new_dentry = new hfs_dentry{
+      new_dentry_name,
+      FileType::REGULAR,
+      area,
+      parent_dentry,
+      nullptr,
+      0,
+      dev
+    };
+    new_dentry->d_oid = new_object();
+    new_dentry->d_expect = expect;
+    spdlog::info("[create] creat object {}", backing_name(new_dentry));
+    inherit_hints(new_dentry, parent_dentry);
+    if(expect == 0 && pack_want(HFS_META->packer, area)) {
+      pack_new_file(HFS_META->packer, new_dentry, mode);
+    }
+    int open_state = open_handle(new_dentry, path, fi->flags | O_CREAT | O_TRUNC, mode, fi);
+    if(open_state == 0){
+      add_child(parent_dentry, new_dentry_name, new_dentry);
+      creator_opened(HFS_HANDLE(fi));
+      trace_name(new_dentry->d_oid, path);
+      trace_dentry(new_dentry, fi->flags);
     } else {
-      return -errno;
+      delete new_dentry->d_attr;
+      delete new_dentry;
+      return open_state;
     }
   } else {
     // file exist
-    std::string real_path;
-    if(target_dentry->d_type == FileType::DIRECTORY) {
-      real_path = HFS_META->ssd_path + path;
-    } else {
-      real_path = ((target_dentry->d_area == FileArea::SSD) ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
-    }
-    spdlog::info("[create] open real path {}", real_path.c_str());
-    int open_state = open(real_path.c_str(), fi->flags);
-    if(open_state != -1) {
-      fi->fh = open_state;
+    spdlog::info("[create] open object {}", backing_name(target_dentry));
+    trace_dentry(target_dentry, fi->flags);
+    int open_state = open_handle(target_dentry, path, fi->flags, 0, fi);
+    if(open_state == 0) {
+      if((fi->flags & O_TRUNC) != 0 && target_dentry->d_type == FileType::REGULAR) {
+        open_truncated(target_dentry);
+      }
     } else {
-      return -errno;
+      return open_state;
     }
   }
   return 0;
@@ -862,29 +2841,148 @@ int HybridFS::hfs_create(const char *path, mode_t mode, struct fuse_file_info *f
 
 int HybridFS::hfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
   spdlog::info("[utimens] path: {}, a_sec: {}, a_nsec: {}, u_sec: {}, u_nsec: {}", path, tv[0].tv_sec, tv[0].tv_nsec, tv[1].tv_sec, tv[1].tv_nsec);
+  hfs_shared_guard guard;
   struct hfs_dentry* target_dentry = find_dentry(path);
   if(target_dentry == nullptr) {
     // does not exist
     spdlog::info("[utimens] failed to find target dentry");
     return -ENOENT;
   }
-  std::string real_path;
-  if(target_dentry->d_type == FileType::DIRECTORY) {
-    real_path = HFS_META->ssd_path + path;
-  } else {
-    real_path = ((target_dentry->d_area == FileArea::SSD) ? HFS_META->ssd_path : HFS_META->hdd_path) + path;
+  trace_dentry(target_dentry);
+  if(target_dentry->d_layout == FileLayout::PACKED) {
+    pack_set_attr(HFS_META->packer, target_dentry, [tv](struct hfs_attr& attr, const struct timespec& now) {
+      struct timespec* times[2] = {&attr.atime, &attr.mtime};
+      for(int i = 0; i < 2; i++) {
+        if(tv == nullptr || tv[i].tv_nsec == UTIME_NOW) {
+          *times[i] = now;
+        } else if(tv[i].tv_nsec != UTIME_OMIT) {
+          *times[i] = tv[i];
+        }
+      }
+    });
+    return 0;
   }
-  spdlog::info("[utimens] utimensat real path {}", real_path.c_str());
-  if(utimensat(AT_FDCWD, real_path.c_str(), tv, AT_SYMLINK_NOFOLLOW) == -1) {
+  std::string obj;
+  const char *name;
+  int dirfd = dentry_at(target_dentry, obj, name);
+  spdlog::info("[utimens] utimensat object {}", obj);
+  if(utimensat(dirfd, name, tv, AT_SYMLINK_NOFOLLOW) == -1) {
     return -errno;
   }
   return 0;
 }
 
-ssize_t HybridFS::hfs_copy_file_range(const char *in_path, struct fuse_file_info *fi_in, off_t in_offset, 
-                                      const char *out_path, struct fuse_file_info *fi_out, off_t out_offset, 
-                                      size_t size, int flags) {
-  spdlog::info("[copy_file_range] in_path: {}, in_offset: {}, out_path: {}, out_offset: {}, size: {}, flags: {:#o}", in_path, in_offset, out_path, out_offset, size, flags);
+// Whether fallocate up to end may move dentry before allocating.
+bool allocate_moves(const struct hfs_dentry* dentry, int64_t end) {
+  return dentry != nullptr && dentry->d_type == FileType::REGULAR && dentry->d_size == 0 && end > dentry->d_alloc &&
+         (dentry->d_layout == FileLayout::WHOLE || dentry->d_layout == FileLayout::STRIPED);
+}
+
+// An empty file about to get blocks is put where they belong first, there
+// is nothing to copy yet. The tree lock is taken exclusively only after a
+// shared look found such a file.
+void place_for_allocate(const char *path, int64_t end) {
+  {
+    hfs_shared_guard guard;
+    if(!allocate_moves(find_dentry(path), end)) {
+      return ;
+    }
+  }
+  hfs_exclusive_guard guard;
+  struct hfs_dentry* dentry = find_dentry(path);
+  if(!allocate_moves(dentry, end)) {
+    return ;
+  }
+  dentry->d_alloc = end;
+  int32_t target_area = migrate_target(dentry);
+  if(target_area != dentry->d_area) {
+    migrate_file(dentry, path, target_area);
+  }
+}
+
+int fallocate_file(const char *path, int mode, off_t off, off_t len) {
+  hfs_shared_guard guard;
+  struct hfs_dentry* target_dentry = find_dentry(path);
+  if(target_dentry == nullptr) {
+    spdlog::info("[fallocate] failed to find target dentry");
+    return -ENOENT;
+  }
+  trace_dentry(target_dentry, off, len);
+  if(target_dentry->d_type == FileType::DIRECTORY) {
+    spdlog::info("[fallocate] target dentry is a directory");
+    return -EISDIR;
+  }
+  flush_dirty(target_dentry, path);
+  bool keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+  bool allocate = (mode & FALLOC_FL_PUNCH_HOLE) == 0;
+  int64_t end = off + len;
+  if(target_dentry->d_layout == FileLayout::PACKED && allocate && keep_size && end <= HFS_META->pack_threshold) {
+    // records have no blocks of their own
+    return 0;
+  }
+  int fallocate_state = require_unpacked(target_dentry);
+  if(fallocate_state == 0) {
+    fallocate_state = require_plain(target_dentry);
+  }
+  if(fallocate_state != 0) {
+    return fallocate_state;
+  }
+  int64_t alloc = target_dentry->d_alloc.load();
+  while(allocate && end > alloc && !target_dentry->d_alloc.compare_exchange_weak(alloc, end)) {
+  }
+  struct hfs_place place = dentry_place(target_dentry);
+  std::vector<int> local_fds;
+  fallocate_state = backing_open(place, backing_name(target_dentry), O_WRONLY, 0, local_fds);
+  if(fallocate_state != 0) {
+    spdlog::info("[fallocate] failed to open");
+    return fallocate_state;
+  }
+  fallocate_state = backing_fallocate(place, local_fds, mode, off, len);
+  backing_close(local_fds);
+  if(fallocate_state == 0 && !keep_size && end > target_dentry->d_size && place.layout == FileLayout::STRIPED) {
+    fallocate_state = backing_truncate(place, backing_name(target_dentry), end);
+  }
+  if(fallocate_state != 0) {
+    spdlog::info("[fallocate] failed with {}", fallocate_state);
+    return fallocate_state;
+  }
+  if((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) != 0 || (!keep_size && end > target_dentry->d_size)) {
+    data_changed(target_dentry, off, len);
+    mem_cache_evict(HFS_META->mem_cache, target_dentry);
+  }
+  if(!keep_size) {
+    grow_size(target_dentry, end);
+  }
+  maybe_migrate(target_dentry, path);
+  return 0;
+}
+
+int HybridFS::hfs_fallocate(const char *path, int mode, off_t off, off_t len, struct fuse_file_info *fi) {
+  spdlog::info("[fallocate] path: {}, mode: {:#x}, offset: {}, length: {}", path, mode, off, len);
+  if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) != 0) {
+    return -EOPNOTSUPP;
+  }
+  if((mode & FALLOC_FL_PUNCH_HOLE) != 0 && (mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE)) != FALLOC_FL_KEEP_SIZE) {
+    return -EOPNOTSUPP;
+  }
+  if(off < 0 || len <= 0) {
+    return -EINVAL;
+  }
+  if((mode & FALLOC_FL_PUNCH_HOLE) == 0) {
+    place_for_allocate(path, off + len);
+  }
+  int fallocate_state = fallocate_file(path, mode, off, len);
+  while(fallocate_state == -ESTALE) {
+    fallocate_state = make_plain(path);
+    if(fallocate_state == 0) {
+      fallocate_state = fallocate_file(path, mode, off, len);
+    }
+  }
+  return fallocate_state;
+}
+
+ssize_t copy_range(const char *in_path, off_t in_offset, const char *out_path, off_t out_offset, size_t size, int flags) {
+  hfs_shared_guard guard;
   // check two files
   struct hfs_dentry* in_dentry = find_dentry(in_path);
   struct hfs_dentry* out_dentry = find_dentry(out_path);
@@ -896,50 +2994,116 @@ ssize_t HybridFS::hfs_copy_file_range(const char *in_path, struct fuse_file_info
     spdlog::info("[copy_file_range] target dentry is a directory");
     return -EISDIR;
   }
+  trace_dentry(out_dentry, out_offset, size);
+  flush_dirty(in_dentry, in_path);
+  flush_dirty(out_dentry, out_path);
+  // packed and compressed files are rewritten whole, copy into a plain file instead
+  int unpack_state = require_unpacked(out_dentry);
+  if(unpack_state == 0) {
+    unpack_state = require_plain(out_dentry);
+  }
+  if(unpack_state != 0) {
+    return unpack_state;
+  }
   // copy range
-  std::string real_in_path = ((in_dentry->d_area == FileArea::SSD) ? HFS_META->ssd_path : HFS_META->hdd_path) + in_path;
-  std::string real_out_path = ((out_dentry->d_area == FileArea::SSD) ? HFS_META->ssd_path : HFS_META->hdd_path) + out_path;
-  spdlog::info("[copy_file_range] open real in path {}", real_in_path.c_str());
-  int in_fd = open(real_in_path.c_str(), O_RDONLY);
-  spdlog::info("[copy_file_range] open real out path {}", real_out_path.c_str());
-  int out_fd = open(real_out_path.c_str(), O_WRONLY);
-  spdlog::info("[copy_file_range] real copy_file_range");
-  ssize_t copy_state = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size, flags);
-  if(copy_state == -1) {
-    return -errno;
+  struct hfs_place in_place = dentry_place(in_dentry);
+  struct hfs_place out_place = dentry_place(out_dentry);
+  std::vector<int> in_fds, out_fds;
+  spdlog::info("[copy_file_range] open in object {}", backing_name(in_dentry));
+  int open_state = backing_open(in_place, backing_name(in_dentry), O_RDONLY, 0, in_fds);
+  if(open_state != 0) {
+    return open_state;
+  }
+  spdlog::info("[copy_file_range] open out object {}", backing_name(out_dentry));
+  open_state = backing_open(out_place, backing_name(out_dentry), O_WRONLY, 0, out_fds);
+  if(open_state != 0) {
+    backing_close(in_fds);
+    return open_state;
+  }
+  ssize_t copy_state = 0;
+  off_t out_start = out_offset;
+  if(in_place.layout == FileLayout::WHOLE && out_place.layout == FileLayout::WHOLE) {
+    spdlog::info("[copy_file_range] real copy_file_range");
+    copy_state = copy_file_range(in_fds[0], &in_offset, out_fds[0], &out_offset, size, flags);
+    if(copy_state == -1) {
+      copy_state = -errno;
+    }
+  } else {
+    // other layouts are copied through the daemon
+    spdlog::info("[copy_file_range] buffered copy");
+    std::vector<char> copy_buf(std::min<size_t>(size, 4 << 20));
+    while((size_t)copy_state < size) {
+      ssize_t read_size = read_at(in_dentry, in_place, in_fds, copy_buf.data(), std::min(copy_buf.size(), size - copy_state),
+                                  in_offset + copy_state);
+      if(read_size <= 0) {
+        if(read_size < 0) {
+          copy_state = read_size;
+        }
+        break;
+      }
+      ssize_t write_size = backing_pwrite(out_place, out_fds, copy_buf.data(), read_size, out_offset + copy_state);
+      if(write_size < 0) {
+        copy_state = write_size;
+        break;
+      }
+      copy_state += write_size;
+    }
   }
-  close(in_fd);
-  close(out_fd);
-  // maybe migrate
-  struct stat st;
-  stat(real_out_path.c_str(), &st);
-  if(out_dentry->d_area == FileArea::SSD && st.st_size >= HFS_META->ssd_upper_limit) {
-    // move file to hdd
-    char cmd[1024];
-    sprintf(cmd, "mv %s %s", (HFS_META->ssd_path + out_path).c_str(), (HFS_META->hdd_path + out_path).c_str());
-    spdlog::info("[copy_file_range] migrate {} to {}", (HFS_META->ssd_path + out_path).c_str(), (HFS_META->hdd_path + out_path).c_str());
-    system(cmd);
-    out_dentry->d_area = FileArea::HDD;
-  } else if(out_dentry->d_area == FileArea::HDD && st.st_size <= HFS_META->hdd_lower_limit){
-    // move file to ssd
-    char cmd[1024];
-    sprintf(cmd, "mv %s %s", (HFS_META->hdd_path + out_path).c_str(), (HFS_META->ssd_path + out_path).c_str());
-    spdlog::info("[copy_file_range] migrate {} to {}", (HFS_META->hdd_path + out_path).c_str(), (HFS_META->ssd_path + out_path).c_str());
-    system(cmd);
-    out_dentry->d_area = FileArea::SSD;
+  backing_close(in_fds);
+  backing_close(out_fds);
+  if(copy_state < 0) {
+    return copy_state;
   }
+  data_changed(out_dentry, out_start, copy_state);
+  grow_size(out_dentry, out_start + copy_state);
+  // maybe migrate
+  maybe_migrate(out_dentry, out_path);
   // return
   return copy_state;
 }
 
+ssize_t HybridFS::hfs_copy_file_range(const char *in_path, struct fuse_file_info *fi_in, off_t in_offset, 
+                                      const char *out_path, struct fuse_file_info *fi_out, off_t out_offset, 
+                                      size_t size, int flags) {
+  spdlog::info("[copy_file_range] in_path: {}, in_offset: {}, out_path: {}, out_offset: {}, size: {}, flags: {:#o}", in_path, in_offset, out_path, out_offset, size, flags);
+  ssize_t copy_state = copy_range(in_path, in_offset, out_path, out_offset, size, flags);
+  while(copy_state == -ESTALE) {
+    copy_state = make_plain(out_path);
+    if(copy_state == 0) {
+      copy_state = copy_range(in_path, in_offset, out_path, out_offset, size, flags);
+    }
+  }
+  return copy_state;
+}
+
 off_t HybridFS::hfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
   spdlog::info("[lseek] path: {}", path);
+  hfs_shared_guard guard;
   if(fi == nullptr) {
     spdlog::info("[lseek] no opened file");
     return -1;
   }
+  struct hfs_handle* handle = HFS_HANDLE(fi);
+  struct hfs_dentry* target_dentry = find_dentry(path);
+  if(target_dentry == nullptr) {
+    return -ENOENT;
+  }
+  trace_dentry(target_dentry, off);
+  flush_dirty(target_dentry, path);
+  if(target_dentry->d_layout != FileLayout::WHOLE) {
+    // striped or packed file, holes are not tracked
+    if((whence == SEEK_DATA || whence == SEEK_HOLE) && off >= target_dentry->d_size) {
+      return -ENXIO;
+    }
+    return whence == SEEK_HOLE ? target_dentry->d_size.load() : off;
+  }
   spdlog::info("[lseek] real lseek");
-  off_t seek_state = lseek(fi->fh, off, whence);
+  std::lock_guard<std::mutex> handle_guard(handle->lock);
+  int open_state = refresh_handle(handle, target_dentry, path);
+  if(open_state != 0) {
+    return open_state;
+  }
+  off_t seek_state = lseek(handle->fds[0], off, whence);
   if(seek_state == -1) {
     return -errno;
   }
@@ -3,18 +3,28 @@
 
 #define FUSE_USE_VERSION 39
 
+#include <pthread.h>
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <fuse3/fuse.h>
 
-enum class FileArea{
-  NOTFILE,
-  SSD,
-  HDD,
-};
+#include "admission.h"
+#include "thread_pool.h"
+#include "tier.h"
+
+// d_area of dentries that are not placed on any tier (directories)
+static constexpr int32_t AREA_NOTFILE = -1;
+
+// Directory for internal files and objects on the devices.
+#define HFS_INTERNAL_DIR ".hybridfs"
 
 enum class FileType{
   REGULAR,
@@ -22,21 +32,143 @@ enum class FileType{
   SYMBOLLINK,
 };
 
+enum class FileLayout{
+  WHOLE,      // one backing file on d_dev
+  STRIPED,    // stripe_unit chunks round robin over d_width devices from d_dev
+  PACKED,     // record in a first tier container, see pack.h
+  COMPRESSED, // independently compressed blocks on d_dev, see compress.h
+};
+
+struct hfs_attr;
+struct hfs_cindex;
+struct hfs_fingerprint;
+struct hfs_move;
+
 struct hfs_dentry {
   std::string d_name;
   FileType d_type;
-  FileArea d_area;
+  int32_t d_area;
   struct hfs_dentry* d_parent;
   std::unordered_map<std::string, struct hfs_dentry*>* d_childs;
+  std::atomic<int64_t> d_size{0};   // grown by concurrent writers, see grow_size
+  int32_t d_dev = 0;    // backing device within the tier
+  FileLayout d_layout = FileLayout::WHOLE;
+  int32_t d_width = 1;
+  uint64_t d_version = 0;   // bumped whenever the backing files are replaced
+  std::atomic<uint64_t> d_write_seq{0};   // bumped on every data change, invalidates cached data
+  std::atomic<uint32_t> d_heat{0};   // reads served, counted under the shared tree lock
+  uint32_t d_pack_id = 0;   // container of a packed file, 0 while empty
+  int64_t d_pack_off = 0;
+  struct hfs_attr* d_attr = nullptr;  // attributes of a packed file
+  // block index of a compressed file, appends swap it while it is read, so
+  // it goes through std::atomic_load and std::atomic_store
+  std::shared_ptr<const struct hfs_cindex> d_cindex;
+  std::mutex d_compress_lock;        // appends to a compressed file, one at a time
+  // placement hints set through user.hybridfs.* xattrs under the shared tree
+  // lock, inherited from the parent directory at creation
+  std::atomic<int32_t> d_pin{-1};       // tier the file is kept on whatever its size
+  std::atomic<int32_t> d_prefer{-1};    // tier new files start on, never promoted above it
+  std::atomic<int32_t> d_dirty{0};   // handles holding back writes to the file, see write_buffer.h
+  std::atomic<int32_t> d_open{0};    // open handles, the directory stays loaded while there are any
+  // size declared through fallocate, placed as if that large, moved by
+  // truncate and fallocate under the shared tree lock
+  std::atomic<int64_t> d_alloc{0};
+  // size a new file is expected to reach while its creator writes, see
+  // admission.h, raised by writes under the shared tree lock
+  std::atomic<int64_t> d_expect{0};
+  std::atomic<struct hfs_fingerprint*> d_fp{nullptr};  // content while indexed for deduplication, see dedup.h
+  uint64_t d_oid = 0;       // backing object, see object_path in backing.h
+  struct hfs_move* d_move = nullptr;  // chunked migration in progress, see hybridfs.cc
+  // a directory dropped by the dentry cache has no d_childs until looked
+  // into again, see dir_cache.h
+  std::atomic<bool> d_loaded{true};
+  std::atomic<uint64_t> d_used{0};    // dir_cache tick of the last lookup in a directory
+  bool d_listed = false;              // on the dir_cache LRU list, at d_lru
+  std::list<struct hfs_dentry*>::iterator d_lru;
+  // handles whose reads and writes the kernel does itself, see passthrough.h
+  std::atomic<int32_t> d_passthrough{0};
+  std::atomic<int32_t> d_passthrough_rw{0};   // of them open for writing
+};
+
+struct hfs_readahead;
+struct hfs_mem_cache;
+struct hfs_packer;
+struct hfs_scheduler;
+struct hfs_write_buffer;
+struct hfs_write_back;
+struct hfs_dio_pool;
+struct hfs_dir_cache;
+struct hfs_dedup;
+
+// Per open file state, kept in fuse_file_info::fh.
+struct hfs_handle {
+  int flags;
+  uint64_t version;         // d_version the fds were opened for
+  std::vector<int> fds;     // one per backing piece
+  struct hfs_readahead* ra;
+  struct hfs_write_buffer* wbuf = nullptr;   // small writes held back, see write_buffer.h
+  std::vector<int> dio_fds; // O_DIRECT fds for bulk traffic, opened on first use
+  bool dio_off = false;     // the backing filesystem does not take O_DIRECT
+  int backing_id = 0;       // registered for kernel passthrough
+  bool passthrough_rw = false;
+  uint64_t oid = 0;         // d_oid of the file opened
+  bool created = false;     // opened by the creation of the file
+  struct hfs_admit_probe probe;
+  // version, fds and dio_fds, held from refresh_handle until the I/O on
+  // them is done, and probe
+  std::mutex lock;
 };
 
+#define HFS_HANDLE(fi) ((struct hfs_handle*) (fi)->fh)
+
 struct hfs_meta {
   std::string fs_path;
-  std::string ssd_path;
-  std::string hdd_path;
-  int64_t ssd_upper_limit;
-  int64_t hdd_lower_limit;
+  std::vector<struct hfs_tier*> tiers;
   struct hfs_dentry* root_dentry;
+  int64_t stripe_unit;        // chunk size of striped files
+  int64_t stripe_threshold;   // files from this size are striped on multi device hdd tiers
+  int32_t io_pool_threads;
+  ThreadPool* io_pool;
+  int64_t readahead_min;      // first prefetch window of a sequential stream
+  int64_t readahead_max;      // largest window, a quarter of it on non hdd tiers
+  ThreadPool* ra_pool;
+  int64_t mem_cache_size;       // 0 disables the memory tier
+  int64_t mem_cache_file_size;  // largest file kept in memory
+  uint32_t mem_cache_admit;     // reads before a file is kept in memory
+  struct hfs_mem_cache* mem_cache;
+  int64_t pack_threshold;       // files up to this size are packed, 0 disables packing
+  int64_t pack_container_size;
+  struct hfs_packer* packer;
+  bool compress;                // compress files demoted to hdd tiers
+  int64_t compress_block;
+  int32_t compress_level;
+  int64_t bg_bandwidth;         // background bytes/s per device, 0 for no limit
+  int64_t bg_iops;              // background requests/s per device, 0 for no limit
+  double bg_latency_factor;     // foreground slowdown that makes background work back off
+  struct hfs_scheduler* scheduler;
+  int64_t write_buffer_size;    // per handle, 0 disables write coalescing
+  int64_t write_buffer_timeout; // ms a buffered write may wait
+  struct hfs_write_back* write_back;
+  int64_t direct_io_size;       // hdd requests from this size bypass the page cache, 0 disables
+  struct hfs_dio_pool* dio_pool;
+  int64_t migrate_chunk;        // unit of background copies, recopied when written meanwhile
+  std::atomic<uint64_t> next_oid;
+  std::string trace_path;       // operation trace file, empty disables tracing
+  int64_t dir_cache_size;       // dentries kept in memory, 0 keeps the whole tree
+  struct hfs_dir_cache* dir_cache;
+  bool passthrough;             // let the kernel do reads and writes of whole files
+  int passthrough_fd;           // fuse device, -1 while passthrough is off
+  int64_t admit_probe;          // bytes a new file is watched for streaming, 0 disables
+  int64_t admit_stream_rate;    // bytes/s of a stream sent below the first tier early
+  struct hfs_admission* admission;
+  int64_t dedup_min_size;       // files from this size are deduplicated on hdd tiers, 0 disables
+  bool dedup_verify;            // compare the data before sharing it
+  struct hfs_dedup* dedup;
+  // held shared by operations that only look up dentries, exclusive by
+  // namespace changes (create, mkdir, link, symlink, rename, unlink,
+  // rmdir), which also free dentries, and by background work that looks at
+  // or replaces dentries
+  pthread_rwlock_t tree_lock;
 };
 
 class HybridFS {
@@ -68,6 +200,7 @@ public:
   static int hfs_access(const char *, int);
   static int hfs_create(const char *, mode_t, struct fuse_file_info *);
   static int hfs_utimens(const char *, const struct timespec tv[2], struct fuse_file_info *fi);
+  static int hfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
   static ssize_t hfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char *path_out, 
                           struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags);
   static off_t hfs_lseek(const char *, off_t off, int whence, struct fuse_file_info *);
@@ -76,6 +209,38 @@ public:
 
 };
 
-#define HFS_META ((struct hfs_meta*) fuse_get_context()->private_data)
+// Set by hfs_init from the fuse context, internal threads have none.
+extern struct hfs_meta* hfs_global_meta;
+#define HFS_META (hfs_global_meta)
+
+// Brings meta up as the file system, what hfs_init does with the meta given
+// to fuse_main. Tests start it without a mount, conn is nullptr then.
+void hfs_start(struct hfs_meta* meta, struct fuse_conn_info *conn);
+// Sets d_size of dentry and the usage of its tier.
+void update_size(struct hfs_dentry* dentry, int64_t size);
+// Raises d_size of dentry to end unless a concurrent write took it further.
+void grow_size(struct hfs_dentry* dentry, int64_t end);
+
+struct hfs_shared_guard {
+  hfs_shared_guard() { pthread_rwlock_rdlock(&HFS_META->tree_lock); }
+  ~hfs_shared_guard() { pthread_rwlock_unlock(&HFS_META->tree_lock); }
+};
+
+struct hfs_exclusive_guard {
+  hfs_exclusive_guard() { pthread_rwlock_wrlock(&HFS_META->tree_lock); }
+  ~hfs_exclusive_guard() { pthread_rwlock_unlock(&HFS_META->tree_lock); }
+};
+
+// For operations that change the namespace only sometimes.
+struct hfs_tree_guard {
+  explicit hfs_tree_guard(bool exclusive) {
+    if(exclusive) {
+      pthread_rwlock_wrlock(&HFS_META->tree_lock);
+    } else {
+      pthread_rwlock_rdlock(&HFS_META->tree_lock);
+    }
+  }
+  ~hfs_tree_guard() { pthread_rwlock_unlock(&HFS_META->tree_lock); }
+};
 
 #endif
\ No newline at end of file
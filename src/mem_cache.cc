@@ -0,0 +1,128 @@
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "hybridfs.h"
+#include "mem_cache.h"
+
+struct hfs_mem_cache* mem_cache_new(int64_t capacity, int64_t max_file_size, uint32_t admit_reads) {
+  struct hfs_mem_cache* cache = new hfs_mem_cache();
+  cache->capacity = capacity;
+  cache->max_file_size = max_file_size;
+  cache->admit_reads = admit_reads;
+  cache->used = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  return cache;
+}
+
+void mem_cache_free(struct hfs_mem_cache* cache) {
+  spdlog::info("[mem_cache] hits: {}, misses: {}, cached files: {}, used: {}", cache->hits.load(), cache->misses.load(),
+               cache->files.size(), cache->used);
+  delete cache;
+}
+
+static void drop_locked(struct hfs_mem_cache* cache, std::unordered_map<const struct hfs_dentry*, struct hfs_cached_file>::iterator it) {
+  cache->used -= it->second.data.size();
+  cache->lru.erase(it->second.lru_pos);
+  cache->files.erase(it);
+}
+
+static void shrink_locked(struct hfs_mem_cache* cache) {
+  while(cache->used > cache->capacity && !cache->lru.empty()) {
+    drop_locked(cache, cache->files.find(cache->lru.back()));
+  }
+}
+
+ssize_t mem_cache_read(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, char *buf, size_t size, off_t off) {
+  if(cache->capacity == 0) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(cache->lock);
+  auto it = cache->files.find(dentry);
+  if(it == cache->files.end() || it->second.write_seq != dentry->d_write_seq) {
+    if(it != cache->files.end()) {
+      // changed behind the cache
+      drop_locked(cache, it);
+    }
+    cache->misses++;
+    return -1;
+  }
+  cache->hits++;
+  cache->lru.splice(cache->lru.begin(), cache->lru, it->second.lru_pos);
+  const std::vector<char>& data = it->second.data;
+  if(off >= (off_t)data.size()) {
+    return 0;
+  }
+  size = std::min<size_t>(size, data.size() - off);
+  memcpy(buf, data.data() + off, size);
+  return size;
+}
+
+bool mem_cache_want(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry) {
+  return cache->capacity > 0 && dentry->d_size <= cache->max_file_size && dentry->d_heat.load(std::memory_order_relaxed) >= cache->admit_reads;
+}
+
+void mem_cache_admit(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, uint64_t write_seq, const char *data, size_t size) {
+  std::lock_guard<std::mutex> lock(cache->lock);
+  if(write_seq != dentry->d_write_seq) {
+    return ;
+  }
+  auto it = cache->files.find(dentry);
+  if(it != cache->files.end()) {
+    drop_locked(cache, it);
+  }
+  cache->lru.push_front(dentry);
+  struct hfs_cached_file& file = cache->files[dentry];
+  file.write_seq = write_seq;
+  file.data.assign(data, data + size);
+  file.lru_pos = cache->lru.begin();
+  cache->used += size;
+  spdlog::info("[mem_cache] admit {} size {}", dentry->d_name, size);
+  shrink_locked(cache);
+}
+
+void mem_cache_write(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, const char *buf, size_t size, off_t off) {
+  std::lock_guard<std::mutex> lock(cache->lock);
+  auto it = cache->files.find(dentry);
+  if(it == cache->files.end()) {
+    return ;
+  }
+  if(off + (off_t)size > cache->max_file_size) {
+    // grown out of the small file range
+    drop_locked(cache, it);
+    return ;
+  }
+  std::vector<char>& data = it->second.data;
+  if(off + size > data.size()) {
+    cache->used += off + size - data.size();
+    data.resize(off + size, 0);
+  }
+  memcpy(data.data() + off, buf, size);
+  it->second.write_seq = dentry->d_write_seq;
+  shrink_locked(cache);
+}
+
+void mem_cache_truncate(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, off_t size) {
+  std::lock_guard<std::mutex> lock(cache->lock);
+  auto it = cache->files.find(dentry);
+  if(it == cache->files.end()) {
+    return ;
+  }
+  if(size > cache->max_file_size) {
+    drop_locked(cache, it);
+    return ;
+  }
+  cache->used += size - (off_t)it->second.data.size();
+  it->second.data.resize(size, 0);
+  it->second.write_seq = dentry->d_write_seq;
+  shrink_locked(cache);
+}
+
+void mem_cache_evict(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(cache->lock);
+  auto it = cache->files.find(dentry);
+  if(it != cache->files.end()) {
+    drop_locked(cache, it);
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef _HYBRIDFS_MEM_CACHE_H
+#define _HYBRIDFS_MEM_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct hfs_dentry;
+
+struct hfs_cached_file {
+  uint64_t write_seq;       // d_write_seq the data is valid for
+  std::vector<char> data;
+  std::list<const struct hfs_dentry*>::iterator lru_pos;
+};
+
+// Memory tier above the device tiers. Holds the whole content of small
+// files once they have been read often enough, evicting least recently
+// used files when over capacity. Writes and truncates update cached files
+// in place, any other data change is caught by the write sequence.
+struct hfs_mem_cache {
+  std::mutex lock;
+  int64_t capacity;
+  int64_t max_file_size;
+  uint32_t admit_reads;     // reads of a file before it is cached
+  int64_t used;
+  std::list<const struct hfs_dentry*> lru;   // most recent first
+  std::unordered_map<const struct hfs_dentry*, struct hfs_cached_file> files;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+};
+
+struct hfs_mem_cache* mem_cache_new(int64_t capacity, int64_t max_file_size, uint32_t admit_reads);
+void mem_cache_free(struct hfs_mem_cache* cache);
+// Bytes read, or -1 if the file is not cached.
+ssize_t mem_cache_read(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, char *buf, size_t size, off_t off);
+bool mem_cache_want(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry);
+// data was read with d_write_seq at write_seq, it is not admitted if a write
+// came in since: the write found nothing cached to update.
+void mem_cache_admit(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, uint64_t write_seq, const char *data, size_t size);
+void mem_cache_write(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, const char *buf, size_t size, off_t off);
+void mem_cache_truncate(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry, off_t size);
+void mem_cache_evict(struct hfs_mem_cache* cache, const struct hfs_dentry* dentry);
+
+#endif
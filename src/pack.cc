@@ -0,0 +1,482 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+
+#include "backing.h"
+#include "pack.h"
+
+static void worker(struct hfs_packer* packer) {
+  std::unique_lock<std::mutex> lock(packer->lock);
+  while(!packer->stop) {
+    packer->cond.wait(lock, [packer] { return packer->stop || !packer->sweep.empty(); });
+    if(packer->stop) {
+      continue;
+    }
+    lock.unlock();
+    packer->compact();
+    lock.lock();
+  }
+}
+
+struct hfs_packer* packer_new(int64_t threshold, int64_t container_size, const std::function<void()>& compact) {
+  struct hfs_packer* packer = new hfs_packer();
+  packer->threshold = threshold;
+  packer->container_size = container_size;
+  packer->next_id = 1;
+  packer->stop = false;
+  packer->compact = compact;
+  if(threshold > 0) {
+    packer->worker = std::thread(worker, packer);
+  }
+  return packer;
+}
+
+static std::string container_path(int32_t dev, uint32_t id) {
+  return HFS_META->tiers[0]->devices[dev]->path + "/" HFS_INTERNAL_DIR "/pack/" + std::to_string(id);
+}
+
+int packer_init(struct hfs_packer* packer) {
+  if(packer->threshold == 0) {
+    return 0;
+  }
+  for(struct hfs_device* dev : HFS_META->tiers[0]->devices) {
+    std::error_code ec;
+    std::filesystem::create_directories(dev->path + "/" HFS_INTERNAL_DIR "/pack", ec);
+    if(ec) {
+      spdlog::info("[pack] failed to create container directory on {}", dev->path);
+      return -ec.value();
+    }
+  }
+  packer->active.assign(HFS_META->tiers[0]->devices.size(), nullptr);
+  return 0;
+}
+
+void packer_free(struct hfs_packer* packer) {
+  {
+    std::lock_guard<std::mutex> lock(packer->lock);
+    packer->stop = true;
+  }
+  packer->cond.notify_all();
+  if(packer->worker.joinable()) {
+    packer->worker.join();
+  }
+  int64_t size = 0, live = 0;
+  for(auto& it : packer->containers) {
+    size += it.second->size;
+    live += it.second->live;
+    close(it.second->fd);
+    delete it.second;
+  }
+  spdlog::info("[pack] containers: {}, bytes: {}, live: {}", packer->containers.size(), size, live);
+  delete packer;
+}
+
+bool pack_want(struct hfs_packer* packer, int32_t area) {
+  return packer->threshold > 0 && area == 0;
+}
+
+void pack_new_file(struct hfs_packer* packer, struct hfs_dentry* dentry, mode_t mode) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  dentry->d_layout = FileLayout::PACKED;
+  dentry->d_pack_id = 0;
+  dentry->d_pack_off = 0;
+  // owned by the caller, or by the daemon when created outside a request
+  struct fuse_context* ctx = fuse_get_context();
+  uid_t uid = ctx != nullptr ? ctx->uid : getuid();
+  gid_t gid = ctx != nullptr ? ctx->gid : getgid();
+  dentry->d_attr = new hfs_attr{mode & 07777, uid, gid, now, now, now};
+}
+
+int pack_dup(struct hfs_packer* packer, uint32_t id) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  auto it = packer->containers.find(id);
+  if(it == packer->containers.end()) {
+    return -ENOENT;
+  }
+  int fd = dup(it->second->fd);
+  return fd == -1 ? -errno : fd;
+}
+
+void pack_stat(struct hfs_packer* packer, const struct hfs_dentry* dentry, struct stat* st) {
+  struct hfs_attr attr = pack_attr(packer, dentry);
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = S_IFREG | attr.mode;
+  st->st_nlink = 1;
+  st->st_uid = attr.uid;
+  st->st_gid = attr.gid;
+  st->st_size = dentry->d_size;
+  st->st_blksize = 4096;
+  st->st_blocks = (st->st_size + 511) / 512;
+  st->st_atim = attr.atime;
+  st->st_mtim = attr.mtime;
+  st->st_ctim = attr.ctime;
+}
+
+struct hfs_attr pack_attr(struct hfs_packer* packer, const struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  return *dentry->d_attr;
+}
+
+void pack_set_attr(struct hfs_packer* packer, struct hfs_dentry* dentry,
+                   const std::function<void(struct hfs_attr&, const struct timespec&)>& change) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  std::lock_guard<std::mutex> lock(packer->lock);
+  change(*dentry->d_attr, now);
+  dentry->d_attr->ctime = now;
+}
+
+// Container with that id, nullptr if there is none.
+static struct hfs_container* container_locked(struct hfs_packer* packer, uint32_t id) {
+  auto it = packer->containers.find(id);
+  return it != packer->containers.end() ? it->second : nullptr;
+}
+
+// Reads [off, off + size) of container c, the fd and device of which never
+// change, so the packer needs not be locked.
+static int read_container(struct hfs_container* c, char *buf, int64_t size, int64_t off) {
+  hfs_io_guard guard(HFS_META->tiers[0]->devices[c->dev]);
+  int64_t done = 0;
+  while(done < size) {
+    ssize_t n = pread(c->fd, buf + done, size - done, off + done);
+    if(n <= 0) {
+      return n == 0 ? -EIO : -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Container holding the record of dentry, kept open until unpin.
+static struct hfs_container* pin_locked(struct hfs_packer* packer, const struct hfs_dentry* dentry) {
+  struct hfs_container* c = container_locked(packer, dentry->d_pack_id);
+  if(c == nullptr) {
+    spdlog::info("[pack] no container {} for {}", dentry->d_pack_id, dentry->d_name);
+    return nullptr;
+  }
+  c->pins++;
+  return c;
+}
+
+static void unpin(struct hfs_packer* packer, struct hfs_container* c) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  if(--c->pins == 0 && c->dropped) {
+    close(c->fd);
+    delete c;
+  }
+}
+
+// Reads [off, off + size) of the record of dentry, which holds that much.
+static int read_range_locked(struct hfs_packer* packer, const struct hfs_dentry* dentry, char *buf, int64_t size, int64_t off) {
+  if(size == 0) {
+    return 0;
+  }
+  struct hfs_container* c = container_locked(packer, dentry->d_pack_id);
+  if(c == nullptr) {
+    spdlog::info("[pack] no container {} for {}", dentry->d_pack_id, dentry->d_name);
+    return -EIO;
+  }
+  return read_container(c, buf, size, dentry->d_pack_off + off);
+}
+
+static int read_record_locked(struct hfs_packer* packer, const struct hfs_dentry* dentry, char *buf) {
+  if(dentry->d_pack_id == 0) {
+    return 0;
+  }
+  return read_range_locked(packer, dentry, buf, dentry->d_size, 0);
+}
+
+static struct hfs_container* active_locked(struct hfs_packer* packer, int32_t dev) {
+  struct hfs_container* c = packer->active[dev];
+  if(c != nullptr && c->size < packer->container_size) {
+    return c;
+  }
+  uint32_t id = packer->next_id++;
+  int fd = open(container_path(dev, id).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(fd == -1) {
+    spdlog::info("[pack] failed to create container {} with {}", id, errno);
+    return nullptr;
+  }
+  c = new hfs_container{id, dev, fd, 0, 0, {}, 0};
+  packer->containers[id] = c;
+  packer->active[dev] = c;
+  spdlog::info("[pack] new container {} on device {}", id, dev);
+  return c;
+}
+
+static void drop_container_locked(struct hfs_packer* packer, struct hfs_container* c) {
+  spdlog::info("[pack] drop container {}", c->id);
+  unlink(container_path(c->dev, c->id).c_str());
+  if(packer->active[c->dev] == c) {
+    packer->active[c->dev] = nullptr;
+  }
+  packer->containers.erase(c->id);
+  if(c->pins > 0) {
+    // the last reader closes it
+    c->dropped = true;
+    return ;
+  }
+  close(c->fd);
+  delete c;
+}
+
+// Points dentry at a new record of size bytes, appended to the active
+// container of its device.
+static int store_locked(struct hfs_packer* packer, struct hfs_dentry* dentry, const char *data, int64_t size) {
+  uint32_t id = 0;
+  int64_t off = 0;
+  if(size > 0) {
+    struct hfs_container* c = active_locked(packer, dentry->d_dev);
+    if(c == nullptr) {
+      return -EIO;
+    }
+    hfs_io_guard guard(HFS_META->tiers[0]->devices[c->dev]);
+    int64_t done = 0;
+    while(done < size) {
+      ssize_t n = pwrite(c->fd, data + done, size - done, c->size + done);
+      if(n == -1) {
+        return -errno;
+      }
+      done += n;
+    }
+    id = c->id;
+    off = c->size;
+    c->size += size;
+    c->live += size;
+    c->members.insert(dentry);
+  }
+  struct hfs_container* old = container_locked(packer, dentry->d_pack_id);
+  if(old != nullptr) {
+    old->live -= dentry->d_size;
+    if(old->id != id) {
+      old->members.erase(dentry);
+    }
+  }
+  dentry->d_pack_id = id;
+  dentry->d_pack_off = off;
+  dentry->d_version++;
+  return 0;
+}
+
+// Moves the live records of a mostly dead container into the active ones.
+static void compact_locked(struct hfs_packer* packer, struct hfs_container* c) {
+  spdlog::info("[pack] compact container {}, live {} of {}", c->id, c->live, c->size);
+  std::vector<struct hfs_dentry*> members(c->members.begin(), c->members.end());
+  std::vector<char> data;
+  for(struct hfs_dentry* dentry : members) {
+    data.resize(dentry->d_size);
+    if(read_record_locked(packer, dentry, data.data()) != 0 || store_locked(packer, dentry, data.data(), data.size()) != 0) {
+      spdlog::info("[pack] failed to move {} out of container {}", dentry->d_name, c->id);
+      return ;
+    }
+  }
+  drop_container_locked(packer, c);
+}
+
+// Called after records of c died, leaves it to compact if it is to go.
+static void maybe_compact_locked(struct hfs_packer* packer, struct hfs_container* c) {
+  bool empty = c->live == 0 && packer->active[c->dev] != c;
+  bool sparse = c->size >= packer->container_size && c->live * 4 < c->size && c->detached == 0;
+  if((empty || sparse) && packer->sweep.insert(c->id).second) {
+    packer->cond.notify_all();
+  }
+}
+
+void pack_compact(struct hfs_packer* packer) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  for(uint32_t id : packer->sweep) {
+    // looked at again, records may have died or come back meanwhile
+    struct hfs_container* c = container_locked(packer, id);
+    if(c == nullptr) {
+      continue;
+    }
+    if(c->live == 0 && packer->active[c->dev] != c) {
+      drop_container_locked(packer, c);
+    } else if(c->size >= packer->container_size && c->live * 4 < c->size && c->detached == 0) {
+      compact_locked(packer, c);
+    }
+  }
+  packer->sweep.clear();
+}
+
+static int rewrite_locked(struct hfs_packer* packer, struct hfs_dentry* dentry, const char *data, int64_t size) {
+  uint32_t old_id = dentry->d_pack_id;
+  int state = store_locked(packer, dentry, data, size);
+  if(state != 0) {
+    return state;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  dentry->d_attr->mtime = now;
+  dentry->d_attr->ctime = now;
+  // with the record, so the next writer reads back all of it
+  update_size(dentry, size);
+  struct hfs_container* old = container_locked(packer, old_id);
+  if(old != nullptr) {
+    maybe_compact_locked(packer, old);
+  }
+  return 0;
+}
+
+ssize_t pack_read(struct hfs_packer* packer, const struct hfs_dentry* dentry, char *buf, size_t size, off_t off) {
+  struct hfs_container* c;
+  int64_t record_off;
+  {
+    std::lock_guard<std::mutex> lock(packer->lock);
+    if(dentry->d_layout != FileLayout::PACKED) {
+      return -ESTALE;
+    }
+    if(off >= dentry->d_size) {
+      return 0;
+    }
+    size = std::min<int64_t>(size, dentry->d_size - off);
+    c = pin_locked(packer, dentry);
+    if(c == nullptr) {
+      return -EIO;
+    }
+    record_off = dentry->d_pack_off;
+  }
+  int state = read_container(c, buf, size, record_off + off);
+  unpin(packer, c);
+  return state != 0 ? state : size;
+}
+
+// Copies the record of dentry into data, at least size bytes, and tells
+// the d_version it was read at.
+static int copy_record(struct hfs_packer* packer, const struct hfs_dentry* dentry, std::vector<char>& data, int64_t size,
+                       uint64_t& version) {
+  struct hfs_container* c = nullptr;
+  int64_t record_off, record_size;
+  {
+    std::lock_guard<std::mutex> lock(packer->lock);
+    if(dentry->d_layout != FileLayout::PACKED) {
+      return -ESTALE;
+    }
+    version = dentry->d_version;
+    record_off = dentry->d_pack_off;
+    record_size = dentry->d_pack_id != 0 ? dentry->d_size.load() : 0;
+    if(record_size > 0) {
+      c = pin_locked(packer, dentry);
+      if(c == nullptr) {
+        return -EIO;
+      }
+    }
+  }
+  data.assign(std::max(record_size, size), 0);
+  if(c == nullptr) {
+    return 0;
+  }
+  int state = read_container(c, data.data(), record_size, record_off);
+  unpin(packer, c);
+  return state;
+}
+
+int pack_write(struct hfs_packer* packer, struct hfs_dentry* dentry, const char *buf, size_t size, off_t off) {
+  std::vector<char> data;
+  while(true) {
+    uint64_t version;
+    int state = copy_record(packer, dentry, data, off + size, version);
+    if(state != 0) {
+      return state;
+    }
+    memcpy(data.data() + off, buf, size);
+    std::lock_guard<std::mutex> lock(packer->lock);
+    if(dentry->d_layout != FileLayout::PACKED) {
+      return -ESTALE;
+    }
+    if(dentry->d_version == version) {
+      return rewrite_locked(packer, dentry, data.data(), data.size());
+    }
+    // another write moved the record meanwhile
+  }
+}
+
+int pack_truncate(struct hfs_packer* packer, struct hfs_dentry* dentry, off_t size) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  if(dentry->d_layout != FileLayout::PACKED) {
+    return -ESTALE;
+  }
+  std::vector<char> data(std::max<int64_t>(dentry->d_size, size), 0);
+  int state = read_record_locked(packer, dentry, data.data());
+  if(state != 0) {
+    return state;
+  }
+  return rewrite_locked(packer, dentry, data.data(), size);
+}
+
+static void remove_locked(struct hfs_packer* packer, struct hfs_dentry* dentry) {
+  struct hfs_container* c = container_locked(packer, dentry->d_pack_id);
+  if(c != nullptr) {
+    c->live -= dentry->d_size;
+    c->members.erase(dentry);
+    maybe_compact_locked(packer, c);
+  }
+  dentry->d_pack_id = 0;
+  delete dentry->d_attr;
+  dentry->d_attr = nullptr;
+}
+
+void pack_remove(struct hfs_packer* packer, struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  remove_locked(packer, dentry);
+}
+
+int pack_unpack(struct hfs_packer* packer, struct hfs_dentry* dentry, const std::string& path) {
+  // no write goes to the record between the read and the switch
+  std::lock_guard<std::mutex> lock(packer->lock);
+  if(dentry->d_layout != FileLayout::PACKED) {
+    return 0;
+  }
+  spdlog::info("[pack] unpack {} size {}", path, dentry->d_size);
+  std::vector<char> data(dentry->d_size);
+  int state = read_record_locked(packer, dentry, data.data());
+  if(state != 0) {
+    return state;
+  }
+  struct hfs_place place{0, dentry->d_dev, FileLayout::WHOLE, 1};
+  std::vector<int> fds;
+  state = backing_open(place, path, O_WRONLY | O_CREAT | O_TRUNC, dentry->d_attr->mode, fds);
+  if(state != 0) {
+    return state;
+  }
+  ssize_t write_size = data.empty() ? 0 : backing_pwrite(place, fds, data.data(), data.size(), 0);
+  if(write_size >= 0 && write_size != (ssize_t)data.size()) {
+    write_size = -EIO;
+  }
+  if(write_size < 0) {
+    backing_close(fds);
+    backing_unlink(place, path);
+    return write_size;
+  }
+  struct timespec times[2] = {dentry->d_attr->atime, dentry->d_attr->mtime};
+  fchmod(fds[0], dentry->d_attr->mode);
+  fchown(fds[0], dentry->d_attr->uid, dentry->d_attr->gid);
+  futimens(fds[0], times);
+  backing_close(fds);
+  remove_locked(packer, dentry);
+  dentry->d_layout = FileLayout::WHOLE;
+  dentry->d_version++;
+  return 0;
+}
+
+void pack_detach(struct hfs_packer* packer, struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  struct hfs_container* c = container_locked(packer, dentry->d_pack_id);
+  if(c != nullptr) {
+    c->members.erase(dentry);
+    c->detached++;
+  }
+}
+
+void pack_attach(struct hfs_packer* packer, struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(packer->lock);
+  struct hfs_container* c = container_locked(packer, dentry->d_pack_id);
+  if(c != nullptr) {
+    c->members.insert(dentry);
+    c->detached--;
+  }
+}
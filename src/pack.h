@@ -0,0 +1,104 @@
+#ifndef _HYBRIDFS_PACK_H
+#define _HYBRIDFS_PACK_H
+
+#include <sys/stat.h>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct hfs_dentry;
+
+// Attributes of a packed file, which has no backing file to keep them.
+struct hfs_attr {
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec atime;
+  struct timespec mtime;
+  struct timespec ctime;
+};
+
+// Append-only file of records, one record per packed file version.
+struct hfs_container {
+  uint32_t id;
+  int32_t dev;              // first tier device holding the container
+  int fd;
+  int64_t size;             // where the next record goes
+  int64_t live;             // bytes of records still referenced
+  std::unordered_set<struct hfs_dentry*> members;
+  int64_t detached;         // members whose dentry the dentry cache dropped
+  int32_t pins = 0;         // reads going on without the packer locked
+  bool dropped = false;     // out of the packer, fd closed once unpinned
+};
+
+// Files up to threshold bytes on the first tier are kept as records in
+// shared containers instead of one backing file each. The index is the
+// dentry itself (d_pack_id, d_pack_off, d_size). Rewriting a file appends
+// a new record and leaves the old one dead, a full container whose live
+// records drop below a quarter is compacted into the active one, and a
+// file growing past threshold is unpacked into a whole backing file.
+// Compaction moves records of other files and drops containers readers may
+// be about to use, so it is left to compact, run on a thread of the packer
+// with no operation in flight.
+struct hfs_packer {
+  std::mutex lock;
+  int64_t threshold;          // 0 disables packing
+  int64_t container_size;     // a container takes no new records from this size
+  uint32_t next_id;
+  std::unordered_map<uint32_t, struct hfs_container*> containers;
+  std::vector<struct hfs_container*> active;   // per first tier device
+  std::unordered_set<uint32_t> sweep;          // containers to compact or drop
+  std::condition_variable cond;
+  bool stop;
+  std::function<void()> compact;
+  std::thread worker;
+};
+
+struct hfs_packer* packer_new(int64_t threshold, int64_t container_size, const std::function<void()>& compact);
+// Creates the container directories, the devices must exist.
+int packer_init(struct hfs_packer* packer);
+void packer_free(struct hfs_packer* packer);
+
+// Whether a new file on tier area starts packed.
+bool pack_want(struct hfs_packer* packer, int32_t area);
+void pack_new_file(struct hfs_packer* packer, struct hfs_dentry* dentry, mode_t mode);
+// New fd on a container, for reading records through the backing layer.
+int pack_dup(struct hfs_packer* packer, uint32_t id);
+// Attributes of a packed file. Writes set its times, so they are read and
+// changed with the packer locked. change gets the time ctime is set to.
+void pack_stat(struct hfs_packer* packer, const struct hfs_dentry* dentry, struct stat* st);
+struct hfs_attr pack_attr(struct hfs_packer* packer, const struct hfs_dentry* dentry);
+void pack_set_attr(struct hfs_packer* packer, struct hfs_dentry* dentry,
+                   const std::function<void(struct hfs_attr&, const struct timespec&)>& change);
+
+// All functions return 0 on success and -errno on failure, -ESTALE when
+// the file was unpacked meanwhile. pack_write and pack_truncate set d_size
+// with the new record, d_version is bumped whenever the record moves.
+// pack_read returns the bytes read. Records are never overwritten in place,
+// so reads from a container go on without the packer locked, and
+// pack_write starts over when another write moved the record meanwhile.
+ssize_t pack_read(struct hfs_packer* packer, const struct hfs_dentry* dentry, char *buf, size_t size, off_t off);
+int pack_write(struct hfs_packer* packer, struct hfs_dentry* dentry, const char *buf, size_t size, off_t off);
+int pack_truncate(struct hfs_packer* packer, struct hfs_dentry* dentry, off_t size);
+void pack_remove(struct hfs_packer* packer, struct hfs_dentry* dentry);
+// Moves the file into a whole backing file at path, its object name, on its
+// device, with the packer locked throughout. 0 if it is not packed. With the
+// tree lock held exclusively, operations holding it shared look at d_layout
+// without the packer lock.
+int pack_unpack(struct hfs_packer* packer, struct hfs_dentry* dentry, const std::string& path);
+// The dentry cache drops and reloads packed files. Their record stays live
+// while detached, and a container is not compacted until every member is
+// attached again.
+void pack_detach(struct hfs_packer* packer, struct hfs_dentry* dentry);
+void pack_attach(struct hfs_packer* packer, struct hfs_dentry* dentry);
+// Compacts or drops the containers left to it. With the tree lock held
+// exclusively.
+void pack_compact(struct hfs_packer* packer);
+
+#endif
@@ -0,0 +1,31 @@
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fuse.h>
+#include <cstdint>
+
+#include "passthrough.h"
+
+#ifdef FUSE_DEV_IOC_BACKING_OPEN
+
+int passthrough_open(int dev_fd, int fd) {
+  struct fuse_backing_map map{};
+  map.fd = fd;
+  int backing_id = ioctl(dev_fd, FUSE_DEV_IOC_BACKING_OPEN, &map);
+  return backing_id < 0 ? -errno : backing_id;
+}
+
+void passthrough_close(int dev_fd, int backing_id) {
+  uint32_t id = backing_id;
+  ioctl(dev_fd, FUSE_DEV_IOC_BACKING_CLOSE, &id);
+}
+
+#else
+
+int passthrough_open(int dev_fd, int fd) {
+  return -EOPNOTSUPP;
+}
+
+void passthrough_close(int dev_fd, int backing_id) {
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _HYBRIDFS_PASSTHROUGH_H
+#define _HYBRIDFS_PASSTHROUGH_H
+
+// FUSE passthrough (Linux 6.9): a file opened with a backing id has its
+// reads and writes done by the kernel on the registered fd, the daemon
+// only sees the open and the release.
+
+// Registers fd with the fuse device, returns the backing id to open the
+// file with or -errno, -EOPNOTSUPP when built against older kernel headers.
+int passthrough_open(int dev_fd, int fd);
+// Drops the registration, files opened with it keep their backing file.
+void passthrough_close(int dev_fd, int backing_id);
+
+#endif
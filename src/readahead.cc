@@ -0,0 +1,158 @@
+#include <fcntl.h>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "readahead.h"
+
+struct hfs_readahead* readahead_new() {
+  struct hfs_readahead* ra = new hfs_readahead();
+  ra->next_off = 0;
+  ra->seq_count = 0;
+  ra->window = HFS_META->readahead_min;
+  ra->buf_off = 0;
+  ra->buf_len = 0;
+  ra->buf_seq = 0;
+  ra->pending = false;
+  ra->fill_off = 0;
+  ra->fill_len = 0;
+  ra->fill_seq = 0;
+  return ra;
+}
+
+void readahead_drain(struct hfs_readahead* ra) {
+  std::lock_guard<std::mutex> lock(ra->lock);
+  if(ra->pending) {
+    ra->fill.wait();
+    ra->pending = false;
+  }
+  ra->buf_len = 0;
+}
+
+void readahead_free(struct hfs_readahead* ra) {
+  readahead_drain(ra);
+  delete ra;
+}
+
+bool readahead_streaming(struct hfs_readahead* ra) {
+  std::lock_guard<std::mutex> lock(ra->lock);
+  return ra->seq_count >= 2;
+}
+
+// Turns a finished prefetch into the served buffer.
+static void collect_fill(struct hfs_readahead* ra, bool wait) {
+  if(!ra->pending) {
+    return ;
+  }
+  if(!wait && ra->fill.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+    return ;
+  }
+  ra->fill.wait();
+  ra->pending = false;
+  if(ra->fill_len > 0) {
+    ra->buf.swap(ra->fill_buf);
+    ra->buf_off = ra->fill_off;
+    ra->buf_len = ra->fill_len;
+    ra->buf_seq = ra->fill_seq;
+  }
+}
+
+static void advise(const struct hfs_place& place, const std::vector<int>& fds, off_t off, int64_t len, int advice) {
+  if(place.layout == FileLayout::COMPRESSED) {
+    // offsets in the backing file are not the file offsets
+    return ;
+  }
+  // striped pieces each hold about 1/width of the range
+  off_t piece_off = place.pack_off + off / piece_count(place);
+  int64_t piece_len = len / piece_count(place) + HFS_META->stripe_unit;
+  for(int fd : fds) {
+    posix_fadvise(fd, piece_off, piece_len, advice);
+  }
+}
+
+ssize_t readahead_read(struct hfs_readahead* ra, const struct hfs_place& place, const std::vector<int>& fds,
+                       const std::vector<int>* dio_fds, char *buf, size_t size, off_t off, int64_t file_size, uint64_t write_seq) {
+  std::lock_guard<std::mutex> lock(ra->lock);
+  // wait for a prefetch of exactly this range, otherwise only take it if done
+  collect_fill(ra, ra->pending && off >= ra->fill_off && off < ra->fill_off + (off_t)ra->fill_buf.size());
+  size_t served = 0;
+  if(ra->buf_len > 0 && ra->buf_seq == write_seq && off >= ra->buf_off && off < ra->buf_off + (off_t)ra->buf_len) {
+    served = std::min<size_t>(size, ra->buf_off + ra->buf_len - off);
+    memcpy(buf, ra->buf.data() + (off - ra->buf_off), served);
+  }
+  ssize_t read_size = served;
+  // whole files are read up to the end of the backing file, a write through
+  // another hard link may have taken it past file_size
+  bool more = place.layout == FileLayout::WHOLE || off + (off_t)served < file_size;
+  if(served < size && more) {
+    ssize_t rest;
+    if(dio_fds != nullptr && (int64_t)(size - served) >= HFS_META->direct_io_size) {
+      rest = backing_pread_direct(place, *dio_fds, buf + served, size - served, off + served, file_size);
+    } else {
+      rest = backing_pread(place, fds, buf + served, size - served, off + served, file_size);
+    }
+    if(rest < 0) {
+      return rest;
+    }
+    read_size += rest;
+  }
+
+  // detect sequential streams, the kernel may reorder a few async reads
+  bool sequential = off == ra->next_off || (ra->seq_count > 0 && off > ra->next_off - ra->window && off <= ra->next_off);
+  struct hfs_tier* tier = HFS_META->tiers[place.area];
+  int64_t max_window = tier->tclass == TierClass::HDD ? HFS_META->readahead_max : HFS_META->readahead_max / 4;
+  if(sequential) {
+    ra->seq_count++;
+    ra->window = std::min(ra->window * 2, std::max(max_window, HFS_META->readahead_min));
+    if(ra->seq_count == 2) {
+      advise(place, fds, off, file_size - off, POSIX_FADV_SEQUENTIAL);
+    }
+  } else {
+    if(ra->seq_count >= 2) {
+      advise(place, fds, 0, file_size, POSIX_FADV_NORMAL);
+    }
+    ra->seq_count = 0;
+    ra->window = HFS_META->readahead_min;
+  }
+  ra->next_off = std::max<off_t>(ra->next_off, off + read_size);
+  if(!sequential) {
+    ra->next_off = off + read_size;
+  }
+  if(ra->seq_count < 2 || ra->next_off >= file_size) {
+    return read_size;
+  }
+
+  // start the next window behind what is already buffered
+  off_t start = ra->next_off;
+  if(ra->buf_len > 0 && ra->buf_seq == write_seq && start >= ra->buf_off && start < ra->buf_off + (off_t)ra->buf_len) {
+    start = ra->buf_off + ra->buf_len;
+  }
+  if(start - ra->next_off > ra->window / 2 || start >= file_size) {
+    // far enough ahead already
+    return read_size;
+  }
+  int64_t len = std::min<int64_t>(ra->window, file_size - start);
+  bool direct = dio_fds != nullptr && len >= HFS_META->direct_io_size;
+  if(!direct) {
+    advise(place, fds, start, len, POSIX_FADV_WILLNEED);
+  }
+  if(tier->tclass != TierClass::HDD || ra->pending) {
+    // fast tiers only get the hint
+    return read_size;
+  }
+  ra->fill_buf.resize(len);
+  ra->fill_off = start;
+  ra->fill_len = 0;
+  ra->fill_seq = write_seq;
+  ra->pending = true;
+  std::vector<int> fill_fds = direct ? *dio_fds : fds;
+  ra->fill = HFS_META->ra_pool->submit([ra, place, fill_fds, direct, start, len, file_size]() {
+    if(direct) {
+      ra->fill_len = backing_pread_direct(place, fill_fds, ra->fill_buf.data(), len, start, file_size);
+    } else {
+      ra->fill_len = backing_pread(place, fill_fds, ra->fill_buf.data(), len, start, file_size);
+    }
+  });
+  spdlog::info("[readahead] prefetch offset {} size {}{}", start, len, direct ? " direct" : "");
+  return read_size;
+}
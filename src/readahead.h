@@ -0,0 +1,45 @@
+#ifndef _HYBRIDFS_READAHEAD_H
+#define _HYBRIDFS_READAHEAD_H
+
+#include <future>
+#include <mutex>
+#include <vector>
+
+#include "backing.h"
+
+// Per handle access pattern and prefetch buffer. Once a handle reads
+// sequentially the backing fds get fadvise hints, and on slow tiers the
+// next window is read into memory in the background while the current
+// request is being consumed. The window doubles on every sequential hit.
+// Given O_DIRECT fds, requests and windows of at least direct_io_size are
+// read through them instead of the page cache.
+struct hfs_readahead {
+  std::mutex lock;
+  off_t next_off;           // where a sequential reader goes next
+  int32_t seq_count;        // sequential requests in a row
+  int64_t window;
+  // data already prefetched
+  std::vector<char> buf;
+  off_t buf_off;
+  size_t buf_len;
+  uint64_t buf_seq;         // d_write_seq the data was read at
+  // prefetch in flight
+  bool pending;
+  std::future<void> fill;
+  std::vector<char> fill_buf;
+  off_t fill_off;
+  ssize_t fill_len;
+  uint64_t fill_seq;
+};
+
+struct hfs_readahead* readahead_new();
+// Waits for a prefetch in flight, must be called before the fds it reads
+// from are closed.
+void readahead_drain(struct hfs_readahead* ra);
+void readahead_free(struct hfs_readahead* ra);
+// Whether the handle reads sequentially.
+bool readahead_streaming(struct hfs_readahead* ra);
+ssize_t readahead_read(struct hfs_readahead* ra, const struct hfs_place& place, const std::vector<int>& fds,
+                       const std::vector<int>* dio_fds, char *buf, size_t size, off_t off, int64_t file_size, uint64_t write_seq);
+
+#endif
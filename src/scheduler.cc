@@ -0,0 +1,146 @@
+#include <spdlog/spdlog.h>
+
+#include "scheduler.h"
+#include "tier.h"
+
+// How often a device budget is scaled, and its bounds.
+static constexpr auto ADJUST_INTERVAL = std::chrono::milliseconds(100);
+static constexpr double MIN_SCALE = 1.0 / 64;
+static constexpr double SCALE_STEP = 1.0 / 16;
+
+static void worker(struct hfs_scheduler* s) {
+  io_background = true;
+  std::unique_lock<std::mutex> lock(s->lock);
+  while(true) {
+    s->cond.wait(lock, [s] { return s->stop || !s->queue.empty(); });
+    if(s->stop) {
+      return ;
+    }
+    struct hfs_dentry* dentry = s->queue.front();
+    s->queue.pop_front();
+    s->queued.erase(dentry);
+    s->running = dentry;
+    s->cancelled = false;
+    lock.unlock();
+    s->migrate(dentry);
+    lock.lock();
+    s->running = nullptr;
+    s->migrations++;
+  }
+}
+
+struct hfs_scheduler* sched_new(int64_t bandwidth, int64_t iops, double latency_factor,
+                                const std::function<void(struct hfs_dentry*)>& migrate) {
+  struct hfs_scheduler* s = new hfs_scheduler();
+  s->bandwidth = bandwidth;
+  s->iops = iops;
+  s->latency_factor = latency_factor;
+  s->running = nullptr;
+  s->cancelled = false;
+  s->stop = false;
+  s->migrate = migrate;
+  s->migrations = 0;
+  s->throttled_ns = 0;
+  s->backoffs = 0;
+  s->worker = std::thread(worker, s);
+  return s;
+}
+
+void sched_free(struct hfs_scheduler* s) {
+  {
+    std::lock_guard<std::mutex> lock(s->lock);
+    s->stop = true;
+  }
+  s->cond.notify_all();
+  s->worker.join();
+  spdlog::info("[sched] migrations: {}, left queued: {}, throttled: {} ms, backoffs: {}", s->migrations, s->queue.size(),
+               s->throttled_ns / 1000000, s->backoffs);
+  delete s;
+}
+
+void sched_enqueue(struct hfs_scheduler* s, struct hfs_dentry* dentry) {
+  {
+    std::lock_guard<std::mutex> lock(s->lock);
+    if(!s->queued.insert(dentry).second) {
+      return ;
+    }
+    s->queue.push_back(dentry);
+  }
+  // throttled background threads wait on the same condition
+  s->cond.notify_all();
+}
+
+void sched_cancel(struct hfs_scheduler* s, struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(s->lock);
+  if(s->queued.erase(dentry) != 0) {
+    for(auto it = s->queue.begin(); it != s->queue.end(); it++) {
+      if(*it == dentry) {
+        s->queue.erase(it);
+        break;
+      }
+    }
+  }
+  if(s->running == dentry) {
+    s->cancelled = true;
+  }
+}
+
+bool sched_cancelled(struct hfs_scheduler* s, struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(s->lock);
+  return s->running == dentry && s->cancelled;
+}
+
+bool sched_queued(struct hfs_scheduler* s, const struct hfs_dentry* dentry) {
+  std::lock_guard<std::mutex> lock(s->lock);
+  struct hfs_dentry* d = const_cast<struct hfs_dentry*>(dentry);
+  return s->running == d || s->queued.count(d) != 0;
+}
+
+bool sched_should_yield(struct hfs_scheduler* s) {
+  std::lock_guard<std::mutex> lock(s->lock);
+  return s->stop || !s->queue.empty();
+}
+
+void sched_throttle(struct hfs_scheduler* s, const struct hfs_device* dev, int64_t bytes) {
+  if(!io_background || (s->bandwidth == 0 && s->iops == 0)) {
+    return ;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(s->lock);
+  auto it = s->budgets.find(dev);
+  if(it == s->budgets.end()) {
+    it = s->budgets.emplace(dev, hfs_dev_budget{(double)s->bandwidth, (double)s->iops, 1.0, now, now}).first;
+  }
+  struct hfs_dev_budget& b = it->second;
+  if(now - b.adjust >= ADJUST_INTERVAL) {
+    b.adjust = now;
+    if(device_congested(dev, s->latency_factor)) {
+      if(b.scale > MIN_SCALE) {
+        spdlog::info("[sched] {} congested, background share {}", dev->path, b.scale / 2);
+        s->backoffs++;
+      }
+      b.scale = std::max(b.scale / 2, MIN_SCALE);
+    } else {
+      b.scale = std::min(b.scale + SCALE_STEP, 1.0);
+    }
+  }
+  // refill, bursts of at most one second
+  double elapsed = std::chrono::duration<double>(now - b.refill).count();
+  b.refill = now;
+  double bytes_rate = s->bandwidth * b.scale, ios_rate = s->iops * b.scale;
+  b.bytes = std::min(b.bytes + elapsed * bytes_rate, bytes_rate) - bytes;
+  b.ios = std::min(b.ios + elapsed * ios_rate, ios_rate) - 1;
+  double wait = 0;
+  if(s->bandwidth > 0 && b.bytes < 0) {
+    wait = -b.bytes / bytes_rate;
+  }
+  if(s->iops > 0 && b.ios < 0) {
+    wait = std::max(wait, -b.ios / ios_rate);
+  }
+  if(wait > 0) {
+    // shutdown cuts the wait short
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(wait));
+    s->throttled_ns += duration.count();
+    s->cond.wait_for(lock, duration, [s] { return s->stop; });
+  }
+}
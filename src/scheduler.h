@@ -0,0 +1,70 @@
+#ifndef _HYBRIDFS_SCHEDULER_H
+#define _HYBRIDFS_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+struct hfs_dentry;
+struct hfs_device;
+
+// Background budget of one device. Tokens may go negative, a request
+// waits until the debt is paid back.
+struct hfs_dev_budget {
+  double bytes;
+  double ios;
+  double scale;   // share of the budget granted, cut while foreground I/O suffers
+  std::chrono::steady_clock::time_point refill;
+  std::chrono::steady_clock::time_point adjust;
+};
+
+// Runs migrations on a thread of its own instead of inside the operation
+// that made a file cross a tier limit. Background I/O is charged against
+// per device bandwidth and IOPS budgets, and the budgets of a device
+// shrink (halved, then regained by sixteenths) while its foreground
+// latency is latency_factor times above its long term average.
+struct hfs_scheduler {
+  std::mutex lock;
+  std::condition_variable cond;
+  int64_t bandwidth;          // bytes/s per device, 0 for no limit
+  int64_t iops;               // requests/s per device, 0 for no limit
+  double latency_factor;
+  std::unordered_map<const struct hfs_device*, struct hfs_dev_budget> budgets;
+  std::deque<struct hfs_dentry*> queue;
+  std::unordered_set<struct hfs_dentry*> queued;
+  struct hfs_dentry* running;   // migration in progress
+  bool cancelled;               // running was deleted meanwhile
+  bool stop;
+  std::function<void(struct hfs_dentry*)> migrate;
+  std::thread worker;
+  // stats
+  uint64_t migrations;
+  int64_t throttled_ns;
+  uint32_t backoffs;
+};
+
+struct hfs_scheduler* sched_new(int64_t bandwidth, int64_t iops, double latency_factor,
+                                const std::function<void(struct hfs_dentry*)>& migrate);
+// Stops the worker once the migration in progress is done.
+void sched_free(struct hfs_scheduler* s);
+
+// Queues dentry for migrate, once.
+void sched_enqueue(struct hfs_scheduler* s, struct hfs_dentry* dentry);
+// Must be called before a queued or running dentry is deleted.
+void sched_cancel(struct hfs_scheduler* s, struct hfs_dentry* dentry);
+bool sched_cancelled(struct hfs_scheduler* s, struct hfs_dentry* dentry);
+// Whether dentry waits in the queue or is being migrated.
+bool sched_queued(struct hfs_scheduler* s, const struct hfs_dentry* dentry);
+// Whether a long migration should make way, for other queued files or for
+// shutdown.
+bool sched_should_yield(struct hfs_scheduler* s);
+// Charges bytes of background I/O to dev, sleeping while over budget.
+// Foreground callers pass through.
+void sched_throttle(struct hfs_scheduler* s, const struct hfs_device* dev, int64_t bytes);
+
+#endif
@@ -0,0 +1,50 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t threads) : stop_(false) {
+  for(size_t i = 0; i < threads; i++) {
+    workers_.emplace_back(&ThreadPool::worker, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  for(std::thread& t : workers_) {
+    t.join();
+  }
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+  std::packaged_task<void()> packed(std::move(task));
+  std::future<void> result = packed.get_future();
+  if(workers_.empty()) {
+    // no worker, run in caller
+    packed();
+    return result;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(packed));
+  }
+  cond_.notify_one();
+  return result;
+}
+
+void ThreadPool::worker() {
+  while(true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if(stop_ && tasks_.empty()) {
+        return ;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
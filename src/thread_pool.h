@@ -0,0 +1,30 @@
+#ifndef _HYBRIDFS_THREAD_POOL_H
+#define _HYBRIDFS_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size pool used to issue backing I/O in parallel.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  std::future<void> submit(std::function<void()> task);
+
+private:
+  void worker();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::packaged_task<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_;
+};
+
+#endif
@@ -0,0 +1,257 @@
+#include <sys/statvfs.h>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+
+#include <spdlog/spdlog.h>
+
+#include "tier.h"
+
+bool parse_size(const std::string& str, int64_t& size) {
+  if(str.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  errno = 0;
+  int64_t value = strtoll(str.c_str(), &end, 10);
+  if(end == str.c_str() || value < 0 || errno == ERANGE) {
+    return false;
+  }
+  int shift = 0;
+  switch(*end) {
+    case 0:
+      break;
+    case 'K': case 'k':
+      shift = 10;
+      break;
+    case 'M': case 'm':
+      shift = 20;
+      break;
+    case 'G': case 'g':
+      shift = 30;
+      break;
+    case 'T': case 't':
+      shift = 40;
+      break;
+    default:
+      return false;
+  }
+  if(*end != 0 && *(end + 1) != 0) {
+    return false;
+  }
+  if(value > (INT64_MAX >> shift)) {
+    // does not fit in bytes
+    return false;
+  }
+  size = value << shift;
+  return true;
+}
+
+bool valid_size(const char* flag, const std::string& value) {
+  int64_t size;
+  return parse_size(value, size);
+}
+
+int64_t size_value(const std::string& value) {
+  int64_t size = 0;
+  parse_size(value, size);
+  return size;
+}
+
+bool parse_tier_class(const std::string& str, TierClass& tclass) {
+  if(str == "memory" || str == "tmpfs") {
+    tclass = TierClass::MEMORY;
+  } else if(str == "nvme") {
+    tclass = TierClass::NVME;
+  } else if(str == "ssd") {
+    tclass = TierClass::SSD;
+  } else if(str == "hdd") {
+    tclass = TierClass::HDD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* tier_class_name(TierClass tclass) {
+  switch(tclass) {
+    case TierClass::MEMORY:
+      return "memory";
+    case TierClass::NVME:
+      return "nvme";
+    case TierClass::SSD:
+      return "ssd";
+    case TierClass::HDD:
+      return "hdd";
+  }
+  return "unknown";
+}
+
+bool load_tier_config(const std::string& file, std::vector<struct hfs_tier*>& tiers) {
+  std::ifstream in(file);
+  if(!in.is_open()) {
+    spdlog::error("[tier] failed to open tier config {}", file);
+    return false;
+  }
+  std::string line;
+  int line_no = 0;
+  while(std::getline(in, line)) {
+    line_no++;
+    size_t comment = line.find('#');
+    if(comment != std::string::npos) {
+      line.erase(comment);
+    }
+    std::istringstream fields(line);
+    std::string name, path, tclass, capacity, upper_limit, lower_limit;
+    if(!(fields >> name)) {
+      // empty line
+      continue;
+    }
+    TierClass t_class;
+    int64_t t_capacity, t_upper_limit, t_lower_limit;
+    if(!(fields >> path >> tclass >> capacity >> upper_limit >> lower_limit)
+       || !parse_tier_class(tclass, t_class)
+       || !parse_size(capacity, t_capacity)
+       || !parse_size(upper_limit, t_upper_limit)
+       || !parse_size(lower_limit, t_lower_limit)) {
+      spdlog::error("[tier] bad tier config at {}:{}", file, line_no);
+      return false;
+    }
+    struct hfs_tier* tier = new_tier(name, path, t_class, t_capacity, t_upper_limit, t_lower_limit);
+    if(tier == nullptr) {
+      spdlog::error("[tier] bad tier config at {}:{}", file, line_no);
+      return false;
+    }
+    spdlog::info("[tier] tier {} {} class {} devices {} capacity {} upper {} lower {}", tiers.size(), tier->name,
+                 tclass, tier->devices.size(), tier->capacity, tier->upper_limit, tier->lower_limit);
+    tiers.push_back(tier);
+  }
+  if(tiers.empty()) {
+    spdlog::error("[tier] no tier in config {}", file);
+    return false;
+  }
+  return true;
+}
+
+struct hfs_tier* new_tier(const std::string& name, const std::string& paths, TierClass tclass,
+                          int64_t capacity, int64_t upper_limit, int64_t lower_limit) {
+  struct hfs_tier* tier = new hfs_tier{name, {}, tclass, capacity, upper_limit, lower_limit, {0}};
+  std::istringstream in(paths);
+  std::string path;
+  while(std::getline(in, path, ',')) {
+    if(!path.empty()) {
+      tier->devices.push_back(new hfs_device{path, {0}});
+    }
+  }
+  if(tier->devices.empty()) {
+    // nothing to place pieces on
+    spdlog::error("[tier] tier {} has no device", name);
+    delete tier;
+    return nullptr;
+  }
+  return tier;
+}
+
+// How long a device keeps the free space it last saw.
+static constexpr int64_t FREE_SPACE_TTL_NS = 1000 * 1000 * 1000;
+
+static int64_t steady_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Free bytes of dev, refreshed by whichever caller finds it stale, -1 if
+// the device can not be asked.
+static int64_t device_free(struct hfs_device* dev) {
+  int64_t now = steady_ns();
+  int64_t seen = dev->free_at.load(std::memory_order_relaxed);
+  if((seen == 0 || now - seen > FREE_SPACE_TTL_NS) && dev->free_at.compare_exchange_strong(seen, now)) {
+    struct statvfs vfs;
+    dev->free_size.store(statvfs(dev->path.c_str(), &vfs) == 0 ? (int64_t)(vfs.f_bavail * vfs.f_frsize) : -1);
+  }
+  return dev->free_size.load(std::memory_order_relaxed);
+}
+
+int32_t tier_pick_device(const struct hfs_tier* tier, int64_t size) {
+  int32_t best = -1;
+  double best_score = 0;
+  for(size_t i = 0; i < tier->devices.size(); i++) {
+    int64_t free_size = device_free(tier->devices[i]);
+    if(free_size < 0 || free_size < size) {
+      continue;
+    }
+    // prefer empty devices, divided by the requests already queued on them
+    double score = (double)free_size / (1 + tier->devices[i]->inflight.load());
+    if(best == -1 || score > best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+bool tier_has_space(const struct hfs_tier* tier, int64_t size) {
+  if(tier->capacity > 0 && tier->used.load() + size > tier->capacity) {
+    return false;
+  }
+  return tier_pick_device(tier, size) != -1;
+}
+
+int32_t tier_by_name(const std::vector<struct hfs_tier*>& tiers, const std::string& name) {
+  for(size_t i = 0; i < tiers.size(); i++) {
+    if(tiers[i]->name == name || std::to_string(i) == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int32_t tier_for_new_file(const std::vector<struct hfs_tier*>& tiers, int64_t size) {
+  for(size_t i = 0; i + 1 < tiers.size(); i++) {
+    if(size < tiers[i]->upper_limit && tier_has_space(tiers[i], size)) {
+      return i;
+    }
+  }
+  return tiers.size() - 1;
+}
+
+int32_t tier_for_size(const std::vector<struct hfs_tier*>& tiers, int32_t cur, int64_t size) {
+  if(cur + 1 < (int32_t)tiers.size() && size >= tiers[cur]->upper_limit && tier_has_space(tiers[cur + 1], size)) {
+    // demote to the next slower tier
+    return cur + 1;
+  }
+  if(cur > 0 && size <= tiers[cur]->lower_limit && tier_has_space(tiers[cur - 1], size)) {
+    // promote to the next faster tier
+    return cur - 1;
+  }
+  return cur;
+}
+
+thread_local bool io_background = false;
+
+// Latency below this is the page cache answering, not the device.
+static constexpr int64_t CONGESTION_FLOOR_NS = 500 * 1000;
+// Averages older than this say nothing about the device now.
+static constexpr int64_t CONGESTION_WINDOW_NS = 1000 * 1000 * 1000;
+
+void device_record_latency(struct hfs_device* dev, int64_t ns) {
+  // racy updates only lose samples
+  int64_t slow = dev->fg_slow.load(std::memory_order_relaxed);
+  if(slow == 0) {
+    dev->fg_fast.store(ns, std::memory_order_relaxed);
+    dev->fg_slow.store(ns, std::memory_order_relaxed);
+  } else {
+    int64_t fast = dev->fg_fast.load(std::memory_order_relaxed);
+    dev->fg_fast.store(fast + (ns - fast) / 8, std::memory_order_relaxed);
+    dev->fg_slow.store(slow + (ns - slow) / 256, std::memory_order_relaxed);
+  }
+  dev->fg_last.store(steady_ns(), std::memory_order_relaxed);
+}
+
+bool device_congested(const struct hfs_device* dev, double factor) {
+  if(steady_ns() - dev->fg_last.load(std::memory_order_relaxed) > CONGESTION_WINDOW_NS) {
+    // no foreground load to protect
+    return false;
+  }
+  int64_t fast = dev->fg_fast.load(std::memory_order_relaxed);
+  return fast > CONGESTION_FLOOR_NS && fast > factor * dev->fg_slow.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,95 @@
+#ifndef _HYBRIDFS_TIER_H
+#define _HYBRIDFS_TIER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class TierClass{
+  MEMORY,
+  NVME,
+  SSD,
+  HDD,
+};
+
+// One backing directory of a tier, usually one per physical device.
+struct hfs_device {
+  std::string path;
+  std::atomic<int32_t> inflight;   // backing I/O currently issued to the device
+  // foreground request latency, ns: a fast and a slow moving average, and
+  // when the last request finished
+  std::atomic<int64_t> fg_fast{0};
+  std::atomic<int64_t> fg_slow{0};
+  std::atomic<int64_t> fg_last{0};
+  // O_PATH directories backing calls resolve names from, opened at mount,
+  // see backing_dirfd
+  int root_fd = -1;
+  int tmp_fd = -1;
+  std::vector<int> obj_fds;   // first fan-out level of the object directory
+  // free bytes from the last statvfs, and when it ran, see tier_pick_device
+  std::atomic<int64_t> free_size{-1};
+  std::atomic<int64_t> free_at{0};
+};
+
+// One storage tier. Tiers are kept ordered from fastest to slowest, the
+// tier index is what a dentry stores in d_area and the device index within
+// the tier what it stores in d_dev.
+struct hfs_tier {
+  std::string name;
+  std::vector<struct hfs_device*> devices;
+  TierClass tclass;
+  int64_t capacity;       // bytes, 0 means bounded only by the device
+  int64_t upper_limit;    // files growing to this size move to the next tier
+  int64_t lower_limit;    // files shrinking to this size move to the previous tier
+  std::atomic<int64_t> used;
+};
+
+bool parse_size(const std::string& str, int64_t& size);
+// Size flags are strings with the same suffixes: valid_size is their gflags
+// validator, size_value the size of one it let through.
+bool valid_size(const char* flag, const std::string& value);
+int64_t size_value(const std::string& value);
+bool parse_tier_class(const std::string& str, TierClass& tclass);
+const char* tier_class_name(TierClass tclass);
+
+// Config file, one tier per line from fastest to slowest:
+//   <name> <path>[,<path>...] <class> <capacity> <upper_limit> <lower_limit>
+// Sizes accept K/M/G/T suffixes, '#' starts a comment.
+bool load_tier_config(const std::string& file, std::vector<struct hfs_tier*>& tiers);
+// nullptr if paths names no device.
+struct hfs_tier* new_tier(const std::string& name, const std::string& paths, TierClass tclass,
+                          int64_t capacity, int64_t upper_limit, int64_t lower_limit);
+
+// Picks the device with the best free space / queue depth ratio that can
+// hold size more bytes, -1 if no device can.
+int32_t tier_pick_device(const struct hfs_tier* tier, int64_t size);
+// Index of the tier with that name (or index), -1 if there is none.
+int32_t tier_by_name(const std::vector<struct hfs_tier*>& tiers, const std::string& name);
+bool tier_has_space(const struct hfs_tier* tier, int64_t size);
+int32_t tier_for_new_file(const std::vector<struct hfs_tier*>& tiers, int64_t size);
+int32_t tier_for_size(const std::vector<struct hfs_tier*>& tiers, int32_t cur, int64_t size);
+
+// Set on threads doing background work (migration) for the time they do it.
+extern thread_local bool io_background;
+
+void device_record_latency(struct hfs_device* dev, int64_t ns);
+// Whether recent foreground requests are factor times slower than usual.
+bool device_congested(const struct hfs_device* dev, double factor);
+
+// Counts one backing request against the device queue depth while in scope,
+// foreground requests also feed the device latency averages.
+struct hfs_io_guard {
+  struct hfs_device* dev;
+  std::chrono::steady_clock::time_point start;
+  explicit hfs_io_guard(struct hfs_device* d) : dev(d), start(std::chrono::steady_clock::now()) { dev->inflight++; }
+  ~hfs_io_guard() {
+    dev->inflight--;
+    if(!io_background) {
+      device_record_latency(dev, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+  }
+};
+
+#endif
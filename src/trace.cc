@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+
+#include <spdlog/spdlog.h>
+
+#include "trace.h"
+
+struct hfs_tracer* hfs_trace = nullptr;
+thread_local struct hfs_trace_record trace_current;
+static thread_local struct hfs_trace_buffer* trace_buffer = nullptr;
+static thread_local std::chrono::steady_clock::time_point trace_start;
+
+// Bytes a thread buffers before writing them out.
+static constexpr size_t TRACE_BUFFER_SIZE = 64 * 1024;
+
+static const char* const TRACE_OP_NAMES[] = {
+  "name", "getattr", "readlink", "mkdir", "unlink", "rmdir", "symlink", "rename", "link", "chmod",
+  "chown", "truncate", "open", "read", "write", "flush", "release", "fsync", "setxattr", "getxattr",
+  "listxattr", "removexattr", "readdir", "access", "create", "utimens", "fallocate", "copy_file_range", "lseek", "migrate",
+};
+static_assert(sizeof(TRACE_OP_NAMES) / sizeof(TRACE_OP_NAMES[0]) == (size_t)TraceOp::COUNT, "trace op names");
+
+const char* trace_op_name(TraceOp op) {
+  return op < TraceOp::COUNT ? TRACE_OP_NAMES[(size_t)op] : "unknown";
+}
+
+int trace_open(const std::string& file) {
+  int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    return -errno;
+  }
+  if(write(fd, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != sizeof(TRACE_MAGIC)) {
+    close(fd);
+    return -EIO;
+  }
+  hfs_trace = new hfs_tracer();
+  hfs_trace->fd = fd;
+  hfs_trace->start = std::chrono::steady_clock::now();
+  spdlog::info("[trace] recording to {}", file);
+  return 0;
+}
+
+// With buf and the tracer locked.
+static void write_out_locked(struct hfs_trace_buffer* buf) {
+  size_t done = 0;
+  while(done < buf->data.size()) {
+    ssize_t n = write(hfs_trace->fd, buf->data.data() + done, buf->data.size() - done);
+    if(n <= 0) {
+      spdlog::info("[trace] failed to write the trace: {}", strerror(errno));
+      break;
+    }
+    done += n;
+  }
+  buf->data.clear();
+}
+
+void trace_close() {
+  if(hfs_trace == nullptr) {
+    return ;
+  }
+  struct hfs_tracer* tracer = hfs_trace;
+  {
+    std::lock_guard<std::mutex> lock(tracer->lock);
+    for(struct hfs_trace_buffer* buf : tracer->buffers) {
+      std::lock_guard<std::mutex> buf_lock(buf->lock);
+      write_out_locked(buf);
+    }
+  }
+  hfs_trace = nullptr;
+  close(tracer->fd);
+  // buffers stay, threads that traced may still hold them
+}
+
+static void append(const struct hfs_trace_record& record, const char *extra, size_t extra_size) {
+  struct hfs_trace_buffer* buf = trace_buffer;
+  if(buf == nullptr) {
+    buf = new hfs_trace_buffer();
+    buf->data.reserve(TRACE_BUFFER_SIZE);
+    std::lock_guard<std::mutex> lock(hfs_trace->lock);
+    hfs_trace->buffers.push_back(buf);
+    trace_buffer = buf;
+  }
+  std::lock_guard<std::mutex> buf_lock(buf->lock);
+  const char *bytes = (const char*)&record;
+  buf->data.insert(buf->data.end(), bytes, bytes + sizeof(record));
+  buf->data.insert(buf->data.end(), extra, extra + extra_size);
+  if(buf->data.size() >= TRACE_BUFFER_SIZE) {
+    std::lock_guard<std::mutex> lock(hfs_trace->lock);
+    write_out_locked(buf);
+  }
+}
+
+static uint64_t since_start(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t - hfs_trace->start).count();
+}
+
+void trace_begin(TraceOp op) {
+  trace_current = hfs_trace_record{};
+  trace_current.op = op;
+  trace_current.tier = -1;
+  trace_start = std::chrono::steady_clock::now();
+}
+
+void trace_end(int64_t result) {
+  if(hfs_trace == nullptr) {
+    return ;
+  }
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  trace_current.time_ns = since_start(trace_start);
+  trace_current.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(now - trace_start).count();
+  trace_current.result = (int32_t)std::max<int64_t>(std::min<int64_t>(result, INT32_MAX), INT32_MIN);
+  append(trace_current, nullptr, 0);
+}
+
+void trace_name(uint64_t oid, const std::string& path) {
+  if(hfs_trace == nullptr) {
+    return ;
+  }
+  // stamped with the start of the running operation so it sorts before it
+  std::chrono::steady_clock::time_point t = trace_start;
+  if(t < hfs_trace->start) {
+    t = std::chrono::steady_clock::now();
+  }
+  struct hfs_trace_record record{};
+  record.time_ns = since_start(t);
+  record.oid = oid;
+  record.size = path.size();
+  record.op = TraceOp::NAME;
+  record.tier = -1;
+  append(record, path.data(), path.size());
+}
+
+void trace_event(TraceOp op, uint64_t oid, int32_t tier, int64_t off, int64_t size, std::chrono::steady_clock::time_point start) {
+  if(hfs_trace == nullptr) {
+    return ;
+  }
+  struct hfs_trace_record record{};
+  record.time_ns = since_start(start);
+  record.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  record.oid = oid;
+  record.off = off;
+  record.size = size;
+  record.op = op;
+  record.tier = tier;
+  append(record, nullptr, 0);
+}
+
+bool trace_load(const std::string& file, std::vector<struct hfs_trace_record>& records, std::vector<std::string>& names) {
+  std::ifstream in(file, std::ios::binary);
+  char magic[sizeof(TRACE_MAGIC)];
+  if(!in.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    spdlog::error("[trace] {} is not a trace", file);
+    return false;
+  }
+  std::vector<struct hfs_trace_record> loaded;
+  std::vector<std::string> loaded_names;
+  struct hfs_trace_record record;
+  while(in.read((char*)&record, sizeof(record))) {
+    std::string name;
+    if(record.op == TraceOp::NAME) {
+      name.resize(record.size);
+      if(!in.read(&name[0], name.size())) {
+        break;
+      }
+    }
+    loaded.push_back(record);
+    loaded_names.push_back(std::move(name));
+  }
+  // buffers of different threads interleave
+  std::vector<size_t> order(loaded.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return loaded[a].time_ns < loaded[b].time_ns; });
+  records.clear();
+  names.clear();
+  for(size_t i : order) {
+    records.push_back(loaded[i]);
+    names.push_back(std::move(loaded_names[i]));
+  }
+  return true;
+}
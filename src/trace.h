@@ -0,0 +1,120 @@
+#ifndef _HYBRIDFS_TRACE_H
+#define _HYBRIDFS_TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class TraceOp : uint8_t {
+  NAME,           // path of oid, size bytes of path follow the record
+  GETATTR,
+  READLINK,
+  MKDIR,
+  UNLINK,
+  RMDIR,
+  SYMLINK,
+  RENAME,
+  LINK,           // off is the oid linked to
+  CHMOD,
+  CHOWN,
+  TRUNCATE,       // off is the new size
+  OPEN,           // off is the open flags
+  READ,
+  WRITE,
+  FLUSH,
+  RELEASE,
+  FSYNC,
+  SETXATTR,
+  GETXATTR,
+  LISTXATTR,
+  REMOVEXATTR,
+  READDIR,
+  ACCESS,
+  CREATE,         // off is the open flags
+  UTIMENS,
+  FALLOCATE,
+  COPY_FILE_RANGE,
+  LSEEK,
+  MIGRATE,        // background move of size bytes to tier, off is the old tier
+  COUNT,
+};
+
+const char* trace_op_name(TraceOp op);
+
+// One operation in a trace file. Files are a "HFSTRACE" header followed by
+// records in the order their buffers were written out, not by time.
+struct hfs_trace_record {
+  uint64_t time_ns;         // start, since the trace began
+  uint64_t oid;             // dentry object id, see backing.h, 0 for none
+  int64_t off;
+  int64_t size;
+  uint32_t latency_us;
+  int32_t result;
+  TraceOp op;
+  int8_t tier;              // of the file when the operation ran, -1 for none
+  uint8_t reserved[6];
+};
+
+static constexpr char TRACE_MAGIC[8] = {'H', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+
+// Per thread record buffer, written out to the trace file when full.
+struct hfs_trace_buffer {
+  std::mutex lock;
+  std::vector<char> data;
+};
+
+// Records every operation into a binary trace file. Operations fill a
+// thread local record while they run, the fuse operation table wraps them
+// with hfs_traced to time them and append the record.
+struct hfs_tracer {
+  std::mutex lock;
+  int fd;
+  std::chrono::steady_clock::time_point start;
+  std::vector<struct hfs_trace_buffer*> buffers;
+};
+
+// nullptr unless tracing.
+extern struct hfs_tracer* hfs_trace;
+// Record of the operation running on this thread.
+extern thread_local struct hfs_trace_record trace_current;
+
+int trace_open(const std::string& file);
+void trace_close();
+
+void trace_begin(TraceOp op);
+void trace_end(int64_t result);
+// File and range of the running operation.
+inline void trace_target(uint64_t oid, int32_t tier, int64_t off = 0, int64_t size = 0) {
+  if(hfs_trace != nullptr) {
+    trace_current.oid = oid;
+    trace_current.tier = tier;
+    trace_current.off = off;
+    trace_current.size = size;
+  }
+}
+void trace_name(uint64_t oid, const std::string& path);
+// Work outside of fuse operations.
+void trace_event(TraceOp op, uint64_t oid, int32_t tier, int64_t off, int64_t size, std::chrono::steady_clock::time_point start);
+
+// Calls fn and records the call.
+template<TraceOp op, auto fn> struct hfs_traced;
+template<TraceOp op, typename R, typename... Args, R (*fn)(Args...)>
+struct hfs_traced<op, fn> {
+  static R call(Args... args) {
+    if(hfs_trace == nullptr) {
+      return fn(args...);
+    }
+    trace_begin(op);
+    R result = fn(args...);
+    trace_end((int64_t)result);
+    return result;
+  }
+};
+
+// Reads a whole trace sorted by time. names[i] is the path of records[i]
+// when that is a NAME record.
+bool trace_load(const std::string& file, std::vector<struct hfs_trace_record>& records, std::vector<std::string>& names);
+
+#endif
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "hybridfs.h"
+#include "write_buffer.h"
+
+static void flusher(struct hfs_write_back* wb) {
+  std::unique_lock<std::mutex> lock(wb->lock);
+  while(!wb->stop) {
+    wb->cond.wait_for(lock, wb->timeout / 2, [wb] { return wb->stop; });
+    if(wb->stop || wb->dirty.empty()) {
+      continue;
+    }
+    lock.unlock();
+    wb->expire();
+    lock.lock();
+  }
+}
+
+struct hfs_write_back* write_back_new(int64_t buffer_size, int64_t timeout_ms, const std::function<void()>& expire) {
+  struct hfs_write_back* wb = new hfs_write_back();
+  wb->buffer_size = buffer_size;
+  wb->timeout = std::chrono::milliseconds(std::max<int64_t>(timeout_ms, 2));
+  wb->stop = false;
+  wb->expire = expire;
+  wb->writes = 0;
+  wb->flushes = 0;
+  if(buffer_size > 0) {
+    wb->flusher = std::thread(flusher, wb);
+  }
+  return wb;
+}
+
+void write_back_free(struct hfs_write_back* wb) {
+  {
+    std::lock_guard<std::mutex> lock(wb->lock);
+    wb->stop = true;
+  }
+  wb->cond.notify_all();
+  if(wb->flusher.joinable()) {
+    wb->flusher.join();
+  }
+  spdlog::info("[write_back] buffered writes: {}, flushes: {}", wb->writes.load(), wb->flushes.load());
+  delete wb;
+}
+
+struct hfs_write_buffer* wbuf_new(struct hfs_write_back* wb) {
+  if(wb->buffer_size == 0) {
+    return nullptr;
+  }
+  struct hfs_write_buffer* buf = new hfs_write_buffer();
+  buf->data.resize(wb->buffer_size);
+  buf->dentry = nullptr;
+  buf->off = 0;
+  buf->len = 0;
+  buf->error = 0;
+  return buf;
+}
+
+void wbuf_free(struct hfs_write_buffer* buf) {
+  delete buf;
+}
+
+size_t wbuf_room(const struct hfs_write_buffer* buf) {
+  return buf->data.size() - (buf->off % buf->data.size()) - buf->len;
+}
+
+size_t wbuf_add(struct hfs_write_buffer* buf, struct hfs_dentry* dentry, const char *data, size_t size, off_t off) {
+  if(buf->len == 0) {
+    buf->dentry = dentry;
+    buf->off = off;
+    buf->since = std::chrono::steady_clock::now();
+  } else if(buf->dentry != dentry || off != buf->off + (off_t)buf->len) {
+    return 0;
+  }
+  size = std::min(size, wbuf_room(buf));
+  memcpy(buf->data.data() + buf->len, data, size);
+  buf->len += size;
+  return size;
+}
+
+bool wbuf_expired(const struct hfs_write_back* wb, const struct hfs_write_buffer* buf) {
+  return buf->len > 0 && std::chrono::steady_clock::now() - buf->since >= wb->timeout;
+}
+
+void write_back_mark_locked(struct hfs_write_back* wb, struct hfs_handle* handle, struct hfs_dentry* dentry) {
+  if(wb->files[dentry].insert(handle).second) {
+    wb->dirty[handle].push_back(dentry);
+    dentry->d_dirty++;
+  }
+}
+
+void write_back_forget_locked(struct hfs_write_back* wb, struct hfs_handle* handle, struct hfs_dentry* dentry) {
+  auto it = wb->files.find(dentry);
+  if(it == wb->files.end() || it->second.erase(handle) == 0) {
+    return ;
+  }
+  dentry->d_dirty--;
+  if(it->second.empty()) {
+    wb->files.erase(it);
+  }
+  std::vector<struct hfs_dentry*>& dentries = wb->dirty[handle];
+  dentries.erase(std::find(dentries.begin(), dentries.end(), dentry));
+  if(dentries.empty()) {
+    wb->dirty.erase(handle);
+  }
+}
+
+struct hfs_handle* write_back_holder_locked(struct hfs_write_back* wb, struct hfs_dentry* dentry,
+                                            const std::unordered_set<struct hfs_handle*>& skip) {
+  auto it = wb->files.find(dentry);
+  if(it == wb->files.end()) {
+    return nullptr;
+  }
+  for(struct hfs_handle* handle : it->second) {
+    if(skip.count(handle) == 0) {
+      return handle;
+    }
+  }
+  return nullptr;
+}
+
+void write_back_clean(struct hfs_write_back* wb, struct hfs_handle* handle) {
+  std::lock_guard<std::mutex> lock(wb->lock);
+  write_back_clean_locked(wb, handle);
+}
+
+void write_back_clean_locked(struct hfs_write_back* wb, struct hfs_handle* handle) {
+  auto it = wb->dirty.find(handle);
+  if(it == wb->dirty.end()) {
+    return ;
+  }
+  std::lock_guard<std::mutex> buf_lock(handle->wbuf->lock);
+  if(handle->wbuf->len > 0) {
+    return ;
+  }
+  std::vector<struct hfs_dentry*> dentries = it->second;
+  for(struct hfs_dentry* dentry : dentries) {
+    write_back_forget_locked(wb, handle, dentry);
+  }
+}
+
+void write_back_dirty(struct hfs_write_back* wb, std::vector<struct hfs_handle*>& handles) {
+  std::lock_guard<std::mutex> lock(wb->lock);
+  handles.clear();
+  for(auto& it : wb->dirty) {
+    handles.push_back(it.first);
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef _HYBRIDFS_WRITE_BUFFER_H
+#define _HYBRIDFS_WRITE_BUFFER_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct hfs_dentry;
+struct hfs_handle;
+
+// Small sequential writes of one handle, held back as a single run of
+// bytes. The run never crosses a multiple of the buffer size, so a stream
+// of appends reaches the backing file in aligned buffer sized writes.
+struct hfs_write_buffer {
+  std::mutex lock;
+  std::vector<char> data;         // capacity
+  struct hfs_dentry* dentry;      // file the run belongs to while len > 0
+  off_t off;
+  size_t len;
+  std::chrono::steady_clock::time_point since;   // first write of the run
+  int error;                      // failed flush not yet reported
+};
+
+// Buffers of all handles, and a thread writing out runs older than the
+// timeout through expire. A handle is registered for a file before writes
+// to it go into its buffer, and forgotten only with both locks held and the
+// run gone, so whoever looks for the runs of a file under lock finds them
+// all. d_dirty of the file counts its handles.
+struct hfs_write_back {
+  std::mutex lock;                // before the lock of any buffer
+  std::condition_variable cond;
+  int64_t buffer_size;            // per handle, 0 disables buffering
+  std::chrono::milliseconds timeout;
+  std::unordered_map<struct hfs_handle*, std::vector<struct hfs_dentry*>> dirty;
+  std::unordered_map<struct hfs_dentry*, std::unordered_set<struct hfs_handle*>> files;
+  bool stop;
+  std::function<void()> expire;
+  std::thread flusher;
+  std::atomic<uint64_t> writes;   // writes taken into buffers
+  std::atomic<uint64_t> flushes;
+};
+
+struct hfs_write_back* write_back_new(int64_t buffer_size, int64_t timeout_ms, const std::function<void()>& expire);
+void write_back_free(struct hfs_write_back* wb);
+// nullptr when buffering is off.
+struct hfs_write_buffer* wbuf_new(struct hfs_write_back* wb);
+void wbuf_free(struct hfs_write_buffer* buf);
+
+// With buf locked: takes as much of a write as fits the run, 0 when the
+// write does not continue it. The run is full when no room is left.
+size_t wbuf_add(struct hfs_write_buffer* buf, struct hfs_dentry* dentry, const char *data, size_t size, off_t off);
+size_t wbuf_room(const struct hfs_write_buffer* buf);
+bool wbuf_expired(const struct hfs_write_back* wb, const struct hfs_write_buffer* buf);
+
+// With wb locked, the buffer of handle is locked before wb is let go.
+void write_back_mark_locked(struct hfs_write_back* wb, struct hfs_handle* handle, struct hfs_dentry* dentry);
+void write_back_forget_locked(struct hfs_write_back* wb, struct hfs_handle* handle, struct hfs_dentry* dentry);
+// A handle registered for dentry and not in skip, nullptr if there is none.
+struct hfs_handle* write_back_holder_locked(struct hfs_write_back* wb, struct hfs_dentry* dentry,
+                                            const std::unordered_set<struct hfs_handle*>& skip);
+// Forgets handle if its buffer holds no run. Release forgets a handle
+// before it frees it, so a handle still registered is alive: the locked
+// form may be given one whose buffer lock was let go meanwhile.
+void write_back_clean(struct hfs_write_back* wb, struct hfs_handle* handle);
+void write_back_clean_locked(struct hfs_write_back* wb, struct hfs_handle* handle);
+void write_back_dirty(struct hfs_write_back* wb, std::vector<struct hfs_handle*>& handles);
+
+#endif
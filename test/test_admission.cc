@@ -0,0 +1,87 @@
+#include "admission.h"
+#include "test_util.h"
+
+// ADMIT_MIN_FILES in admission.cc.
+static const int admit_min_files = 4;
+
+static int32_t area_of(const char *path) {
+  hfs_shared_guard guard;
+  return find_dentry(path)->d_area;
+}
+
+// New files start on ssd until their directory has enough history, then
+// below it when most earlier files there grew large. A directory with no
+// history keeps starting them on ssd.
+void test_directory_history() {
+  const int64_t limit = 64 * 1024;
+  struct hfs_meta* meta = test_meta(1, limit);
+  test_start(meta);
+  assert(HybridFS::hfs_mkdir("/backups", 0755) == 0);
+  assert(HybridFS::hfs_mkdir("/other", 0755) == 0);
+  std::string data = test_pattern(2 * limit, 1);
+  // creates path, checks the tier it starts on and fills it
+  auto create = [&](const char *path, int32_t area) {
+    struct fuse_file_info fi{};
+    fi.flags = O_WRONLY | O_CREAT;
+    assert(HybridFS::hfs_create(path, 0644, &fi) == 0);
+    assert(area_of(path) == area);
+    assert(HybridFS::hfs_write(path, data.data(), data.size(), 0, &fi) == (int)data.size());
+    assert(HybridFS::hfs_release(path, &fi) == 0);
+  };
+  for(int i = 0; i < admit_min_files; i++) {
+    create(("/backups/b" + std::to_string(i)).c_str(), 0);
+  }
+  test_settle();
+  create("/backups/next", 1);
+  assert(meta->admission->expected == 1);
+  {
+    hfs_shared_guard guard;
+    // closed, placed by its size from now on
+    assert(find_dentry("/backups/next")->d_expect == 0);
+  }
+  create("/other/first", 0);
+  assert(meta->admission->expected == 1);
+  assert(test_read("/backups/next", data.size() + 1) == data);
+  test_stop();
+}
+
+// A creator writing the first probe bytes front to back, fast enough, has
+// its file moved below ssd while it still writes, one that skips around
+// does not.
+void test_stream_redirect() {
+  const int64_t chunk = 64 * 1024;
+  struct hfs_meta* meta = test_meta(1, 16 * chunk);
+  meta->admit_probe = 4 * chunk;
+  meta->admit_stream_rate = 1;
+  test_start(meta);
+  std::string data = test_pattern(8 * chunk, 2);
+  for(const char *path : {"/stream", "/scattered"}) {
+    bool sequential = strcmp(path, "/stream") == 0;
+    struct fuse_file_info fi{};
+    fi.flags = O_WRONLY | O_CREAT;
+    assert(HybridFS::hfs_create(path, 0644, &fi) == 0);
+    assert(area_of(path) == 0);
+    for(int64_t i = 0; i < 8; i++) {
+      // the scattered creator writes every pair of chunks back to front
+      int64_t at = sequential ? i : i ^ 1;
+      assert(HybridFS::hfs_write(path, data.data() + at * chunk, chunk, at * chunk, &fi) == (int)chunk);
+      if(sequential && i + 1 == 3) {
+        test_settle();
+        assert(area_of(path) == 0);
+      }
+    }
+    test_settle();
+    assert(area_of(path) == (sequential ? 1 : 0));
+    assert(HybridFS::hfs_release(path, &fi) == 0);
+    assert(test_read(path, data.size() + 1) == data);
+  }
+  assert(meta->admission->redirected == 1);
+  test_stop();
+}
+
+int main() {
+  test_directory_history();
+  test_stream_redirect();
+  printf("test_admission ok\n");
+  return 0;
+}
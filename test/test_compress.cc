@@ -0,0 +1,217 @@
+#include "compress.h"
+#include "test_util.h"
+
+// Text like data that compresses, with some noise.
+static std::string text(int64_t size, uint32_t seed) {
+  std::string noise = test_pattern(size / 16 + 1, seed);
+  std::string data;
+  for(int64_t i = 0; data.size() < (size_t)size; i++) {
+    data += "line " + std::to_string(i) + " of the log " + noise.substr(i % noise.size(), 1) + "\n";
+  }
+  data.resize(size);
+  return data;
+}
+
+// Random reads decode through the block index, and appends leave the
+// blocks an older index points to as they were.
+void test_block_index() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string path = test_dir() + "/compressed";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  assert(fd != -1);
+  int64_t block = 4096;
+  std::string data = text(10 * block + 1000, 1);
+  struct hfs_cindex index;
+  int state = compress_file(fd, data.size(), block, 1, [&](char *buf, size_t size, off_t off) {
+    memcpy(buf, data.data() + off, size);
+    return (ssize_t)size;
+  }, index);
+  assert(state == 0);
+  assert(index.offs.size() == 11);
+  assert((int64_t)(index.offs.back() + index.lens.back()) < (int64_t)data.size() / 2);
+  std::string buf(3 * block, 0);
+  for(off_t off : {(off_t)0, (off_t)100, block - 1, 5 * block + 7, (off_t)data.size() - 2000}) {
+    ssize_t n = compress_pread(fd, index, &buf[0], buf.size(), off);
+    size_t expect = std::min<size_t>(buf.size(), data.size() - off);
+    assert(n == (ssize_t)expect);
+    assert(buf.compare(0, n, data, off, n) == 0);
+  }
+  // the tail block goes after the old data
+  struct stat st;
+  assert(fstat(fd, &st) == 0);
+  std::string before(st.st_size, 0);
+  assert(pread(fd, &before[0], before.size(), 0) == st.st_size);
+  std::string more = text(2 * block, 2);
+  std::shared_ptr<const struct hfs_cindex> next;
+  assert(compress_append(fd, index, more.data(), more.size(), 1, next) == 0);
+  std::string after(st.st_size, 0);
+  assert(pread(fd, &after[0], after.size(), 0) == st.st_size);
+  assert(before == after);
+  assert(next->size == (int64_t)(data.size() + more.size()));
+  assert(next->offs.size() == 13);
+  assert(next->offs[10] >= index.offs.back() + index.lens.back());
+  assert(next->dead == index.lens.back());
+  assert(fstat(fd, &st) == 0);
+  assert(st.st_size == compress_stored(*next));
+  // readers of the old index still see the old tail
+  assert(compress_pread(fd, index, &buf[0], 1000, 10 * block) == 1000);
+  assert(buf.compare(0, 1000, data, 10 * block, 1000) == 0);
+  data += more;
+  buf.resize(data.size());
+  assert(compress_pread(fd, *next, &buf[0], buf.size(), 0) == (ssize_t)data.size());
+  assert(buf == data);
+  close(fd);
+  test_stop();
+}
+
+// Demoted files are compressed, appends keep them so and other writes
+// turn them back into plain files.
+void test_compressed_file() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->compress = true;
+  test_start(meta);
+  std::string data = text(200 * 1024 + 10, 3);
+  test_write("/log", data, 0, true);
+  test_pin("/log", "hdd");
+  struct hfs_dentry* dentry = find_dentry("/log");
+  assert(dentry->d_area == 1);
+  assert(dentry->d_layout == FileLayout::COMPRESSED);
+  assert(test_stat_piece(dentry, 0).st_size < (off_t)data.size() / 2);
+  assert(test_read("/log", data.size()) == data);
+  std::string more = text(50 * 1024, 4);
+  test_write("/log", more, data.size());
+  data += more;
+  assert(dentry->d_layout == FileLayout::COMPRESSED);
+  assert(test_read("/log", data.size() + 1) == data);
+  // a handle open across the rewrite reads the plain file
+  struct fuse_file_info fi{};
+  fi.flags = O_RDONLY;
+  assert(HybridFS::hfs_open("/log", &fi) == 0);
+  std::string patch = "patched";
+  test_write("/log", patch, 1000);
+  data.replace(1000, patch.size(), patch);
+  assert(dentry->d_layout == FileLayout::WHOLE);
+  assert((test_stat_piece(dentry, 0).st_mode & 07777) == 0644);
+  std::string buf(patch.size(), 0);
+  assert(HybridFS::hfs_read("/log", &buf[0], buf.size(), 1000, &fi) == (int)buf.size());
+  assert(buf == patch);
+  assert(HybridFS::hfs_release("/log", &fi) == 0);
+  assert(test_read("/log", data.size() + 1) == data);
+  test_stop();
+}
+
+// Small appends leave old last blocks behind, the file is compressed again
+// before they outweigh the live ones.
+void test_append_reclaim() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->compress = true;
+  test_start(meta);
+  std::string data = text(100 * 1024, 5);
+  test_write("/log", data, 0, true);
+  test_pin("/log", "hdd");
+  struct hfs_dentry* dentry = find_dentry("/log");
+  assert(dentry->d_layout == FileLayout::COMPRESSED);
+  bool reclaimed = false;
+  for(int i = 0; i < 500; i++) {
+    std::string more = text(1024, 6 + i);
+    test_write("/log", more, data.size());
+    data += more;
+    assert(dentry->d_layout == FileLayout::COMPRESSED);
+    std::shared_ptr<const struct hfs_cindex> cindex = std::atomic_load(&dentry->d_cindex);
+    assert(!compress_wasteful(*cindex));
+    reclaimed |= cindex->dead == 0;
+    assert(test_stat_piece(dentry, 0).st_size == compress_stored(*cindex));
+  }
+  assert(reclaimed);
+  assert(test_stat_piece(dentry, 0).st_size < (off_t)data.size() / 2);
+  assert(test_read("/log", data.size() + 1) == data);
+  test_stop();
+}
+
+// Appends keep landing while another write has the file rewritten, the
+// copy catches up with them and none is lost.
+void test_append_during_rewrite() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->compress = true;
+  test_start(meta);
+  std::string data = text(2 * 1024 * 1024, 7);
+  test_write("/log", data, 0, true);
+  test_pin("/log", "hdd");
+  struct hfs_dentry* dentry = find_dentry("/log");
+  assert(dentry->d_layout == FileLayout::COMPRESSED);
+  std::string more = text(4096, 8);
+  std::atomic<int> appended{0};
+  std::atomic<bool> stop{false};
+  std::thread appender([&]() {
+    for(off_t off = data.size(); !stop; off += more.size()) {
+      assert(HybridFS::hfs_write("/log", more.data(), more.size(), off, nullptr) == (int)more.size());
+      appended++;
+    }
+  });
+  while(appended < 10) {
+    std::this_thread::yield();
+  }
+  std::string patch = "patched";
+  test_write("/log", patch, 1000);
+  stop = true;
+  appender.join();
+  data.replace(1000, patch.size(), patch);
+  for(int i = 0; i < appended; i++) {
+    data += more;
+  }
+  assert(dentry->d_layout == FileLayout::WHOLE);
+  assert(test_read("/log", data.size() + 1) == data);
+  test_stop();
+}
+
+// Opens that truncate a compressed file while it is read: reads find the
+// end of the file instead of failing on the old index over the new file.
+void test_truncating_open() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->compress = true;
+  test_start(meta);
+  std::string data = text(256 * 1024, 9);
+  std::atomic<bool> stop{false};
+  std::thread reader([&]() {
+    std::vector<char> buf(64 * 1024);
+    while(!stop) {
+      struct fuse_file_info fi{};
+      fi.flags = O_RDONLY;
+      if(HybridFS::hfs_open("/log", &fi) != 0) {
+        continue;
+      }
+      for(off_t off = 0; off < (off_t)data.size(); off += buf.size()) {
+        assert(HybridFS::hfs_read("/log", buf.data(), buf.size(), off, &fi) >= 0);
+      }
+      assert(HybridFS::hfs_release("/log", &fi) == 0);
+    }
+  });
+  for(int i = 0; i < 10; i++) {
+    if(i > 0) {
+      // compressed on the way down only
+      test_pin("/log", "ssd");
+    }
+    test_write("/log", data, 0, i == 0);
+    test_pin("/log", "hdd");
+    assert(find_dentry("/log")->d_layout == FileLayout::COMPRESSED);
+    struct fuse_file_info fi{};
+    fi.flags = O_WRONLY | O_TRUNC;
+    assert(HybridFS::hfs_open("/log", &fi) == 0);
+    assert(find_dentry("/log")->d_size == 0);
+    assert(HybridFS::hfs_release("/log", &fi) == 0);
+  }
+  stop = true;
+  reader.join();
+  test_stop();
+}
+
+int main() {
+  test_block_index();
+  test_compressed_file();
+  test_append_reclaim();
+  test_append_during_rewrite();
+  test_truncating_open();
+  printf("test_compress ok\n");
+  return 0;
+}
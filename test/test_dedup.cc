@@ -0,0 +1,53 @@
+#include "dedup.h"
+#include "test_util.h"
+
+// A file demoted with the content of one already on the tier shares its
+// extents when the backing filesystem can clone them, and a write takes
+// the written file out of the index while the other keeps its data.
+void test_dedup() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->dedup_min_size = 64 * 1024;
+  test_start(meta);
+  struct hfs_dedup* dd = HFS_META->dedup;
+  std::string data = test_pattern(256 * 1024, 1);
+  test_write("/a", data, 0, true);
+  test_write("/b", data, 0, true);
+  test_pin("/a", "hdd");
+  struct hfs_dentry* a = find_dentry("/a");
+  assert(a->d_area == 1);
+  assert(a->d_fp.load() != nullptr);
+  struct hfs_fingerprint fp = *a->d_fp.load();
+  struct hfs_dedup_entry entry;
+  assert(dedup_lookup(dd, fp, data.size(), 1, entry) && entry.oid == a->d_oid);
+
+  test_pin("/b", "hdd");
+  struct hfs_dentry* b = find_dentry("/b");
+  assert(b->d_area == 1);
+  assert(dd->hashed == 2);
+  if(dd->no_clone.count(1) == 0) {
+    assert(dd->shared == 1 && dd->saved_bytes == data.size());
+    assert(b->d_dev == a->d_dev);
+  } else {
+    printf("test_dedup: no reflink on %s, extents not shared\n", test_dir().c_str());
+    assert(dd->shared == 0);
+  }
+  assert(test_read("/a", data.size() + 1) == data);
+  assert(test_read("/b", data.size() + 1) == data);
+
+  // the index forgets /a on its first write, /b is left alone
+  std::string patch = test_pattern(100, 2);
+  test_write("/a", patch, 1000);
+  assert(a->d_fp.load() == nullptr);
+  assert(!dedup_lookup(dd, fp, data.size(), 1, entry) || entry.oid != a->d_oid);
+  std::string a_data = data;
+  a_data.replace(1000, patch.size(), patch);
+  assert(test_read("/a", data.size() + 1) == a_data);
+  assert(test_read("/b", data.size() + 1) == data);
+  test_stop();
+}
+
+int main() {
+  test_dedup();
+  printf("test_dedup ok\n");
+  return 0;
+}
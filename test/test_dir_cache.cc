@@ -0,0 +1,117 @@
+#include "compress.h"
+#include "dir_cache.h"
+
+#include "test_util.h"
+
+// From hybridfs.cc.
+bool dir_evictable(const struct hfs_dentry* dir);
+int64_t drop_dir(struct hfs_dentry* dir);
+
+static void drop(const char *path) {
+  hfs_exclusive_guard guard;
+  struct hfs_dentry* dir = find_dentry(path);
+  assert(dir_evictable(dir));
+  assert(drop_dir(dir) > 0);
+}
+
+// The entries file of dir, as the dentry cache names it.
+static std::string entries_path(const struct hfs_dentry* dir) {
+  std::string obj = object_path(dir->d_oid);
+  const char *name;
+  int dirfd = backing_dirfd(dentry_place(dir), 0, obj, name);
+  return "/proc/self/fd/" + std::to_string(dirfd) + "/" + name + "/entries";
+}
+
+// Children of every layout come back from the entries file as they were
+// dropped, and a damaged entries file loads nothing.
+void test_dir_reload() {
+  struct hfs_meta* meta = test_meta(2, INT64_MAX);
+  meta->stripe_threshold = 256 * 1024;
+  meta->compress = true;
+  meta->pack_threshold = 4096;
+  meta->pack_container_size = 16 * 1024;
+  meta->dir_cache_size = 1000;
+  test_start(meta);
+  assert(HybridFS::hfs_mkdir("/d", 0755) == 0);
+  assert(HybridFS::hfs_mkdir("/d/sub", 0755) == 0);
+  const char *paths[] = {"/d/whole", "/d/striped", "/d/packed", "/d/compressed", "/d/sub/f"};
+  std::string data[] = {test_pattern(64 * 1024, 1), test_pattern(600 * 1024, 2), test_pattern(1000, 3),
+                        std::string(100 * 1024, 'a'), test_pattern(100, 4)};
+  for(int i = 0; i < 5; i++) {
+    test_write(paths[i], data[i], 0, true);
+  }
+  test_pin("/d/striped", "hdd");
+  test_pin("/d/compressed", "hdd");
+  FileLayout layouts[] = {FileLayout::WHOLE, FileLayout::STRIPED, FileLayout::PACKED, FileLayout::COMPRESSED};
+  struct { int32_t area; int64_t size; uint64_t oid; int32_t width; uint64_t version; } before[4];
+  for(int i = 0; i < 4; i++) {
+    struct hfs_dentry* dentry = find_dentry(paths[i]);
+    assert(dentry->d_layout == layouts[i]);
+    before[i] = {dentry->d_area, dentry->d_size, dentry->d_oid, dentry->d_width, dentry->d_version};
+  }
+  size_t blocks = find_dentry("/d/compressed")->d_cindex->offs.size();
+
+  drop("/d/sub");
+  drop("/d");
+  assert(!find_dentry("/")->d_childs->at("d")->d_loaded);
+  for(int i = 0; i < 4; i++) {
+    struct hfs_dentry* dentry = find_dentry(paths[i]);
+    assert(dentry->d_layout == layouts[i]);
+    assert(dentry->d_area == before[i].area);
+    assert(dentry->d_size == before[i].size);
+    assert(dentry->d_oid == before[i].oid);
+    assert(dentry->d_width == before[i].width);
+    assert(dentry->d_version == before[i].version);
+  }
+  assert(find_dentry("/d/compressed")->d_cindex->offs.size() == blocks);
+  for(int i = 0; i < 5; i++) {
+    assert(test_read(paths[i], data[i].size() + 1) == data[i]);
+  }
+
+  drop("/d/sub");
+  drop("/d");
+  struct hfs_dentry* dir = find_dentry("/")->d_childs->at("d");
+  std::string entries = entries_path(dir);
+  struct stat st;
+  assert(stat(entries.c_str(), &st) == 0);
+  std::unordered_map<std::string, struct hfs_dentry*> childs;
+  assert(truncate(entries.c_str(), st.st_size - 1) == 0);
+  assert(dir_load(dir, childs) == -EIO && childs.empty());
+  int fd = open(entries.c_str(), O_WRONLY | O_APPEND);
+  assert(fd != -1 && write(fd, "xx", 2) == 2);
+  close(fd);
+  assert(dir_load(dir, childs) == -EIO && childs.empty());
+  assert(find_dentry("/d/whole") == nullptr);
+  test_stop();
+}
+
+// A directory with an open file stays loaded until the file is released.
+void test_dir_open() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->dir_cache_size = 1000;
+  test_start(meta);
+  assert(HybridFS::hfs_mkdir("/d", 0755) == 0);
+  std::string data = test_pattern(1000, 5);
+  test_write("/d/file", data, 0, true);
+  struct fuse_file_info fi{};
+  fi.flags = O_RDONLY;
+  assert(HybridFS::hfs_open("/d/file", &fi) == 0);
+  {
+    hfs_exclusive_guard guard;
+    assert(!dir_evictable(find_dentry("/d")));
+  }
+  std::string buf(data.size(), 0);
+  assert(HybridFS::hfs_read("/d/file", &buf[0], buf.size(), 0, &fi) == (int)buf.size());
+  assert(buf == data);
+  assert(HybridFS::hfs_release("/d/file", &fi) == 0);
+  drop("/d");
+  assert(test_read("/d/file", data.size() + 1) == data);
+  test_stop();
+}
+
+int main() {
+  test_dir_reload();
+  test_dir_open();
+  printf("test_dir_cache ok\n");
+  return 0;
+}
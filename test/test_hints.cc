@@ -0,0 +1,172 @@
+#include "mem_cache.h"
+#include "test_util.h"
+
+// Value of xattr name of path, or the error as a string.
+static std::string get_hint(const char *path, const char *name) {
+  char buf[64];
+  int n = HybridFS::hfs_getxattr(path, name, buf, sizeof(buf));
+  return n < 0 ? "error " + std::to_string(n) : std::string(buf, n);
+}
+
+static int set_hint(const char *path, const char *name, const std::string& value) {
+  return HybridFS::hfs_setxattr(path, name, value.data(), value.size(), 0);
+}
+
+static int32_t area_of(const char *path) {
+  hfs_shared_guard guard;
+  return find_dentry(path)->d_area;
+}
+
+// Files created below a directory preferring hdd start there, by name or
+// index, and other files still start on ssd.
+void test_prefer() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string data = test_pattern(4096, 1);
+  assert(HybridFS::hfs_mkdir("/logs", 0755) == 0);
+  assert(get_hint("/logs", "user.hybridfs.prefer") == "error " + std::to_string(-ENODATA));
+  assert(set_hint("/logs", "user.hybridfs.prefer", "hdd") == 0);
+  assert(get_hint("/logs", "user.hybridfs.prefer") == "hdd");
+  test_write("/logs/a", data, 0, true);
+  assert(area_of("/logs/a") == 1);
+  assert(get_hint("/logs/a", "user.hybridfs.tier") == "hdd");
+  assert(get_hint("/logs/a", "user.hybridfs.prefer") == "hdd");
+  // tier indexes work too, the newline of echo is dropped
+  assert(set_hint("/logs", "user.hybridfs.prefer", "0\n") == 0);
+  assert(get_hint("/logs", "user.hybridfs.prefer") == "ssd");
+  test_write("/logs/b", data, 0, true);
+  assert(area_of("/logs/b") == 0);
+  test_write("/top", data, 0, true);
+  assert(area_of("/top") == 0);
+  assert(test_read("/logs/a", data.size() + 1) == data);
+  test_stop();
+}
+
+// Hints of a directory are taken over by what is created below it later,
+// directories included, and not by what was there before.
+void test_inherited() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string data = test_pattern(4096, 2);
+  assert(HybridFS::hfs_mkdir("/cold", 0755) == 0);
+  test_write("/cold/old", data, 0, true);
+  assert(set_hint("/cold", "user.hybridfs.pin", "hdd") == 0);
+  assert(HybridFS::hfs_mkdir("/cold/sub", 0755) == 0);
+  assert(get_hint("/cold/sub", "user.hybridfs.pin") == "hdd");
+  test_write("/cold/sub/new", data, 0, true);
+  assert(area_of("/cold/sub/new") == 1);
+  assert(get_hint("/cold/sub/new", "user.hybridfs.pin") == "hdd");
+  assert(get_hint("/cold/sub/new", "user.hybridfs.prefer") == "error " + std::to_string(-ENODATA));
+  assert(area_of("/cold/old") == 0);
+  assert(get_hint("/cold/old", "user.hybridfs.pin") == "error " + std::to_string(-ENODATA));
+  char list[256];
+  int n = HybridFS::hfs_listxattr("/cold/sub/new", list, sizeof(list));
+  assert(n > 0);
+  assert(std::string(list, n).find("user.hybridfs.pin") != std::string::npos);
+  test_stop();
+}
+
+// tier and heat are read only, and only files have them.
+void test_read_only() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string data = test_pattern(4096, 3);
+  test_write("/file", data, 0, true);
+  assert(test_read("/file", data.size()) == data);
+  assert(set_hint("/file", "user.hybridfs.tier", "hdd") == -EPERM);
+  assert(set_hint("/file", "user.hybridfs.heat", "0") == -EPERM);
+  assert(area_of("/file") == 0);
+  assert(get_hint("/file", "user.hybridfs.tier") == "ssd");
+  std::string heat = get_hint("/file", "user.hybridfs.heat");
+  assert(!heat.empty() && heat.find_first_not_of("0123456789") == std::string::npos);
+  // sizes are asked for with an empty buffer
+  assert(HybridFS::hfs_getxattr("/file", "user.hybridfs.tier", nullptr, 0) == 3);
+  char small[2];
+  assert(HybridFS::hfs_getxattr("/file", "user.hybridfs.tier", small, sizeof(small)) == -ERANGE);
+  assert(get_hint("/", "user.hybridfs.tier") == "error " + std::to_string(-ENODATA));
+  test_stop();
+}
+
+// A file whose pin is removed goes back where its size puts it.
+void test_unpin() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->tiers[1]->lower_limit = 64 * 1024;
+  test_start(meta);
+  std::string data = test_pattern(4096, 6);
+  test_write("/file", data, 0, true);
+  test_pin("/file", "hdd");
+  assert(area_of("/file") == 1);
+  assert(HybridFS::hfs_removexattr("/file", "user.hybridfs.pin") == 0);
+  assert(HybridFS::hfs_removexattr("/file", "user.hybridfs.pin") == -ENODATA);
+  test_settle();
+  assert(area_of("/file") == 0);
+  assert(test_read("/file", data.size() + 1) == data);
+  test_stop();
+}
+
+// Unknown tiers and hints are refused and leave the file as it was.
+void test_bad_tier() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string data = test_pattern(4096, 4);
+  test_write("/file", data, 0, true);
+  for(const char *tier : {"nvme", "2", "-1", ""}) {
+    assert(set_hint("/file", "user.hybridfs.pin", tier) == -EINVAL);
+    assert(set_hint("/file", "user.hybridfs.prefer", tier) == -EINVAL);
+  }
+  assert(set_hint("/file", "user.hybridfs.color", "hdd") == -ENOTSUP);
+  assert(set_hint("/missing", "user.hybridfs.pin", "hdd") == -ENOENT);
+  assert(get_hint("/file", "user.hybridfs.pin") == "error " + std::to_string(-ENODATA));
+  assert(get_hint("/file", "user.hybridfs.prefer") == "error " + std::to_string(-ENODATA));
+  test_settle();
+  assert(area_of("/file") == 0);
+  assert(test_read("/file", data.size() + 1) == data);
+  test_stop();
+}
+
+// Prefetching a tree returns before the files are read, they are all in
+// the memory tier a little later.
+void test_prefetch() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->mem_cache_size = 1024 * 1024;
+  meta->mem_cache_file_size = 64 * 1024;
+  test_start(meta);
+  std::string data = test_pattern(4096, 5);
+  assert(HybridFS::hfs_mkdir("/data", 0755) == 0);
+  assert(HybridFS::hfs_mkdir("/data/sub", 0755) == 0);
+  const int files = 8;
+  for(int i = 0; i < files; i++) {
+    test_write(("/data/" + std::to_string(i)).c_str(), data, 0, true);
+    test_write(("/data/sub/" + std::to_string(i)).c_str(), data, 0, true);
+  }
+  assert(set_hint("/data", "user.hybridfs.prefetch", "1") == 0);
+  struct hfs_mem_cache* cache = HFS_META->mem_cache;
+  for(int waited = 0; waited < 500; waited++) {
+    {
+      std::lock_guard<std::mutex> lock(cache->lock);
+      if(cache->files.size() == 2 * files) {
+        break;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  {
+    std::lock_guard<std::mutex> lock(cache->lock);
+    assert(cache->files.size() == 2 * files);
+  }
+  uint64_t hits = cache->hits;
+  assert(test_read("/data/sub/3", data.size() + 1) == data);
+  assert(cache->hits > hits);
+  test_stop();
+}
+
+int main() {
+  test_prefer();
+  test_inherited();
+  test_read_only();
+  test_unpin();
+  test_bad_tier();
+  test_prefetch();
+  printf("test_hints ok\n");
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include "test_util.h"
+
+// Copies of migrations in progress on the hdd device, by name.
+static std::vector<std::string> copies() {
+  std::vector<std::string> names;
+  for(auto& entry : std::filesystem::directory_iterator(test_dir() + "/hdd0/" HFS_INTERNAL_DIR "/tmp")) {
+    names.push_back(entry.path().string());
+  }
+  return names;
+}
+
+static struct stat stat_path(const std::string& path) {
+  struct stat st;
+  assert(stat(path.c_str(), &st) == 0);
+  return st;
+}
+
+// A throttled migration copies chunk by chunk up a cursor while the file
+// stays writable on its tier. Chunks written after the cursor passed them
+// are copied again, and a migration making way for another file picks up
+// where it stopped.
+void test_chunked_migration() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->migrate_chunk = 16 * 1024;
+  meta->bg_bandwidth = 64 * 1024;
+  test_start(meta);
+  int64_t chunk = meta->migrate_chunk;
+  std::string data = test_pattern(16 * chunk, 1);
+  test_write("/big", data, 0, true);
+  const char *tier = "hdd";
+  assert(HybridFS::hfs_setxattr("/big", "user.hybridfs.pin", tier, strlen(tier), 0) == 0);
+  struct hfs_dentry* dentry = find_dentry("/big");
+  // the first second of budget goes at once, then a chunk every quarter
+  std::vector<std::string> names;
+  while((names = copies()).empty() || stat_path(names[0]).st_size < 4 * chunk) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  std::string copy = names[0];
+  struct stat copy_st = stat_path(copy);
+  {
+    hfs_shared_guard guard;
+    assert(dentry->d_move != nullptr);
+    assert(dentry->d_area == 0);
+  }
+  // chunk 0 is behind the cursor, the copy holds its old data
+  std::string patch = test_pattern(100, 2);
+  test_write("/big", patch, 10);
+  data.replace(10, patch.size(), patch);
+  int fd = open(copy.c_str(), O_RDONLY);
+  assert(fd != -1);
+  std::string old(patch.size(), 0);
+  assert(pread(fd, &old[0], old.size(), 10) == (ssize_t)old.size());
+  close(fd);
+  assert(old != patch);
+  // and chunk 15 ahead of it
+  test_write("/big", patch, 15 * chunk + 5);
+  data.replace(15 * chunk + 5, patch.size(), patch);
+  // another file makes the migration yield, it comes back to the same copy
+  test_write("/small", test_pattern(1000, 3), 0, true);
+  assert(HybridFS::hfs_setxattr("/small", "user.hybridfs.pin", tier, strlen(tier), 0) == 0);
+  while(find_dentry("/small")->d_area != 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  {
+    hfs_shared_guard guard;
+    if(dentry->d_move != nullptr) {
+      struct stat st = stat_path(copy);
+      assert(st.st_ino == copy_st.st_ino && st.st_size >= copy_st.st_size);
+    }
+  }
+  test_settle();
+  assert(dentry->d_area == 1);
+  assert(dentry->d_move == nullptr);
+  assert(copies().empty());
+  assert(test_read("/big", data.size() + 1) == data);
+  test_stop();
+}
+
+// Holes stay holes on the new tier.
+void test_migration_holes() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->migrate_chunk = 64 * 1024;
+  test_start(meta);
+  int64_t size = 4 * 1024 * 1024;
+  std::string head = test_pattern(64 * 1024, 1);
+  std::string tail = test_pattern(64 * 1024, 2);
+  test_write("/sparse", head, 0, true);
+  test_write("/sparse", tail, size - tail.size());
+  test_pin("/sparse", "hdd");
+  struct hfs_dentry* dentry = find_dentry("/sparse");
+  assert(dentry->d_area == 1);
+  struct stat st = test_stat_piece(dentry, 0);
+  assert(st.st_size == size);
+  assert(st.st_blocks * 512 < size / 4);
+  std::string data = test_read("/sparse", size);
+  assert(data.compare(0, head.size(), head) == 0);
+  assert(data.compare(size - tail.size(), tail.size(), tail) == 0);
+  assert((int64_t)data.find_first_not_of('\0', head.size()) == size - (int64_t)tail.size());
+  test_stop();
+}
+
+// A file written all over while it moves is not copied whole with the
+// tree lock held, the move backs off until the writes stop.
+void test_migration_backoff() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->migrate_chunk = 16 * 1024;
+  meta->bg_bandwidth = 512 * 1024;
+  test_start(meta);
+  int64_t chunk = meta->migrate_chunk;
+  // twice the first second of budget, the writes go to the first 20
+  const int64_t chunks = 64, hot = 20;
+  std::string data = test_pattern(chunks * chunk, 1);
+  test_write("/hot", data, 0, true);
+  std::string patch = test_pattern(100, 2);
+  for(int64_t i = 0; i < hot; i++) {
+    data.replace(i * chunk, patch.size(), patch);
+  }
+  struct hfs_dentry* dentry = find_dentry("/hot");
+  struct fuse_file_info fi{};
+  fi.flags = O_WRONLY;
+  assert(HybridFS::hfs_open("/hot", &fi) == 0);
+  std::atomic<bool> stop{false};
+  std::thread writer([&]() {
+    for(int64_t i = 0; !stop; i = (i + 1) % hot) {
+      assert(HybridFS::hfs_write("/hot", patch.data(), patch.size(), i * chunk, &fi) == (int)patch.size());
+    }
+  });
+  const char *tier = "hdd";
+  assert(HybridFS::hfs_setxattr("/hot", "user.hybridfs.pin", tier, strlen(tier), 0) == 0);
+  std::this_thread::sleep_for(std::chrono::seconds(8));
+  {
+    hfs_shared_guard guard;
+    assert(dentry->d_area == 0);
+  }
+  stop = true;
+  writer.join();
+  assert(HybridFS::hfs_release("/hot", &fi) == 0);
+  test_settle();
+  assert(dentry->d_area == 1);
+  assert(test_read("/hot", data.size() + 1) == data);
+  test_stop();
+}
+
+// An open handle follows its file to the new tier, for reads and writes
+// racing the migrations on it as well as fsync and lseek.
+void test_handle_reopen() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string data = test_pattern(256 * 1024, 1);
+  test_write("/file", data, 0, true);
+  struct fuse_file_info fi{};
+  fi.flags = O_RDWR;
+  assert(HybridFS::hfs_open("/file", &fi) == 0);
+  struct hfs_dentry* dentry = find_dentry("/file");
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> readers;
+  for(int i = 0; i < 4; i++) {
+    readers.emplace_back([&, i]() {
+      std::string buf(4096, 0);
+      for(int n = i; !stop; n += 7) {
+        off_t off = n * 512 % (data.size() - buf.size());
+        assert(HybridFS::hfs_read("/file", &buf[0], buf.size(), off, &fi) == (int)buf.size());
+        assert(data.compare(off, buf.size(), buf) == 0);
+      }
+    });
+  }
+  for(int i = 0; i < 3; i++) {
+    test_pin("/file", "hdd");
+    test_pin("/file", "ssd");
+  }
+  stop = true;
+  for(std::thread& t : readers) {
+    t.join();
+  }
+  test_pin("/file", "hdd");
+  assert(dentry->d_area == 1);
+  assert(HybridFS::hfs_fsync("/file", 0, &fi) == 0);
+  assert(HFS_HANDLE(&fi)->version == dentry->d_version);
+  test_pin("/file", "ssd");
+  assert(HybridFS::hfs_lseek("/file", 0, SEEK_END, &fi) == (off_t)data.size());
+  assert(HFS_HANDLE(&fi)->version == dentry->d_version);
+  std::string patch = test_pattern(100, 2);
+  assert(HybridFS::hfs_write("/file", patch.data(), patch.size(), 10, &fi) == (int)patch.size());
+  assert(HybridFS::hfs_fsync("/file", 0, &fi) == 0);
+  assert(HybridFS::hfs_release("/file", &fi) == 0);
+  data.replace(10, patch.size(), patch);
+  assert(test_read("/file", data.size()) == data);
+  test_stop();
+}
+
+int main() {
+  test_chunked_migration();
+  test_migration_holes();
+  test_migration_backoff();
+  test_handle_reopen();
+  printf("test_migrate ok\n");
+  return 0;
+}
@@ -0,0 +1,201 @@
+#include "pack.h"
+#include "test_util.h"
+
+static std::string file_name(int i) {
+  return "/small" + std::to_string(i);
+}
+
+// Waits until the packer thread has compacted what was left to it.
+static void settle_packer(struct hfs_packer* packer) {
+  while(true) {
+    {
+      std::lock_guard<std::mutex> lock(packer->lock);
+      if(packer->sweep.empty()) {
+        return ;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// Small files are records in shared containers, rewrites leave dead records
+// that compaction reclaims, and a file growing past the threshold gets a
+// backing file of its own.
+void test_pack() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->pack_threshold = 4096;
+  meta->pack_container_size = 16 * 1024;
+  test_start(meta);
+  struct hfs_packer* packer = HFS_META->packer;
+  const int files = 8;
+  std::vector<std::string> data(files);
+  for(int i = 0; i < files; i++) {
+    data[i] = test_pattern(1000 + i * 300, i);
+    test_write(file_name(i).c_str(), data[i], 0, true);
+    struct hfs_dentry* dentry = find_dentry(file_name(i).c_str());
+    assert(dentry->d_layout == FileLayout::PACKED);
+    assert(dentry->d_pack_id != 0);
+  }
+  // a container takes records until it is 16 KB, the eight go in the first
+  assert(packer->containers.size() == 1);
+  for(int i = 0; i < files; i++) {
+    assert(test_read(file_name(i).c_str(), 4096) == data[i]);
+  }
+  // every rewrite appends a record, full containers left mostly dead are
+  // compacted
+  for(int round = 0; round < 20; round++) {
+    for(int i = 0; i < files; i++) {
+      std::string patch = test_pattern(100, round * files + i);
+      test_write(file_name(i).c_str(), patch, 50);
+      data[i].replace(50, patch.size(), patch);
+    }
+  }
+  settle_packer(packer);
+  int64_t size = 0, live = 0;
+  for(auto& it : packer->containers) {
+    size += it.second->size;
+    live += it.second->live;
+  }
+  int64_t expect_live = 0;
+  for(int i = 0; i < files; i++) {
+    expect_live += data[i].size();
+    assert(test_read(file_name(i).c_str(), 4096) == data[i]);
+  }
+  assert(live == expect_live);
+  // 400 KB were written, what is kept is a few containers
+  assert(size < 4 * meta->pack_container_size);
+  // grown out of its container
+  std::string tail = test_pattern(4096, 99);
+  test_write(file_name(0).c_str(), tail, data[0].size());
+  data[0] += tail;
+  struct hfs_dentry* dentry = find_dentry(file_name(0).c_str());
+  assert(dentry->d_layout == FileLayout::WHOLE);
+  assert(test_stat_piece(dentry, 0).st_size == (off_t)data[0].size());
+  assert(test_read(file_name(0).c_str(), data[0].size() + 1) == data[0]);
+  // records of removed files die
+  assert(HybridFS::hfs_unlink(file_name(1).c_str()) == 0);
+  live = 0;
+  for(auto& it : packer->containers) {
+    live += it.second->live;
+  }
+  assert(live == expect_live - (int64_t)data[0].size() + (int64_t)tail.size() - (int64_t)data[1].size());
+  test_stop();
+}
+
+// Files rewritten and read from several threads keep their data while
+// their containers are compacted behind them.
+void test_pack_concurrent() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->pack_threshold = 4096;
+  meta->pack_container_size = 16 * 1024;
+  meta->write_buffer_size = 0;
+  test_start(meta);
+  const int files = 4;
+  for(int i = 0; i < files; i++) {
+    test_write(file_name(i).c_str(), test_pattern(2000, i), 0, true);
+  }
+  std::vector<std::thread> threads;
+  for(int i = 0; i < files; i++) {
+    threads.emplace_back([i]() {
+      std::string name = file_name(i);
+      for(int round = 0; round < 100; round++) {
+        // grows and shrinks around the size of its last record
+        std::string data = test_pattern(1500 + round % 7 * 100, i * 1000 + round);
+        assert(HybridFS::hfs_truncate(name.c_str(), 0, nullptr) == 0);
+        test_write(name.c_str(), data, 0);
+        assert(test_read(name.c_str(), 4096) == data);
+      }
+    });
+  }
+  for(std::thread& t : threads) {
+    t.join();
+  }
+  settle_packer(HFS_META->packer);
+  assert(HFS_META->packer->containers.size() < 8);
+  test_stop();
+}
+
+// Handles appending to one packed file at once keep each other's bytes,
+// and the container counts the record at its full size.
+void test_pack_appends() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->pack_threshold = 64 * 1024;
+  test_start(meta);
+  test_write("/shared", std::string(), 0, true);
+  const int writers = 2;
+  const int rounds = 100;
+  const int chunk = 100;
+  std::string data = test_pattern(writers * rounds * chunk, 7);
+  std::vector<std::thread> threads;
+  for(int i = 0; i < writers; i++) {
+    threads.emplace_back([&, i]() {
+      struct fuse_file_info fi{};
+      fi.flags = O_WRONLY;
+      assert(HybridFS::hfs_open("/shared", &fi) == 0);
+      for(int round = 0; round < rounds; round++) {
+        off_t off = (round * writers + i) * chunk;
+        assert(HybridFS::hfs_write("/shared", &data[off], chunk, off, &fi) == chunk);
+      }
+      assert(HybridFS::hfs_release("/shared", &fi) == 0);
+    });
+  }
+  for(std::thread& t : threads) {
+    t.join();
+  }
+  struct hfs_dentry* dentry = find_dentry("/shared");
+  assert(dentry->d_layout == FileLayout::PACKED);
+  assert(dentry->d_size == (int64_t)data.size());
+  assert(test_read("/shared", data.size() + 1) == data);
+  int64_t live = 0;
+  for(auto& it : HFS_META->packer->containers) {
+    live += it.second->live;
+  }
+  assert(live == (int64_t)data.size());
+  test_stop();
+}
+
+// Files grown out of their containers while others stat and read them:
+// every stat and read sees the file packed or unpacked, never half way
+// between.
+void test_pack_unpack_concurrent() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->pack_threshold = 4096;
+  test_start(meta);
+  const int files = 20;
+  std::string small = test_pattern(1000, 1);
+  std::string large = small + test_pattern(8192, 2);
+  for(int i = 0; i < files; i++) {
+    test_write(file_name(i).c_str(), small, 0, true);
+  }
+  std::atomic<bool> done{false};
+  std::thread reader([&]() {
+    while(!done) {
+      for(int i = 0; i < files; i++) {
+        std::string name = file_name(i);
+        struct stat st;
+        assert(HybridFS::hfs_getattr(name.c_str(), &st, nullptr) == 0);
+        assert((st.st_mode & 0777) == 0644);
+        std::string data = test_read(name.c_str(), large.size());
+        assert(data.size() >= small.size() && large.compare(0, data.size(), data) == 0);
+      }
+    }
+  });
+  for(int i = 0; i < files; i++) {
+    test_write(file_name(i).c_str(), large.substr(small.size()), small.size());
+  }
+  done = true;
+  reader.join();
+  for(int i = 0; i < files; i++) {
+    assert(find_dentry(file_name(i).c_str())->d_layout == FileLayout::WHOLE);
+  }
+  test_stop();
+}
+
+int main() {
+  test_pack();
+  test_pack_concurrent();
+  test_pack_appends();
+  test_pack_unpack_concurrent();
+  printf("test_pack ok\n");
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "test_util.h"
+
+// Device roots hold the object store only, no names of the file system.
+static void check_flat() {
+  for(struct hfs_tier* tier : HFS_META->tiers) {
+    for(struct hfs_device* dev : tier->devices) {
+      for(auto& entry : std::filesystem::directory_iterator(dev->path)) {
+        assert(entry.path().filename() == HFS_INTERNAL_DIR);
+      }
+    }
+  }
+}
+
+// Renames of files and of directories with files in them only change the
+// tree, backing objects keep their names and inodes.
+void test_rename() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  assert(HybridFS::hfs_mkdir("/a", 0755) == 0);
+  assert(HybridFS::hfs_mkdir("/a/b", 0755) == 0);
+  std::string data = test_pattern(10000, 1);
+  test_write("/a/b/f", data, 0, true);
+  struct hfs_dentry* dentry = find_dentry("/a/b/f");
+  uint64_t oid = dentry->d_oid;
+  ino_t ino = test_stat_piece(dentry, 0).st_ino;
+  check_flat();
+
+  assert(HybridFS::hfs_rename("/a", "/c", 0) == 0);
+  assert(find_dentry("/a/b/f") == nullptr);
+  struct stat st;
+  assert(HybridFS::hfs_getattr("/a", &st, nullptr) == -ENOENT);
+  assert(find_dentry("/c/b/f") == dentry);
+  assert(dentry->d_oid == oid);
+  assert(test_stat_piece(dentry, 0).st_ino == ino);
+  assert(test_read("/c/b/f", data.size()) == data);
+
+  assert(HybridFS::hfs_rename("/c/b/f", "/g", 0) == 0);
+  assert(find_dentry("/g") == dentry);
+  assert(test_stat_piece(dentry, 0).st_ino == ino);
+  assert(test_read("/g", data.size()) == data);
+
+  // the replaced file goes with its object
+  test_write("/h", test_pattern(100, 2), 0, true);
+  struct hfs_dentry* replaced = find_dentry("/h");
+  std::string replaced_obj = object_path(replaced->d_oid);
+  const char *name;
+  int dirfd = backing_dirfd(dentry_place(replaced), 0, replaced_obj, name);
+  assert(HybridFS::hfs_rename("/g", "/h", 0) == 0);
+  assert(faccessat(dirfd, name, F_OK, 0) == -1 && errno == ENOENT);
+  assert(find_dentry("/h") == dentry);
+  assert(test_stat_piece(dentry, 0).st_ino == ino);
+  assert(test_read("/h", data.size()) == data);
+  check_flat();
+  test_stop();
+}
+
+// Hard links have a dentry each, a write through one name is read back
+// in full through the other.
+void test_link() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  test_start(meta);
+  std::string data = test_pattern(10000, 3);
+  test_write("/f", data.substr(0, 4000), 0, true);
+  assert(HybridFS::hfs_link("/f", "/g") == 0);
+  test_write("/g", data.substr(4000), 4000);
+  struct stat st;
+  assert(HybridFS::hfs_getattr("/f", &st, nullptr) == 0);
+  assert(st.st_size == (off_t)data.size());
+  assert(test_read("/f", data.size() + 1) == data);
+  // past the end the dentry of /f knows
+  assert(test_read("/f", data.size(), 4000) == data.substr(4000));
+  assert(test_read("/g", data.size() + 1) == data);
+  test_stop();
+}
+
+// Reads of a hard linked file are not served from the memory tier, which
+// would miss writes through the other name.
+void test_link_cached() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->mem_cache_size = 1024 * 1024;
+  meta->mem_cache_file_size = 64 * 1024;
+  test_start(meta);
+  std::string data = test_pattern(4000, 4);
+  test_write("/f", data, 0, true);
+  assert(HybridFS::hfs_link("/f", "/g") == 0);
+  for(int i = 0; i < 4; i++) {
+    assert(test_read("/f", data.size() + 1) == data);
+  }
+  std::string other = test_pattern(4000, 5);
+  test_write("/g", other, 0);
+  assert(test_read("/f", other.size() + 1) == other);
+  test_stop();
+}
+
+int main() {
+  test_rename();
+  test_link();
+  test_link_cached();
+  printf("test_rename ok\n");
+  return 0;
+}
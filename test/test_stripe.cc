@@ -0,0 +1,47 @@
+#include "test_util.h"
+
+// A file demoted to a three device hdd tier is split in stripe_unit chunks
+// round robin, and reads and writes across chunk boundaries are split
+// alike.
+void test_stripe_split() {
+  struct hfs_meta* meta = test_meta(3, INT64_MAX);
+  meta->stripe_threshold = 256 * 1024;
+  test_start(meta);
+  int64_t unit = meta->stripe_unit;
+  // ten chunks and a half: pieces of 4, 3.5 and 3 chunks
+  std::string data = test_pattern(10 * unit + unit / 2, 1);
+  test_write("/big", data, 0, true);
+  test_pin("/big", "hdd");
+  struct hfs_dentry* dentry = find_dentry("/big");
+  assert(dentry->d_area == 1);
+  assert(dentry->d_layout == FileLayout::STRIPED);
+  assert(dentry->d_width == 3);
+  assert(test_stat_piece(dentry, 0).st_size == 4 * unit);
+  assert(test_stat_piece(dentry, 1).st_size == 3 * unit + unit / 2);
+  assert(test_stat_piece(dentry, 2).st_size == 3 * unit);
+  assert(test_read("/big", data.size()) == data);
+  // unaligned, over three chunk boundaries
+  off_t off = 2 * unit - 100;
+  assert(test_read("/big", 2 * unit + 200, off) == data.substr(off, 2 * unit + 200));
+  std::string patch = test_pattern(3 * unit, 2);
+  off = unit + 17;
+  test_write("/big", patch, off);
+  data.replace(off, patch.size(), patch);
+  assert(test_read("/big", data.size()) == data);
+  // the first byte of chunk 4 is the first byte of chunk 1 of piece 1
+  char c;
+  std::string obj = object_path(dentry->d_oid);
+  const char *name;
+  int dirfd = backing_dirfd(dentry_place(dentry), 1, obj, name);
+  int fd = openat(dirfd, name, O_RDONLY);
+  assert(fd != -1 && pread(fd, &c, 1, unit) == 1);
+  close(fd);
+  assert(c == data[4 * unit]);
+  test_stop();
+}
+
+int main() {
+  test_stripe_split();
+  printf("test_stripe ok\n");
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <vector>
+
+#include "test_util.h"
+#include "trace.h"
+
+// Small writes through the traced operations, enough to fill a thread
+// buffer more than once.
+static void write_traced(const char *path, int writes) {
+  struct fuse_file_info fi{};
+  fi.flags = O_WRONLY | O_CREAT;
+  assert((hfs_traced<TraceOp::CREATE, HybridFS::hfs_create>::call(path, 0644, &fi)) == 0);
+  for(int i = 0; i < writes; i++) {
+    assert((hfs_traced<TraceOp::WRITE, HybridFS::hfs_write>::call(path, "0123456789", 10, i * 10, &fi)) == 10);
+  }
+  assert((hfs_traced<TraceOp::RELEASE, HybridFS::hfs_release>::call(path, &fi)) == 0);
+}
+
+// What operations record comes back from trace_load in time order, from
+// every thread, with the names of the files.
+void test_trace_load() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->trace_path = test_dir() + "/trace";
+  test_start(meta);
+  const int writes = 3000;
+  assert((hfs_traced<TraceOp::MKDIR, HybridFS::hfs_mkdir>::call("/d", 0755)) == 0);
+  std::thread other(write_traced, "/d/u", writes);
+  write_traced("/t", writes);
+  other.join();
+  test_pin("/t", "hdd");
+  uint64_t t_oid = find_dentry("/t")->d_oid;
+  uint64_t u_oid = find_dentry("/d/u")->d_oid;
+  trace_close();
+
+  std::vector<struct hfs_trace_record> records;
+  std::vector<std::string> names;
+  assert(trace_load(meta->trace_path, records, names));
+  assert(names.size() == records.size());
+  assert(std::is_sorted(records.begin(), records.end(), [](const struct hfs_trace_record& a, const struct hfs_trace_record& b) {
+    return a.time_ns < b.time_ns;
+  }));
+  int t_writes = 0, u_writes = 0, mkdirs = 0, migrates = 0;
+  bool t_named = false;
+  for(size_t i = 0; i < records.size(); i++) {
+    const struct hfs_trace_record& r = records[i];
+    if(r.op == TraceOp::NAME && r.oid == t_oid) {
+      assert(names[i] == "/t");
+      t_named = true;
+    } else if(r.op == TraceOp::CREATE && r.oid == t_oid) {
+      // the name comes first
+      assert(t_named);
+    } else if(r.op == TraceOp::WRITE) {
+      assert(r.size == 10 && r.off % 10 == 0 && r.result == 10 && r.tier == 0);
+      r.oid == t_oid ? t_writes++ : u_writes++;
+      assert(r.oid == t_oid || r.oid == u_oid);
+    } else if(r.op == TraceOp::MKDIR) {
+      assert(r.result == 0);
+      mkdirs++;
+    } else if(r.op == TraceOp::MIGRATE) {
+      assert(r.oid == t_oid && r.tier == 1 && r.off == 0 && r.size == writes * 10);
+      migrates++;
+    }
+  }
+  assert(t_named);
+  assert(t_writes == writes && u_writes == writes);
+  assert(mkdirs == 1 && migrates == 1);
+  test_stop();
+}
+
+int main() {
+  test_trace_load();
+  printf("test_trace ok\n");
+  return 0;
+}
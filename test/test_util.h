@@ -0,0 +1,156 @@
+#ifndef _HYBRIDFS_TEST_UTIL_H
+#define _HYBRIDFS_TEST_UTIL_H
+
+// checks run in release builds too
+#undef NDEBUG
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+#include "backing.h"
+#include "hybridfs.h"
+#include "scheduler.h"
+
+// The file system run in process, without a mount: tests call the HybridFS
+// operations directly over tiers kept in a scratch directory, and look at
+// the dentries and backing objects they leave.
+
+// From hybridfs.cc.
+struct hfs_dentry* find_dentry(const char *path);
+
+static std::string test_dir() {
+  return "/tmp/hybridfs_test." + std::to_string(getpid());
+}
+
+// An ssd tier of one device over an hdd tier of hdd_devices. Files from
+// upper_limit bytes are demoted, none promoted. Tests change the fields
+// they are about before test_start.
+static struct hfs_meta* test_meta(int32_t hdd_devices, int64_t upper_limit) {
+  struct hfs_meta* meta = new hfs_meta();
+  meta->fs_path = test_dir() + "/mnt";
+  meta->root_dentry = nullptr;
+  meta->stripe_unit = 64 * 1024;
+  meta->stripe_threshold = INT64_MAX;
+  meta->io_pool_threads = 4;
+  meta->readahead_min = 128 * 1024;
+  meta->readahead_max = 1024 * 1024;
+  meta->mem_cache_size = 0;
+  meta->mem_cache_file_size = 0;
+  meta->mem_cache_admit = 2;
+  meta->pack_threshold = 0;
+  meta->pack_container_size = 1024 * 1024;
+  meta->compress = false;
+  meta->compress_block = 16 * 1024;
+  meta->compress_level = 1;
+  meta->bg_bandwidth = 0;
+  meta->bg_iops = 0;
+  meta->bg_latency_factor = 2.0;
+  meta->write_buffer_size = 0;
+  meta->write_buffer_timeout = 200;
+  meta->direct_io_size = 0;
+  meta->migrate_chunk = 64 * 1024;
+  meta->dir_cache_size = 0;
+  meta->passthrough = false;
+  meta->admit_probe = 0;
+  meta->admit_stream_rate = 0;
+  meta->dedup_min_size = 0;
+  meta->dedup_verify = true;
+  std::string hdd_paths;
+  for(int32_t i = 0; i < hdd_devices; i++) {
+    hdd_paths += (i == 0 ? "" : ",") + test_dir() + "/hdd" + std::to_string(i);
+  }
+  meta->tiers.push_back(new_tier("ssd", test_dir() + "/ssd", TierClass::SSD, 0, upper_limit, -1));
+  meta->tiers.push_back(new_tier("hdd", hdd_paths, TierClass::HDD, 0, INT64_MAX, -1));
+  return meta;
+}
+
+static void test_start(struct hfs_meta* meta) {
+  spdlog::set_level(spdlog::level::warn);
+  hfs_start(meta, nullptr);
+}
+
+static void test_stop() {
+  HybridFS::hfs_destroy(HFS_META);
+  std::filesystem::remove_all(test_dir());
+}
+
+// Bytes that tell every offset apart.
+static std::string test_pattern(int64_t size, uint32_t seed) {
+  std::string data(size, 0);
+  uint32_t x = seed * 2654435761u + 1;
+  for(int64_t i = 0; i < size; i++) {
+    x = x * 1103515245u + 12345u;
+    data[i] = (char)(x >> 16);
+  }
+  return data;
+}
+
+static void test_write(const char *path, const std::string& data, off_t off, bool create = false) {
+  struct fuse_file_info fi{};
+  fi.flags = O_WRONLY | (create ? O_CREAT : 0);
+  int state = create ? HybridFS::hfs_create(path, 0644, &fi) : HybridFS::hfs_open(path, &fi);
+  assert(state == 0);
+  assert(HybridFS::hfs_write(path, data.data(), data.size(), off, &fi) == (int)data.size());
+  assert(HybridFS::hfs_release(path, &fi) == 0);
+}
+
+static std::string test_read(const char *path, int64_t size, off_t off = 0) {
+  struct fuse_file_info fi{};
+  fi.flags = O_RDONLY;
+  assert(HybridFS::hfs_open(path, &fi) == 0);
+  std::string data(size, 0);
+  int64_t done = 0;
+  while(done < size) {
+    int n = HybridFS::hfs_read(path, &data[done], size - done, off + done, &fi);
+    assert(n >= 0);
+    if(n == 0) {
+      break;
+    }
+    done += n;
+  }
+  data.resize(done);
+  assert(HybridFS::hfs_release(path, &fi) == 0);
+  return data;
+}
+
+// Waits until the background migrations queued so far are done.
+static void test_settle() {
+  struct hfs_scheduler* s = HFS_META->scheduler;
+  while(true) {
+    {
+      std::lock_guard<std::mutex> lock(s->lock);
+      if(s->queue.empty() && s->running == nullptr) {
+        return ;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// Moves path to tier through the pin hint and waits for it.
+static void test_pin(const char *path, const char *tier) {
+  assert(HybridFS::hfs_setxattr(path, "user.hybridfs.pin", tier, strlen(tier), 0) == 0);
+  test_settle();
+}
+
+// stat of one piece of the backing object of dentry.
+static struct stat test_stat_piece(const struct hfs_dentry* dentry, int32_t piece) {
+  std::string obj = object_path(dentry->d_oid);
+  const char *name;
+  int dirfd = backing_dirfd(dentry_place(dentry), piece, obj, name);
+  struct stat st;
+  assert(fstatat(dirfd, name, &st, 0) == 0);
+  return st;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#include "write_buffer.h"
+
+#include "test_util.h"
+
+static void open_handles(const char *path, struct fuse_file_info* fis, int n) {
+  for(int i = 0; i < n; i++) {
+    fis[i] = fuse_file_info{};
+    fis[i].flags = O_WRONLY;
+    assert(HybridFS::hfs_open(path, &fis[i]) == 0);
+  }
+}
+
+// Writes several handles hold back on one file are all seen by others, and
+// dropped with the file when it goes away.
+void test_write_back() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->write_buffer_size = 64 * 1024;
+  meta->write_buffer_timeout = 1000;
+  test_start(meta);
+  const int n = 4;
+  std::string data = test_pattern(n * 4096, 1);
+  test_write("/file", std::string(data.size(), 0), 0, true);
+  struct hfs_dentry* dentry = find_dentry("/file");
+  struct fuse_file_info fis[n];
+  open_handles("/file", fis, n);
+  std::vector<std::thread> writers;
+  for(int i = 0; i < n; i++) {
+    writers.emplace_back([&, i]() {
+      for(int j = 0; j < 100; j++) {
+        int64_t off = i * 4096 + j % 4 * 1024;
+        assert(HybridFS::hfs_write("/file", &data[off], 1024, off, &fis[i]) == 1024);
+      }
+    });
+  }
+  for(std::thread& t : writers) {
+    t.join();
+  }
+  assert(dentry->d_dirty > 0);
+  assert(test_read("/file", data.size()) == data);
+  assert(dentry->d_dirty == 0);
+  for(struct fuse_file_info& fi : fis) {
+    assert(HybridFS::hfs_release("/file", &fi) == 0);
+  }
+
+  test_write("/gone", std::string(), 0, true);
+  open_handles("/gone", fis, 2);
+  assert(HybridFS::hfs_write("/gone", data.data(), 4096, 0, &fis[0]) == 4096);
+  assert(HybridFS::hfs_write("/gone", data.data(), 4096, 4096, &fis[1]) == 4096);
+  assert(find_dentry("/gone")->d_dirty == 1);
+  assert(HybridFS::hfs_unlink("/gone") == 0);
+  // the write back thread must not reach for the file past its timeout
+  std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+  {
+    std::lock_guard<std::mutex> lock(HFS_META->write_back->lock);
+    assert(HFS_META->write_back->files.empty());
+  }
+  for(int i = 0; i < 2; i++) {
+    assert(HybridFS::hfs_release("/gone", &fis[i]) == 0);
+  }
+  assert(test_read("/file", data.size()) == data);
+  test_stop();
+}
+
+// Buffered appends to a demoted compressed file keep it compressed.
+void test_compressed_append() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->write_buffer_size = 64 * 1024;
+  meta->write_buffer_timeout = 1000;
+  meta->compress = true;
+  test_start(meta);
+  std::string data(100 * 1024, 'a');
+  test_write("/log", data, 0, true);
+  test_pin("/log", "hdd");
+  struct hfs_dentry* dentry = find_dentry("/log");
+  assert(dentry->d_layout == FileLayout::COMPRESSED);
+  struct fuse_file_info fi{};
+  fi.flags = O_WRONLY;
+  assert(HybridFS::hfs_open("/log", &fi) == 0);
+  std::string more = test_pattern(2048, 2);
+  for(int i = 0; i < 2; i++) {
+    assert(HybridFS::hfs_write("/log", &more[i * 1024], 1024, data.size() + i * 1024, &fi) == 1024);
+    assert(dentry->d_layout == FileLayout::COMPRESSED);
+  }
+  assert(dentry->d_dirty == 1);
+  assert(HybridFS::hfs_release("/log", &fi) == 0);
+  data += more;
+  assert(dentry->d_layout == FileLayout::COMPRESSED);
+  assert(test_read("/log", data.size() + 1) == data);
+  test_stop();
+}
+
+// Handles released while stats write out what they hold back: the stat is
+// done with a handle before the release frees it.
+void test_release_while_flushed() {
+  struct hfs_meta* meta = test_meta(1, INT64_MAX);
+  meta->write_buffer_size = 64 * 1024;
+  meta->write_buffer_timeout = 1000;
+  test_start(meta);
+  std::string data = test_pattern(4096, 3);
+  test_write("/file", std::string(data.size(), 0), 0, true);
+  std::atomic<bool> done{false};
+  std::thread stat_thread([&]() {
+    while(!done) {
+      struct stat st;
+      assert(HybridFS::hfs_getattr("/file", &st, nullptr) == 0);
+    }
+  });
+  for(int round = 0; round < 2000; round++) {
+    struct fuse_file_info fi;
+    open_handles("/file", &fi, 1);
+    int64_t off = round % 4 * 1024;
+    assert(HybridFS::hfs_write("/file", &data[off], 1024, off, &fi) == 1024);
+    assert(HybridFS::hfs_release("/file", &fi) == 0);
+  }
+  done = true;
+  stat_thread.join();
+  assert(find_dentry("/file")->d_dirty == 0);
+  assert(test_read("/file", data.size()) == data);
+  test_stop();
+}
+
+int main() {
+  test_write_back();
+  test_compressed_append();
+  test_release_while_flushed();
+  printf("test_write_back ok\n");
+  return 0;
+}